@@ -12,6 +12,8 @@
 #include "blobwatch.h"
 #include "debug.h"
 #include "flicker.h"
+#include "log-ring.h"
+#include "trace.h"
 
 struct leds;
 
@@ -354,15 +356,17 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 
 		if (b->track_index >= 0 &&
 		    ob->tracked[b->track_index] != i + 1) {
-			printf("Inconsistency! %d != %d\n",
-			       ob->tracked[b->track_index], i + 1);
+			ouvrt_log("Inconsistency! %d != %d\n",
+				  ob->tracked[b->track_index], i + 1);
 		}
 	}
 
 	if (rift_flicker) {
 		/* Identify blobs by their blinking pattern */
+		OUVRT_TRACE(flicker_start, ob->num_blobs, led_pattern_phase);
 		flicker_process(ob->blobs, ob->num_blobs, led_pattern_phase,
 				leds);
+		OUVRT_TRACE(flicker_end, ob->num_blobs, led_pattern_phase);
 	}
 
 	/* Return observed blobs */
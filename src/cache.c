@@ -0,0 +1,157 @@
+/*
+ * Persistent cache files
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+static bool cache_read_only;
+
+/*
+ * Disables all writes to the cache directory, for example while replaying
+ * a recording of a different setup.
+ */
+void cache_set_read_only(bool read_only)
+{
+	cache_read_only = read_only;
+}
+
+bool cache_is_read_only(void)
+{
+	return cache_read_only;
+}
+
+/*
+ * Returns the full path of the named file in the ouvrt cache directory,
+ * usually ~/.cache/ouvrt, creating the directory if necessary. The caller
+ * must free the returned string.
+ */
+gchar *cache_get_filename(const char *name)
+{
+	gchar *dir, *filename;
+
+	dir = g_build_filename(g_get_user_cache_dir(), "ouvrt", NULL);
+	if (g_mkdir_with_parents(dir, 0700) < 0) {
+		g_print("Cache: Failed to create %s: %s\n", dir,
+			strerror(errno));
+	}
+
+	filename = g_build_filename(dir, name, NULL);
+	g_free(dir);
+
+	return filename;
+}
+
+/*
+ * Reads the named file from the cache directory. Returns TRUE on success,
+ * the caller must free the returned contents.
+ */
+gboolean cache_read(const char *name, gchar **contents, gsize *length)
+{
+	gchar *filename;
+	gboolean ret;
+
+	filename = cache_get_filename(name);
+	ret = g_file_get_contents(filename, contents, length, NULL);
+	g_free(filename);
+
+	return ret;
+}
+
+/*
+ * Atomically replaces the named file in the cache directory, unless the
+ * cache is read-only.
+ */
+void cache_write(const char *name, const void *contents, gsize length)
+{
+	GError *error = NULL;
+	gchar *filename;
+
+	if (cache_read_only)
+		return;
+
+	filename = cache_get_filename(name);
+	if (!g_file_set_contents(filename, contents, length, &error)) {
+		g_print("Cache: Failed to write %s: %s\n", filename,
+			error->message);
+		g_error_free(error);
+	}
+	g_free(filename);
+}
+
+/*
+ * Maps the named binary cache file into memory if its header matches the
+ * given magic and version. The payload is valid until cache_unmap().
+ */
+gboolean cache_map(const char *name, uint32_t magic, uint32_t version,
+		   struct cache_mapping *map)
+{
+	const struct cache_header *header;
+	gchar *filename;
+	struct stat st;
+	void *addr;
+	int fd;
+
+	filename = cache_get_filename(name);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	g_free(filename);
+	if (fd < 0)
+		return FALSE;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return FALSE;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return FALSE;
+
+	header = addr;
+	if (header->magic != magic || header->version != version ||
+	    header->size != st.st_size - sizeof(*header)) {
+		munmap(addr, st.st_size);
+		return FALSE;
+	}
+
+	map->addr = addr;
+	map->length = st.st_size;
+	map->data = header + 1;
+	map->size = header->size;
+
+	return TRUE;
+}
+
+void cache_unmap(struct cache_mapping *map)
+{
+	munmap(map->addr, map->length);
+	memset(map, 0, sizeof(*map));
+}
+
+/*
+ * Writes the payload with a binary cache file header.
+ */
+void cache_write_binary(const char *name, uint32_t magic, uint32_t version,
+			const void *data, gsize size)
+{
+	struct cache_header *header;
+
+	header = g_malloc(sizeof(*header) + size);
+	header->magic = magic;
+	header->version = version;
+	header->size = size;
+	memcpy(header + 1, data, size);
+
+	cache_write(name, header, sizeof(*header) + size);
+
+	g_free(header);
+}
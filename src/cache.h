@@ -0,0 +1,43 @@
+/*
+ * Persistent cache files
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary cache files start with a header identifying the payload layout.
+ * The version must be increased whenever the layout changes.
+ */
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+};
+
+struct cache_mapping {
+	void *addr;
+	gsize length;
+	const void *data;
+	gsize size;
+};
+
+void cache_set_read_only(bool read_only);
+bool cache_is_read_only(void);
+
+gchar *cache_get_filename(const char *name);
+gboolean cache_read(const char *name, gchar **contents, gsize *length);
+void cache_write(const char *name, const void *contents, gsize length);
+
+gboolean cache_map(const char *name, uint32_t magic, uint32_t version,
+		   struct cache_mapping *map);
+void cache_unmap(struct cache_mapping *map);
+void cache_write_binary(const char *name, uint32_t magic, uint32_t version,
+			const void *data, gsize size);
+
+#endif /* __CACHE_H__ */
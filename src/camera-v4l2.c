@@ -15,13 +15,27 @@
 
 #include "camera-v4l2.h"
 #include "debug.h"
+#include "latency.h"
+#include "recorder.h"
+#include "trace.h"
 #include "tracker.h"
 
+#define V4L2_DEFAULT_BUFFERS	4
+#define V4L2_MAX_BUFFERS	VIDEO_MAX_FRAME
+
+struct v4l2_mapping {
+	void *start;
+	size_t length;
+	uint32_t offset;
+};
+
 struct _OuvrtCameraV4L2Private {
-	uint32_t offset[3];
-	void *buf[3];
+	unsigned int num_buffers;
+	struct v4l2_mapping *buf;
 };
 
+static unsigned int default_num_buffers = V4L2_DEFAULT_BUFFERS;
+
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtCameraV4L2, ouvrt_camera_v4l2,
 			   OUVRT_TYPE_CAMERA)
 
@@ -62,6 +76,22 @@ static int ouvrt_camera_v4l2_open(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Unmaps and frees all capture buffers.
+ */
+static void ouvrt_camera_v4l2_free_buffers(OuvrtCameraV4L2Private *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_buffers; i++) {
+		if (priv->buf[i].start)
+			munmap(priv->buf[i].start, priv->buf[i].length);
+	}
+	free(priv->buf);
+	priv->buf = NULL;
+	priv->num_buffers = 0;
+}
+
 /*
  * Requests buffers and starts streaming.
  *
@@ -93,7 +123,7 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		}
 	};
 	struct v4l2_requestbuffers reqbufs = {
-		.count = 3,
+		.count = v4l2->num_buffers,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 		.memory = V4L2_MEMORY_MMAP,
 	};
@@ -119,18 +149,24 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	if (ret < 0)
 		g_print("v4l2: S_PARM error: %d\n", errno);
 
-	if (1 /* DEBUG */) {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		camera->sizeimage += sizeof(struct ouvrt_debug_attachment);
-	}
-
 	ret = ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
-	if (ret < 0)
+	if (ret < 0) {
 		g_print("v4l2: REQBUFS error: %d\n", errno);
-	if (reqbufs.count > 3) {
+		return ret;
+	}
+	if (reqbufs.count == 0 || reqbufs.count > V4L2_MAX_BUFFERS) {
 		g_print("v4l2: REQBUFS error: %d buffers\n", reqbufs.count);
 		return -1;
 	}
+	if (reqbufs.count != v4l2->num_buffers) {
+		g_print("v4l2: Requested %d buffers, got %d\n",
+			v4l2->num_buffers, reqbufs.count);
+	}
+
+	priv->buf = calloc(reqbufs.count, sizeof(*priv->buf));
+	if (!priv->buf)
+		return -ENOMEM;
+	priv->num_buffers = reqbufs.count;
 
 	g_print("v4l2: %dx%d %4.4s %d Hz, %d buffers à %d bytes\n",
 		format.fmt.pix.width, format.fmt.pix.height,
@@ -140,24 +176,29 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		reqbufs.count, format.fmt.pix.sizeimage);
 
 	for (i = 0; i < reqbufs.count; i++) {
-		struct v4l2_buffer buf;
+		struct v4l2_buffer buf = {
+			.index = i,
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
 
-		buf.index = i;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		ret = ioctl(fd, VIDIOC_QUERYBUF, &buf);
-		if (ret < 0)
-			g_print("v4l2: QUERYBUF error\n");
-
-		if (reqbufs.memory == V4L2_MEMORY_MMAP) {
-			priv->buf[i] = mmap(NULL, camera->sizeimage,
-					    PROT_READ | PROT_WRITE,
-					    MAP_SHARED, dev->fd,
-					    buf.m.offset);
-			priv->offset[i] = buf.m.offset;
-		} else if (reqbufs.memory == V4L2_MEMORY_USERPTR) {
-			priv->buf[i] = malloc(camera->sizeimage);
-			buf.m.userptr = (unsigned long)priv->buf[i];
+		if (ret < 0) {
+			g_print("v4l2: QUERYBUF error: %d\n", errno);
+			goto err_free;
+		}
+
+		priv->buf[i].start = mmap(NULL, buf.length,
+					  PROT_READ | PROT_WRITE, MAP_SHARED,
+					  fd, buf.m.offset);
+		if (priv->buf[i].start == MAP_FAILED) {
+			g_print("v4l2: mmap error: %d\n", errno);
+			priv->buf[i].start = NULL;
+			ret = -1;
+			goto err_free;
 		}
+		priv->buf[i].length = buf.length;
+		priv->buf[i].offset = buf.m.offset;
 
 		ret = ioctl(fd, VIDIOC_QBUF, &buf);
 		if (ret < 0)
@@ -167,8 +208,7 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	ret = ioctl(fd, VIDIOC_STREAMON, &format.type);
 	if (ret < 0) {
 		g_print("v4l2: STREAMON error\n");
-		reqbufs.count = 0;
-		ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
+		goto err_free;
 	}
 
 	g_print("v4l2: Started streaming\n");
@@ -186,6 +226,12 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	camera->debug = debug_stream_new(&desc);
 
 	return ret;
+
+err_free:
+	ouvrt_camera_v4l2_free_buffers(priv);
+	reqbufs.count = 0;
+	ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
+	return ret;
 }
 
 /*
@@ -227,7 +273,7 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 	int ret;
 
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = priv->offset[1] ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+	buf.memory = V4L2_MEMORY_MMAP;
 
 	pfd.fd = dev->fd;
 	pfd.events = POLLIN;
@@ -257,17 +303,11 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 		timestamps[0] = buf.timestamp.tv_sec + 1e-6 * buf.timestamp.tv_usec;
 		timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
-		if (buf.memory == V4L2_MEMORY_MMAP) {
-			raw = priv->buf[buf.index];
-			if (buf.m.offset != priv->offset[buf.index])
-				raw = NULL;
-		} else if (buf.memory == V4L2_MEMORY_USERPTR) {
-			raw = (void *)buf.m.userptr;
-			if (raw != priv->buf[buf.index])
-				raw = NULL;
-		} else {
+		if (buf.index < priv->num_buffers &&
+		    buf.m.offset == priv->buf[buf.index].offset)
+			raw = priv->buf[buf.index].start;
+		else
 			raw = NULL;
-		}
 		if (!raw) {
 			g_print("v4l2: DQBUF error: %d, disabling camera\n",
 				errno);
@@ -286,39 +326,82 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 		 * available, using the LED blinking pattern.
 		 */
 		struct blobservation *ob = NULL;
-		if (camera->tracker) {
-			uint64_t sof_time = buf.timestamp.tv_sec * 1000000000 +
-					    buf.timestamp.tv_usec * 1000;
+		uint64_t sof_time = buf.timestamp.tv_sec * 1000000000 +
+				    buf.timestamp.tv_usec * 1000;
 
+		OUVRT_TRACE(frame_dequeue, dev->id, buf.sequence, sof_time);
+
+		if (recorder_record_frames()) {
+			struct recorder_frame frame = {
+				.sequence = buf.sequence,
+				.width = width,
+				.height = height,
+			};
+
+			recorder_write(dev->rec, RECORDER_EVENT_FRAME,
+				       sof_time, &frame, sizeof(frame), raw,
+				       width * height);
+		}
+
+		if (camera->tracker) {
+			OUVRT_TRACE(blob_detect_start, dev->id, sof_time);
 			ouvrt_tracker_process_frame(camera->tracker,
 						    raw, width, height,
 						    sof_time, &ob);
+			OUVRT_TRACE(blob_detect_end, dev->id, sof_time,
+				    ob ? ob->num_blobs : 0);
+		}
+
+		if (ob) {
+			struct recorder_blobs blobs = {
+				.sequence = buf.sequence,
+				.num_blobs = ob->num_blobs,
+			};
+
+			recorder_write(dev->rec, RECORDER_EVENT_BLOBS,
+				       sof_time, &blobs, sizeof(blobs),
+				       ob->blobs,
+				       ob->num_blobs * sizeof(struct blob));
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
 		timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+		if (camera->tracker) {
+			latency_record(dev->id, LATENCY_CAPTURE_TO_DETECT,
+				       tp.tv_sec * 1000000000ULL + tp.tv_nsec -
+				       sof_time);
+		}
+
 		if (ob && camera->tracker) {
 			/*
 			 * If we got an observation, calculate the pose from
 			 * blob detector output, intrinsic camera parameters,
 			 * and the known LED positions.
 			 */
+			OUVRT_TRACE(pnp_start, dev->id, sof_time,
+				    ob->num_blobs);
 			ouvrt_tracker_process_blobs(camera->tracker, ob->blobs,
 						    ob->num_blobs,
 						    &camera->camera_matrix,
 						    camera->dist_coeffs,
 						    &rot, &trans);
+			OUVRT_TRACE(pnp_end, dev->id, sof_time);
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &tp);
 		timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+		if (ob && camera->tracker) {
+			latency_record(dev->id, LATENCY_DETECT_TO_POSE,
+				       1e9 * (timestamps[3] - timestamps[2]));
+		}
+
 		ret = OUVRT_CAMERA_GET_CLASS(dev)->process_frame(camera, raw);
 		if (ret == 0) {
 			debug_stream_frame_push(camera->debug, raw,
-						camera->sizeimage, width * height,
-						ob, &rot, &trans, timestamps);
+						width * height, ob, &rot,
+						&trans, timestamps);
 		}
 
 		ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
@@ -346,29 +429,17 @@ static void ouvrt_camera_v4l2_stop(OuvrtDevice *dev)
 	};
 	__u32 prio = V4L2_PRIORITY_BACKGROUND;
 	int ret;
-	int i;
 
 	ret = ioctl(dev->fd, VIDIOC_S_PRIORITY, &prio);
 	if (ret < 0)
 		g_print("v4l2: S_PRIORITY error\n");
 
-	if (priv->offset[1]) {
-		for (i = 0; i < 3; i++) {
-			munmap(priv->buf[i], camera->sizeimage);
-			priv->buf[i] = NULL;
-		}
-	} else {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		for (i = 0; i < 3; i++) {
-			free(priv->buf[i]);
-			priv->buf[i] = NULL;
-		}
-	}
-
 	ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &reqbufs.type);
 	if (ret < 0 && errno != ENODEV)
 		g_print("v4l2: STREAMOFF error: %d\n", errno);
 
+	ouvrt_camera_v4l2_free_buffers(priv);
+
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &reqbufs);
 	if (ret < 0 && errno != ENODEV)
 		g_print("v4l2: REQBUFS error: %d\n", errno);
@@ -396,5 +467,23 @@ static void ouvrt_camera_v4l2_class_init(OuvrtCameraV4L2Class *klass)
  */
 static void ouvrt_camera_v4l2_init(OuvrtCameraV4L2 *self)
 {
+	self->num_buffers = default_num_buffers;
 	self->priv = ouvrt_camera_v4l2_get_instance_private(self);
+	self->priv->num_buffers = 0;
+	self->priv->buf = NULL;
+}
+
+/*
+ * Sets the number of capture buffers requested by cameras created after
+ * this call. More queued buffers allow the driver to keep capturing while
+ * frame processing occasionally takes longer than a frame period.
+ */
+int ouvrt_camera_v4l2_set_default_num_buffers(unsigned int num_buffers)
+{
+	if (num_buffers < 2 || num_buffers > V4L2_MAX_BUFFERS)
+		return -EINVAL;
+
+	default_num_buffers = num_buffers;
+
+	return 0;
 }
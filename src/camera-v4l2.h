@@ -36,6 +36,7 @@ struct _OuvrtCameraV4L2 {
 	OuvrtCamera camera;
 
 	uint32_t pixelformat;
+	unsigned int num_buffers;
 
 	OuvrtCameraV4L2Private *priv;
 };
@@ -48,4 +49,6 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(OuvrtCameraV4L2, g_object_unref)
 
 GType ouvrt_camera_v4l2_get_type(void);
 
+int ouvrt_camera_v4l2_set_default_num_buffers(unsigned int num_buffers);
+
 #endif /* __CAMERA_V4L2_H__ */
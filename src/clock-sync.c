@@ -0,0 +1,207 @@
+/*
+ * Device to host clock synchronization
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock-sync.h"
+
+/* Length of device time over which the lowest offset is collected, in ns */
+#define CLOCK_SYNC_BUCKET_LENGTH	1e9
+/* Maximum accepted relative frequency error between device and host */
+#define CLOCK_SYNC_MAX_SKEW		1e-3
+
+/*
+ * Initializes the clock synchronization state for a device counter that
+ * counts at frequency Hz and wraps around after bits bits.
+ */
+void clock_sync_init(struct clock_sync *sync, uint64_t frequency,
+		     unsigned int bits)
+{
+	memset(sync, 0, sizeof(*sync));
+	sync->frequency = frequency;
+	sync->mask = bits >= 64 ? UINT64_MAX : (1ULL << bits) - 1;
+}
+
+/*
+ * Returns the signed distance from the last seen raw timestamp to the given
+ * raw timestamp, assuming they are less than half a wraparound apart.
+ */
+static int64_t clock_sync_raw_delta(const struct clock_sync *sync,
+				    uint64_t raw)
+{
+	uint64_t delta = (raw - sync->last_raw) & sync->mask;
+
+	if (delta > sync->mask / 2)
+		return -(int64_t)((sync->last_raw - raw) & sync->mask);
+
+	return delta;
+}
+
+/*
+ * Extends a raw, wrapping device timestamp into a monotonic 64-bit tick
+ * count. Timestamps slightly older than the newest one seen so far are
+ * extended correctly, but do not move the newest timestamp backwards.
+ */
+uint64_t clock_sync_unwrap(struct clock_sync *sync, uint64_t raw)
+{
+	int64_t delta;
+
+	raw &= sync->mask;
+	if (!sync->valid) {
+		sync->valid = true;
+		sync->last_raw = raw;
+		sync->ticks = raw;
+		return raw;
+	}
+
+	delta = clock_sync_raw_delta(sync, raw);
+	if (delta < 0)
+		return sync->ticks + delta;
+
+	sync->last_raw = raw;
+	sync->ticks += delta;
+
+	return sync->ticks;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double median(double *values, unsigned int num)
+{
+	qsort(values, num, sizeof(*values), compare_double);
+
+	if (num % 2)
+		return values[num / 2];
+
+	return 0.5 * (values[num / 2 - 1] + values[num / 2]);
+}
+
+/*
+ * Refits the line through the lower envelope points with the Theil-Sen
+ * estimator, which tolerates buckets in which every observation was delayed.
+ */
+static void clock_sync_refit(struct clock_sync *sync)
+{
+	double values[CLOCK_SYNC_BUCKETS * (CLOCK_SYNC_BUCKETS - 1) / 2];
+	const struct clock_sync_point *a, *b;
+	unsigned int num = 0;
+	unsigned int i, j;
+	double skew;
+
+	for (i = 0; i < sync->num_points; i++) {
+		for (j = i + 1; j < sync->num_points; j++) {
+			a = &sync->points[i];
+			b = &sync->points[j];
+			if (fabs(b->device - a->device) < 0.5 *
+			    CLOCK_SYNC_BUCKET_LENGTH)
+				continue;
+			values[num++] = (b->host - a->host) /
+					(b->device - a->device) - 1.0;
+		}
+	}
+
+	if (num) {
+		skew = median(values, num);
+		if (skew > CLOCK_SYNC_MAX_SKEW)
+			skew = CLOCK_SYNC_MAX_SKEW;
+		if (skew < -CLOCK_SYNC_MAX_SKEW)
+			skew = -CLOCK_SYNC_MAX_SKEW;
+		sync->skew = skew;
+	}
+
+	for (i = 0; i < sync->num_points; i++) {
+		a = &sync->points[i];
+		values[i] = a->host - (1.0 + sync->skew) * a->device;
+	}
+	sync->offset = median(values, sync->num_points);
+}
+
+/*
+ * Adds an observation of the unwrapped device timestamp ticks, received at
+ * host time host_ns. The host time may be taken any time after the device
+ * timestamp was received, late observations just do not improve the fit.
+ */
+void clock_sync_update(struct clock_sync *sync, uint64_t ticks,
+		       uint64_t host_ns)
+{
+	struct clock_sync_point p;
+	double offset;
+
+	if (!sync->have_ref) {
+		sync->have_ref = true;
+		sync->ref_ticks = ticks;
+		sync->ref_host = host_ns;
+	}
+
+	p.device = (double)(int64_t)(ticks - sync->ref_ticks) * 1e9 /
+		   sync->frequency;
+	p.host = (double)(int64_t)(host_ns - sync->ref_host);
+
+	if (!sync->have_bucket) {
+		sync->have_bucket = true;
+		sync->bucket_start = p.device;
+		sync->bucket = p;
+	} else if (p.device - sync->bucket_start >= CLOCK_SYNC_BUCKET_LENGTH) {
+		sync->points[sync->next_point] = sync->bucket;
+		sync->next_point = (sync->next_point + 1) % CLOCK_SYNC_BUCKETS;
+		if (sync->num_points < CLOCK_SYNC_BUCKETS)
+			sync->num_points++;
+		clock_sync_refit(sync);
+
+		sync->bucket_start = p.device;
+		sync->bucket = p;
+	} else if (p.host - p.device <
+		   sync->bucket.host - sync->bucket.device) {
+		sync->bucket = p;
+	}
+
+	/*
+	 * An observation below the fitted line proves that the line is too
+	 * late, move it down immediately.
+	 */
+	offset = p.host - (1.0 + sync->skew) * p.device;
+	if (offset < sync->offset)
+		sync->offset = offset;
+}
+
+/*
+ * Converts an unwrapped device timestamp to CLOCK_MONOTONIC time in ns.
+ */
+uint64_t clock_sync_ticks_to_host(const struct clock_sync *sync,
+				  uint64_t ticks)
+{
+	double device;
+
+	if (!sync->have_ref)
+		return 0;
+
+	device = (double)(int64_t)(ticks - sync->ref_ticks) * 1e9 /
+		 sync->frequency;
+
+	return sync->ref_host +
+	       (int64_t)llround(sync->offset + (1.0 + sync->skew) * device);
+}
+
+/*
+ * Converts a raw device timestamp close to the newest one passed to
+ * clock_sync_unwrap() to CLOCK_MONOTONIC time in ns.
+ */
+uint64_t clock_sync_raw_to_host(const struct clock_sync *sync, uint64_t raw)
+{
+	if (!sync->valid)
+		return 0;
+
+	return clock_sync_ticks_to_host(sync, sync->ticks +
+					clock_sync_raw_delta(sync,
+							     raw & sync->mask));
+}
@@ -0,0 +1,74 @@
+/*
+ * Device to host clock synchronization
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __CLOCK_SYNC_H__
+#define __CLOCK_SYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CLOCK_SYNC_BUCKETS	16
+
+/*
+ * Lowest observed offset between host and device clock within one bucket
+ * of device time, both relative to the first observation, in ns.
+ */
+struct clock_sync_point {
+	double device;
+	double host;
+};
+
+/*
+ * Maps a wrapping hardware timestamp counter of a given frequency and bit
+ * width to CLOCK_MONOTONIC. Observations are pairs of device timestamps and
+ * host times at which they were received. As the transport only ever adds
+ * latency, the fit follows the lower envelope of the observed offsets.
+ */
+struct clock_sync {
+	uint64_t frequency;
+	uint64_t mask;
+
+	bool valid;
+	uint64_t last_raw;
+	uint64_t ticks;
+
+	bool have_ref;
+	uint64_t ref_ticks;
+	uint64_t ref_host;
+
+	bool have_bucket;
+	double bucket_start;
+	struct clock_sync_point bucket;
+	struct clock_sync_point points[CLOCK_SYNC_BUCKETS];
+	unsigned int num_points;
+	unsigned int next_point;
+
+	double skew;
+	double offset;
+};
+
+void clock_sync_init(struct clock_sync *sync, uint64_t frequency,
+		     unsigned int bits);
+uint64_t clock_sync_unwrap(struct clock_sync *sync, uint64_t raw);
+void clock_sync_update(struct clock_sync *sync, uint64_t ticks,
+		       uint64_t host_ns);
+uint64_t clock_sync_ticks_to_host(const struct clock_sync *sync,
+				  uint64_t ticks);
+uint64_t clock_sync_raw_to_host(const struct clock_sync *sync, uint64_t raw);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in ns.
+ */
+static inline uint64_t clock_sync_host_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* __CLOCK_SYNC_H__ */
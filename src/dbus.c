@@ -10,11 +10,26 @@
 #include "camera.h"
 #include "camera-dk2.h"
 #include "device.h"
+#include "device-registry.h"
 #include "gdbus-generated.h"
-#include "ouvrtd.h"
+#include "latency.h"
 #include "rift.h"
+#include "telemetry.h"
+#include "telemetry-ring.h"
+
+/*
+ * The bus name that created a telemetry subscription, and the watch that
+ * removes the subscription when that name vanishes from the bus.
+ */
+struct telemetry_subscriber {
+	gchar *sender;
+	guint watcher_id;
+};
 
 static GDBusObjectManagerServer *manager = NULL;
+static GHashTable *telemetry_subscribers = NULL;
+
+static void ouvrt_dbus_export_telemetry(void);
 
 /*
  * Creates the object manager when the D-Bus connection is available.
@@ -33,6 +48,8 @@ static void ouvrt_dbus_on_bus_acquired(GDBusConnection *connection,
 	/* org.freedesktop.DBus.ObjectManager */
 	manager = g_dbus_object_manager_server_new("/de/phfuenf/ouvrt");
 	g_dbus_object_manager_server_set_connection(manager, connection);
+
+	ouvrt_dbus_export_telemetry();
 }
 
 static void sender_vanished_handler(G_GNUC_UNUSED GDBusConnection *connection,
@@ -313,12 +330,248 @@ static void ouvrt_dbus_export_radio1_interface(OuvrtObjectSkeleton *object,
 	g_object_unref(radio);
 }
 
+static gboolean
+ouvrt_statistics1_on_handle_get_latencies(OuvrtStatistics1 *object,
+					  GDBusMethodInvocation *invocation,
+					  gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	struct latency_summary summary;
+	GVariantBuilder builder;
+	enum latency_stage stage;
+	GVariant *latencies;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(tttt)}"));
+	for (stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+		if (!latency_get_summary(dev->id, stage, &summary))
+			continue;
+		g_variant_builder_add(&builder, "{s(tttt)}",
+				      latency_stage_name(stage), summary.count,
+				      summary.p50, summary.p99, summary.max);
+	}
+
+	latencies = g_variant_builder_end(&builder);
+	ouvrt_statistics1_complete_get_latencies(object, invocation, latencies);
+
+	return TRUE;
+}
+
+/*
+ * Exports a Statistics1 interface via D-Bus.
+ */
+static void
+ouvrt_dbus_export_statistics1_interface(OuvrtObjectSkeleton *object,
+					OuvrtDevice *dev)
+{
+	OuvrtStatistics1 *statistics = ouvrt_statistics1_skeleton_new();
+
+	g_signal_connect(statistics, "handle-get-latencies",
+			 G_CALLBACK(ouvrt_statistics1_on_handle_get_latencies),
+			 dev);
+
+	ouvrt_object_skeleton_set_statistics1(object, statistics);
+	g_object_unref(statistics);
+}
+
+static gboolean
+ouvrt_telemetry1_on_handle_acquire(OuvrtTelemetry1 *object,
+				   GDBusMethodInvocation *invocation,
+				   GUnixFDList *fd_list,
+				   G_GNUC_UNUSED gpointer user_data)
+{
+	GError *error = NULL;
+	const gchar *sender;
+	gint index;
+	int fd;
+
+	if (fd_list != NULL) {
+		g_warning("Telemetry1.Acquire ignoring received fd list\n");
+		g_object_unref(fd_list);
+	}
+
+	fd = telemetry_ring_get_fd();
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error(invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+			"Telemetry ring not available");
+		return TRUE;
+	}
+
+	sender = g_dbus_method_invocation_get_sender(invocation);
+
+	g_print("Telemetry1 ring acquired by %s\n", sender);
+
+	fd_list = g_unix_fd_list_new();
+	index = g_unix_fd_list_append(fd_list, fd, &error);
+	if (index < 0) {
+		g_dbus_method_invocation_return_gerror(invocation, error);
+		g_error_free(error);
+		g_object_unref(fd_list);
+		return TRUE;
+	}
+
+	ouvrt_telemetry1_complete_acquire(object, invocation, fd_list,
+					  g_variant_new_handle(index));
+	g_object_unref(fd_list);
+
+	return TRUE;
+}
+
+/*
+ * Drops a telemetry subscription and stops watching its sender.
+ */
+static void telemetry_subscriber_free(gpointer data)
+{
+	struct telemetry_subscriber *subscriber = data;
+
+	g_bus_unwatch_name(subscriber->watcher_id);
+	g_free(subscriber->sender);
+	g_free(subscriber);
+}
+
+static void
+telemetry_subscriber_vanished(G_GNUC_UNUSED GDBusConnection *connection,
+			      const gchar *name, gpointer user_data)
+{
+	guint id = GPOINTER_TO_UINT(user_data);
+
+	g_print("Telemetry1 subscription %u dropped, %s left the bus\n", id,
+		name);
+
+	telemetry_unsubscribe(id);
+	g_hash_table_remove(telemetry_subscribers, user_data);
+}
+
+static gboolean
+ouvrt_telemetry1_on_handle_subscribe(OuvrtTelemetry1 *object,
+				     GDBusMethodInvocation *invocation,
+				     guint device_id, guint types, gdouble rate,
+				     G_GNUC_UNUSED gpointer user_data)
+{
+	struct telemetry_subscriber *subscriber;
+	const gchar *sender;
+	int dev_id;
+	guint id;
+
+	if (device_id == G_MAXUINT32) {
+		dev_id = TELEMETRY_ALL_DEVICES;
+	} else if (device_id <= G_MAXUINT8) {
+		dev_id = device_id;
+	} else {
+		g_dbus_method_invocation_return_error(invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Invalid device id %u", device_id);
+		return TRUE;
+	}
+
+	if (!(rate >= 0.0)) {
+		g_dbus_method_invocation_return_error(invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Invalid rate %f", rate);
+		return TRUE;
+	}
+
+	sender = g_dbus_method_invocation_get_sender(invocation);
+
+	id = telemetry_subscribe(dev_id, types, rate);
+
+	g_print("Telemetry1 subscription %u by %s: device %d, types 0x%x, rate %.1f Hz\n",
+		id, sender, dev_id, types, rate);
+
+	subscriber = g_new0(struct telemetry_subscriber, 1);
+	subscriber->sender = g_strdup(sender);
+	g_hash_table_insert(telemetry_subscribers, GUINT_TO_POINTER(id),
+			    subscriber);
+	subscriber->watcher_id = g_bus_watch_name(G_BUS_TYPE_SESSION, sender,
+					G_BUS_NAME_WATCHER_FLAGS_NONE,
+					NULL, /* name_appeared_handler */
+					telemetry_subscriber_vanished,
+					GUINT_TO_POINTER(id),
+					NULL); /* user_data_free_func */
+
+	ouvrt_telemetry1_complete_subscribe(object, invocation, id);
+
+	return TRUE;
+}
+
+static gboolean
+ouvrt_telemetry1_on_handle_unsubscribe(OuvrtTelemetry1 *object,
+				       GDBusMethodInvocation *invocation,
+				       guint id,
+				       G_GNUC_UNUSED gpointer user_data)
+{
+	struct telemetry_subscriber *subscriber;
+	const gchar *sender;
+
+	sender = g_dbus_method_invocation_get_sender(invocation);
+
+	subscriber = g_hash_table_lookup(telemetry_subscribers,
+					 GUINT_TO_POINTER(id));
+	if (!subscriber || g_strcmp0(subscriber->sender, sender) != 0) {
+		g_dbus_method_invocation_return_error(invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"Unknown subscription %u", id);
+		return TRUE;
+	}
+
+	g_print("Telemetry1 subscription %u removed by %s\n", id, sender);
+
+	telemetry_unsubscribe(id);
+	g_hash_table_remove(telemetry_subscribers, GUINT_TO_POINTER(id));
+
+	ouvrt_telemetry1_complete_unsubscribe(object, invocation);
+
+	return TRUE;
+}
+
+/*
+ * Exports the Telemetry1 interface via D-Bus.
+ */
+static void ouvrt_dbus_export_telemetry(void)
+{
+	OuvrtObjectSkeleton *object;
+	OuvrtTelemetry1 *telemetry;
+
+	if (telemetry_ring_get_fd() < 0)
+		return;
+
+	telemetry_subscribers = g_hash_table_new_full(g_direct_hash,
+						      g_direct_equal, NULL,
+						      telemetry_subscriber_free);
+
+	object = ouvrt_object_skeleton_new("/de/phfuenf/ouvrt/telemetry");
+	telemetry = ouvrt_telemetry1_skeleton_new();
+
+	ouvrt_telemetry1_set_size(telemetry, telemetry_ring_size());
+	ouvrt_telemetry1_set_slot_size(telemetry, TELEMETRY_RING_SLOT_SIZE);
+	ouvrt_telemetry1_set_num_slots(telemetry, TELEMETRY_RING_NUM_SLOTS);
+
+	g_signal_connect(telemetry, "handle-acquire",
+			 G_CALLBACK(ouvrt_telemetry1_on_handle_acquire), NULL);
+	g_signal_connect(telemetry, "handle-subscribe",
+			 G_CALLBACK(ouvrt_telemetry1_on_handle_subscribe), NULL);
+	g_signal_connect(telemetry, "handle-unsubscribe",
+			 G_CALLBACK(ouvrt_telemetry1_on_handle_unsubscribe),
+			 NULL);
+
+	ouvrt_object_skeleton_set_telemetry1(object, telemetry);
+	g_object_unref(telemetry);
+
+	g_dbus_object_manager_server_export(manager,
+					    G_DBUS_OBJECT_SKELETON(object));
+	g_object_unref(object);
+}
+
 void ouvrt_dbus_export_device(OuvrtDevice *dev)
 {
 	gchar *object_path;
 	OuvrtObjectSkeleton *object;
 
-	if (!manager)
+	if (!manager || !dev->active)
+		return;
+
+	/* Devices started before the name was acquired are already exported */
+	if (g_object_get_data(G_OBJECT(dev), "ouvrt-dbus-object-path"))
 		return;
 
 	object_path = g_strdup_printf("/de/phfuenf/ouvrt/dev_%lu", dev->id);
@@ -341,23 +594,35 @@ void ouvrt_dbus_export_device(OuvrtDevice *dev)
 		ouvrt_dbus_export_camera1_interface(object, dev);
 	}
 
+	/* Export a Statistics1 interface */
+	ouvrt_dbus_export_statistics1_interface(object, dev);
+
 	g_dbus_object_manager_server_export(manager,
 					    G_DBUS_OBJECT_SKELETON(object));
 	g_object_unref(object);
-	g_free(object_path);
+	g_object_set_data_full(G_OBJECT(dev), "ouvrt-dbus-object-path",
+			       object_path, g_free);
 }
 
+/*
+ * Unexports the device if it was exported. Devices that are still starting
+ * or failed to start have not been exported yet.
+ */
 void ouvrt_dbus_unexport_device(OuvrtDevice *dev)
 {
-	gchar *object_path =
-		g_strdup_printf("/de/phfuenf/ouvrt/dev_%lu", dev->id);
+	const gchar *object_path;
+
+	object_path = g_object_get_data(G_OBJECT(dev),
+					"ouvrt-dbus-object-path");
+	if (!object_path)
+		return;
 
 	if (manager) {
 		g_print("D-Bus: Unexporting %s\n", object_path);
 		g_dbus_object_manager_server_unexport(manager, object_path);
 	}
 
-	g_free(object_path);
+	g_object_set_data(G_OBJECT(dev), "ouvrt-dbus-object-path", NULL);
 }
 
 static void __ouvrt_dbus_export_device(gpointer data,
@@ -374,10 +639,14 @@ static void
 ouvrt_dbus_on_name_acquired(GDBusConnection *connection G_GNUC_UNUSED,
 			    const gchar *name, gpointer user_data)
 {
+	GPtrArray *devices;
+
 	g_print("ouvrtd: Acquired name \"%s\"\n", name);
 
 	/* Now we are ready to serve our objects */
-	g_list_foreach(device_list, __ouvrt_dbus_export_device, user_data);
+	devices = device_registry_snapshot();
+	g_ptr_array_foreach(devices, __ouvrt_dbus_export_device, user_data);
+	g_ptr_array_unref(devices);
 }
 
 /*
@@ -126,11 +126,13 @@ struct debug_stream *debug_stream_unref(struct debug_stream *gst)
 
 /*
  * Allocates a GstBuffer that wraps the frame and pushes it into the
- * GStreamer pipeline.
+ * GStreamer pipeline. If timestamps are given, the debug attachment is
+ * filled into a separate side buffer that is appended to the frame memory,
+ * so that the capture buffer does not need to reserve space for it.
  */
 void debug_stream_frame_push(struct debug_stream *gst, void *src, size_t size,
-			     size_t attach_offset, struct blobservation *ob,
-			     dquat *rot, dvec3 *trans, double timestamps[3])
+			     struct blobservation *ob, dquat *rot, dvec3 *trans,
+			     double timestamps[4])
 {
 	struct ouvrt_debug_attachment *attach;
 	unsigned int num;
@@ -140,31 +142,35 @@ void debug_stream_frame_push(struct debug_stream *gst, void *src, size_t size,
 	if (!gst->connected)
 		return;
 
-	if (ob) {
-		attach = (struct ouvrt_debug_attachment *)
-			 ((char *)src + attach_offset);
+	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src,
+					  size, 0, size, NULL, NULL);
+	if (!buf)
+		return;
 
-		/* Copy blobs and flicker history */
-		memcpy(&attach->blobservation, ob, sizeof(*ob));
+	if (timestamps) {
+		attach = g_malloc0(sizeof(*attach));
 
-		/* Copy rotation and translation */
-		memcpy(&attach->rot, rot, sizeof(dquat));
-		memcpy(&attach->trans, trans, sizeof(dvec3));
+		if (ob) {
+			/* Copy blobs and flicker history */
+			memcpy(&attach->blobservation, ob, sizeof(*ob));
 
-		/* Copy raw IMU sensor readings */
-		num = debug_imu_fifo_out(attach->imu_samples, 32);
-		attach->num_imu_samples = num;
+			/* Copy rotation and translation */
+			memcpy(&attach->rot, rot, sizeof(dquat));
+			memcpy(&attach->trans, trans, sizeof(dvec3));
 
-		if (timestamps) {
-			memcpy(attach->timestamps, timestamps,
-			       4 * sizeof(double));
+			/* Copy raw IMU sensor readings */
+			num = debug_imu_fifo_out(attach->imu_samples, 32);
+			attach->num_imu_samples = num;
 		}
-	}
 
-	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src,
-					  size, 0, size, NULL, NULL);
-	if (!buf)
-		return;
+		memcpy(attach->timestamps, timestamps, 4 * sizeof(double));
+
+		gst_buffer_append_memory(buf,
+			gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
+					       attach, sizeof(*attach), 0,
+					       sizeof(*attach), attach,
+					       g_free));
+	}
 
 //	GST_BUFFER_TIMESTAMP(buffer) = ...
 //	GST_BUFFER_DURATION(buffer) = ...
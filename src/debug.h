@@ -56,9 +56,9 @@ void debug_stream_init(int *argc, char **argv[]);
 struct debug_stream *debug_stream_new(const struct debug_stream_desc *desc);
 struct debug_stream *debug_stream_unref(struct debug_stream *stream);
 void debug_stream_frame_push(struct debug_stream *stream,
-			     void *frame, size_t size, size_t attach_offset,
+			     void *frame, size_t size,
 			     struct blobservation *ob, dquat *rot,
-			     dvec3 *trans, double timestamps[3]);
+			     dvec3 *trans, double timestamps[4]);
 void debug_stream_deinit(void);
 #else
 static inline void debug_stream_init(int *argc, char **argv[])
@@ -77,9 +77,8 @@ static inline struct debug_stream *debug_stream_unref(struct debug_stream *s)
 
 static inline void debug_stream_frame_push(struct debug_stream *stream,
 					   void *frame, size_t size,
-					   size_t attach_offset,
 					   struct blobservation *ob, dquat *rot,
-					   dvec3 *trans, double timestamps[3])
+					   dvec3 *trans, double timestamps[4])
 {
 }
 
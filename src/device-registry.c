@@ -0,0 +1,298 @@
+/*
+ * Registry of present devices
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <glib.h>
+
+#include "device-registry.h"
+
+/*
+ * Registered devices are indexed by all of their device nodes, by serial
+ * number, and by the devpath of their parent USB device. Serial numbers and
+ * parent devpaths can be shared by multiple devices, for example the Rift
+ * DK2 and its tracking camera report the same serial number. The index keys
+ * are copied on registration, so that devices can be removed from all
+ * indices even if their fields change in the meantime.
+ */
+struct device_registry_entry {
+	OuvrtDevice *dev;
+	GList *link;
+	GPtrArray *devnodes;
+	char *serial;
+	char *parent_devpath;
+};
+
+static GMutex registry_mutex;
+static GQueue devices = G_QUEUE_INIT;
+static GHashTable *entries;
+static GHashTable *devnode_index;
+static GHashTable *serial_index;
+static GHashTable *parent_index;
+static GHashTable *serial_to_id_table;
+
+static void device_registry_init(void)
+{
+	if (entries)
+		return;
+
+	entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+	devnode_index = g_hash_table_new(g_str_hash, g_str_equal);
+	serial_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     NULL);
+	parent_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     NULL);
+	serial_to_id_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+						   g_free, NULL);
+}
+
+/*
+ * Adds the device to the list of devices stored under key in a multi-valued
+ * index.
+ */
+static void device_index_add(GHashTable *index, const char *key,
+			     OuvrtDevice *dev)
+{
+	GList *list;
+
+	if (!key)
+		return;
+
+	list = g_hash_table_lookup(index, key);
+	list = g_list_append(list, dev);
+	g_hash_table_replace(index, g_strdup(key), list);
+}
+
+static void device_index_remove(GHashTable *index, const char *key,
+				OuvrtDevice *dev)
+{
+	GList *list;
+
+	if (!key)
+		return;
+
+	list = g_hash_table_lookup(index, key);
+	list = g_list_remove(list, dev);
+	if (list)
+		g_hash_table_replace(index, g_strdup(key), list);
+	else
+		g_hash_table_remove(index, key);
+}
+
+static OuvrtDevice *device_index_lookup(GHashTable *index, const char *key)
+{
+	GList *list;
+
+	if (!key)
+		return NULL;
+
+	list = g_hash_table_lookup(index, key);
+
+	return list ? g_object_ref(list->data) : NULL;
+}
+
+static void device_registry_index_devnode(struct device_registry_entry *entry,
+					  const char *devnode)
+{
+	char *key;
+
+	if (!devnode || g_hash_table_contains(devnode_index, devnode))
+		return;
+
+	key = g_strdup(devnode);
+	g_ptr_array_add(entry->devnodes, key);
+	g_hash_table_insert(devnode_index, key, entry);
+}
+
+/*
+ * Registers a device with all its device nodes, its serial number, and its
+ * parent devpath. The registry holds a reference to the device until it is
+ * removed.
+ */
+void device_registry_add(OuvrtDevice *dev)
+{
+	struct device_registry_entry *entry;
+	int i;
+
+	g_mutex_lock(&registry_mutex);
+
+	device_registry_init();
+
+	if (g_hash_table_contains(entries, dev)) {
+		g_mutex_unlock(&registry_mutex);
+		return;
+	}
+
+	entry = g_new0(struct device_registry_entry, 1);
+	entry->dev = g_object_ref(dev);
+	entry->devnodes = g_ptr_array_new_with_free_func(g_free);
+	entry->serial = g_strdup(dev->serial);
+	entry->parent_devpath = g_strdup(dev->parent_devpath);
+
+	g_queue_push_tail(&devices, dev);
+	entry->link = devices.tail;
+	g_hash_table_insert(entries, dev, entry);
+
+	for (i = 0; i < 3; i++)
+		device_registry_index_devnode(entry, dev->devnodes[i]);
+	device_index_add(serial_index, entry->serial, dev);
+	device_index_add(parent_index, entry->parent_devpath, dev);
+
+	g_mutex_unlock(&registry_mutex);
+}
+
+/*
+ * Adds another device node to an already registered multi-interface device.
+ */
+void device_registry_add_devnode(OuvrtDevice *dev, const char *devnode)
+{
+	struct device_registry_entry *entry;
+
+	g_mutex_lock(&registry_mutex);
+
+	device_registry_init();
+
+	entry = g_hash_table_lookup(entries, dev);
+	if (entry)
+		device_registry_index_devnode(entry, devnode);
+
+	g_mutex_unlock(&registry_mutex);
+}
+
+/*
+ * Removes the device that owns the given device node from all indices.
+ * Returns the registry's reference to the device, or NULL if no device
+ * owns this device node.
+ */
+OuvrtDevice *device_registry_remove_devnode(const char *devnode)
+{
+	struct device_registry_entry *entry;
+	OuvrtDevice *dev = NULL;
+	unsigned int i;
+
+	if (!devnode)
+		return NULL;
+
+	g_mutex_lock(&registry_mutex);
+
+	device_registry_init();
+
+	entry = g_hash_table_lookup(devnode_index, devnode);
+	if (entry) {
+		dev = entry->dev;
+
+		for (i = 0; i < entry->devnodes->len; i++)
+			g_hash_table_remove(devnode_index,
+					    entry->devnodes->pdata[i]);
+		device_index_remove(serial_index, entry->serial, dev);
+		device_index_remove(parent_index, entry->parent_devpath, dev);
+		g_queue_delete_link(&devices, entry->link);
+		g_hash_table_remove(entries, dev);
+
+		g_ptr_array_free(entry->devnodes, TRUE);
+		g_free(entry->serial);
+		g_free(entry->parent_devpath);
+		g_free(entry);
+	}
+
+	g_mutex_unlock(&registry_mutex);
+
+	return dev;
+}
+
+/*
+ * Returns whether the device is still registered.
+ */
+gboolean device_registry_contains(OuvrtDevice *dev)
+{
+	gboolean ret;
+
+	g_mutex_lock(&registry_mutex);
+	ret = entries && g_hash_table_contains(entries, dev);
+	g_mutex_unlock(&registry_mutex);
+
+	return ret;
+}
+
+/*
+ * Returns a new reference to the first registered device with the given
+ * serial number, or NULL.
+ */
+OuvrtDevice *device_registry_lookup_serial(const char *serial)
+{
+	OuvrtDevice *dev;
+
+	g_mutex_lock(&registry_mutex);
+	device_registry_init();
+	dev = device_index_lookup(serial_index, serial);
+	g_mutex_unlock(&registry_mutex);
+
+	return dev;
+}
+
+/*
+ * Returns a new reference to the first registered device with the given
+ * parent devpath, or NULL.
+ */
+OuvrtDevice *device_registry_lookup_parent_devpath(const char *parent_devpath)
+{
+	OuvrtDevice *dev;
+
+	g_mutex_lock(&registry_mutex);
+	device_registry_init();
+	dev = device_index_lookup(parent_index, parent_devpath);
+	g_mutex_unlock(&registry_mutex);
+
+	return dev;
+}
+
+/*
+ * Returns an array of references to all registered devices, in order of
+ * registration. The array can be used without holding the registry lock
+ * and must be freed with g_ptr_array_unref().
+ */
+GPtrArray *device_registry_snapshot(void)
+{
+	GPtrArray *array;
+	GList *link;
+
+	g_mutex_lock(&registry_mutex);
+
+	array = g_ptr_array_new_full(devices.length, g_object_unref);
+	for (link = devices.head; link; link = link->next)
+		g_ptr_array_add(array, g_object_ref(link->data));
+
+	g_mutex_unlock(&registry_mutex);
+
+	return array;
+}
+
+/*
+ * Creates or returns an existing stable id for a given serial number. Ids
+ * are kept when devices are removed, so that replugged devices get their
+ * previous id back.
+ */
+unsigned long device_registry_claim_id(const char *serial, gboolean *new_id)
+{
+	unsigned long id;
+	gpointer value;
+
+	g_mutex_lock(&registry_mutex);
+
+	device_registry_init();
+
+	if (g_hash_table_lookup_extended(serial_to_id_table, serial, NULL,
+					 &value)) {
+		id = (unsigned long)value;
+		*new_id = FALSE;
+	} else {
+		id = g_hash_table_size(serial_to_id_table);
+		g_hash_table_insert(serial_to_id_table, g_strdup(serial),
+				    (gpointer)id);
+		*new_id = TRUE;
+	}
+
+	g_mutex_unlock(&registry_mutex);
+
+	return id;
+}
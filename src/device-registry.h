@@ -0,0 +1,25 @@
+/*
+ * Registry of present devices
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __DEVICE_REGISTRY_H__
+#define __DEVICE_REGISTRY_H__
+
+#include <glib.h>
+
+#include "device.h"
+
+void device_registry_add(OuvrtDevice *dev);
+void device_registry_add_devnode(OuvrtDevice *dev, const char *devnode);
+OuvrtDevice *device_registry_remove_devnode(const char *devnode);
+gboolean device_registry_contains(OuvrtDevice *dev);
+
+OuvrtDevice *device_registry_lookup_serial(const char *serial);
+OuvrtDevice *device_registry_lookup_parent_devpath(const char *parent_devpath);
+
+GPtrArray *device_registry_snapshot(void);
+
+unsigned long device_registry_claim_id(const char *serial, gboolean *new_id);
+
+#endif /* __DEVICE_REGISTRY_H__ */
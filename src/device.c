@@ -3,22 +3,44 @@
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier: (LGPL-2.1-or-later OR BSL-1.0)
  */
+#define _GNU_SOURCE
 #include <glib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "device.h"
+#include "device-registry.h"
+#include "recorder.h"
 
 struct _OuvrtDevicePrivate {
+	GMutex lock;
 	GThread *thread;
+	gboolean starting;
+	gboolean stopping;
+	struct device_sched_policy sched_policy;
 };
 
 G_DEFINE_ABSTRACT_TYPE_WITH_PRIVATE(OuvrtDevice, ouvrt_device, G_TYPE_OBJECT)
 
-static GHashTable *serial_to_id_table;
+static const char *device_type_names[NUM_DEVICE_TYPES] = {
+	[DEVICE_TYPE_HMD] = "hmd",
+	[DEVICE_TYPE_CAMERA] = "camera",
+	[DEVICE_TYPE_CONTROLLER] = "controller",
+};
+
+static struct device_sched_policy sched_policies[NUM_DEVICE_TYPES];
+static gint memory_locked;
+
+/* Number of start tasks queued by ouvrt_device_start_async() */
+static GMutex pending_starts_mutex;
+static GCond pending_starts_cond;
+static unsigned int num_pending_starts;
 
 /*
  * Stops the device before disposing of it
@@ -43,6 +65,7 @@ static void ouvrt_device_finalize(GObject *object)
 	free(dev->devnode);
 	free(dev->name);
 	free(dev->serial);
+	g_mutex_clear(&dev->priv->lock);
 	G_OBJECT_CLASS(ouvrt_device_parent_class)->finalize(object);
 }
 
@@ -107,7 +130,58 @@ static void ouvrt_device_init(OuvrtDevice *self)
 	self->fds[1] = -1;
 	self->fds[2] = -1;
 	self->priv = ouvrt_device_get_instance_private(self);
+	g_mutex_init(&self->priv->lock);
 	self->priv->thread = NULL;
+	self->priv->starting = FALSE;
+	self->priv->stopping = FALSE;
+	memset(&self->priv->sched_policy, 0, sizeof(self->priv->sched_policy));
+}
+
+/*
+ * Applies the scheduling policy stored by ouvrt_device_start() to the
+ * calling thread. Failures are not fatal, the thread just keeps running
+ * with the default policy.
+ */
+static void ouvrt_device_apply_sched_policy(OuvrtDevice *dev)
+{
+	const struct device_sched_policy *policy = &dev->priv->sched_policy;
+	struct sched_param param;
+	cpu_set_t cpuset;
+	int ret;
+	int i;
+
+	if (policy->mlock && g_atomic_int_compare_and_exchange(&memory_locked,
+							      0, 1)) {
+		ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+		if (ret < 0) {
+			g_print("%s: Failed to lock memory: %d (%s)\n",
+				dev->name, errno, strerror(errno));
+			g_atomic_int_set(&memory_locked, 0);
+		}
+	}
+
+	if (policy->cpu_mask) {
+		CPU_ZERO(&cpuset);
+		for (i = 0; i < 64; i++) {
+			if (policy->cpu_mask & (1ULL << i))
+				CPU_SET(i, &cpuset);
+		}
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset),
+					     &cpuset);
+		if (ret) {
+			g_print("%s: Failed to set CPU affinity: %d (%s)\n",
+				dev->name, ret, strerror(ret));
+		}
+	}
+
+	if (policy->priority > 0) {
+		param.sched_priority = policy->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret) {
+			g_print("%s: Failed to set SCHED_FIFO priority %d: %d (%s)\n",
+				dev->name, policy->priority, ret, strerror(ret));
+		}
+	}
 }
 
 /*
@@ -117,6 +191,8 @@ static gpointer device_start_routine(gpointer data)
 {
 	OuvrtDevice *dev = OUVRT_DEVICE(data);
 
+	ouvrt_device_apply_sched_policy(dev);
+
 	OUVRT_DEVICE_GET_CLASS(dev)->thread(dev);
 
 	return NULL;
@@ -127,16 +203,11 @@ static gpointer device_start_routine(gpointer data)
  */
 unsigned long ouvrt_device_claim_id(OuvrtDevice *dev, const char *serial)
 {
+	gboolean new_id;
 	unsigned long id;
 
-	if (!serial_to_id_table)
-		serial_to_id_table = g_hash_table_new(g_str_hash, g_str_equal);
-
-	if (!g_hash_table_lookup_extended(serial_to_id_table, serial, NULL,
-					  (gpointer *)&id)) {
-		id = g_hash_table_size(serial_to_id_table);
-		g_hash_table_replace(serial_to_id_table, g_strdup(serial),
-				     (gpointer)id);
+	id = device_registry_claim_id(serial, &new_id);
+	if (new_id) {
 		g_print("%s: acquired new id %lu for serial %s\n", dev->name,
 			id, serial);
 	} else {
@@ -156,39 +227,141 @@ int ouvrt_device_open(OuvrtDevice *dev)
 }
 
 /*
- * Starts the device and its worker thread.
+ * Starts the device and its worker thread. This may block for a while
+ * during device specific handshakes and configuration readout, which are
+ * done without holding the device lock, so that ouvrt_device_stop() does
+ * not have to wait for them. A device that was stopped is not started
+ * again, if the stop request arrives during the handshake, the device is
+ * stopped and closed right after it.
  */
 int ouvrt_device_start(OuvrtDevice *dev)
 {
-	int ret;
+	int ret = 0;
 
-	if (dev->active)
-		return 0;
+	g_mutex_lock(&dev->priv->lock);
+
+	if (dev->priv->stopping) {
+		ret = -ECANCELED;
+		goto out;
+	}
+
+	if (dev->active || dev->priv->starting)
+		goto out;
+
+	dev->priv->starting = TRUE;
+	g_mutex_unlock(&dev->priv->lock);
 
 	ret = ouvrt_device_open(dev);
-	if (ret < 0)
-		return ret;
+	if (ret == 0)
+		ret = OUVRT_DEVICE_GET_CLASS(dev)->start(dev);
+
+	g_mutex_lock(&dev->priv->lock);
+	dev->priv->starting = FALSE;
 
-	ret = OUVRT_DEVICE_GET_CLASS(dev)->start(dev);
 	if (ret < 0)
-		return ret;
+		goto out;
+
+	if (dev->priv->stopping) {
+		OUVRT_DEVICE_GET_CLASS(dev)->stop(dev);
+		OUVRT_DEVICE_GET_CLASS(dev)->close(dev);
+		ret = -ECANCELED;
+		goto out;
+	}
 
 	if (dev->serial)
 		dev->id = ouvrt_device_claim_id(dev, dev->serial);
 
+	if (dev->type < NUM_DEVICE_TYPES)
+		dev->priv->sched_policy = sched_policies[dev->type];
+
+	dev->rec = recorder_stream_new(dev->type, dev->id, dev->name,
+				       dev->serial);
+
 	dev->active = TRUE;
 	dev->priv->thread = g_thread_new(NULL, device_start_routine, dev);
 
-	return 0;
+out:
+	g_mutex_unlock(&dev->priv->lock);
+
+	return ret;
+}
+
+static void ouvrt_device_start_thread(GTask *task, gpointer source_object,
+				      G_GNUC_UNUSED gpointer task_data,
+				      G_GNUC_UNUSED GCancellable *cancellable)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(source_object);
+
+	g_task_return_int(task, ouvrt_device_start(dev));
+
+	g_mutex_lock(&pending_starts_mutex);
+	if (--num_pending_starts == 0)
+		g_cond_broadcast(&pending_starts_cond);
+	g_mutex_unlock(&pending_starts_mutex);
+}
+
+/*
+ * Starts the device in a thread pool worker, so that multiple devices can
+ * be brought up in parallel. The callback is called from the thread-default
+ * main context of the caller when the device is started. The task holds a
+ * reference to the device until then.
+ */
+void ouvrt_device_start_async(OuvrtDevice *dev, GAsyncReadyCallback callback,
+			      gpointer user_data)
+{
+	GTask *task;
+
+	g_mutex_lock(&pending_starts_mutex);
+	num_pending_starts++;
+	g_mutex_unlock(&pending_starts_mutex);
+
+	task = g_task_new(dev, NULL, callback, user_data);
+	g_task_set_source_tag(task, ouvrt_device_start_async);
+	g_task_run_in_thread(task, ouvrt_device_start_thread);
+	g_object_unref(task);
 }
 
 /*
- * Stops the device and its worker thread.
+ * Waits until all start tasks queued by ouvrt_device_start_async() have
+ * returned. To be called after all devices were stopped, before shared
+ * state such as the recorder or telemetry is torn down. Start tasks of
+ * stopped devices return without starting them, but a handshake that is
+ * already in progress has to finish first.
+ */
+void ouvrt_device_wait_pending_starts(void)
+{
+	g_mutex_lock(&pending_starts_mutex);
+	while (num_pending_starts)
+		g_cond_wait(&pending_starts_cond, &pending_starts_mutex);
+	g_mutex_unlock(&pending_starts_mutex);
+}
+
+/*
+ * Returns the result of ouvrt_device_start() for a device started with
+ * ouvrt_device_start_async().
+ */
+int ouvrt_device_start_finish(OuvrtDevice *dev, GAsyncResult *result)
+{
+	g_return_val_if_fail(g_task_is_valid(result, dev), -EINVAL);
+
+	return g_task_propagate_int(G_TASK(result), NULL);
+}
+
+/*
+ * Stops the device and its worker thread. The device can not be started
+ * again afterwards. If a start is in progress, this does not wait for it,
+ * the starting thread stops the device when its handshake is done.
  */
 void ouvrt_device_stop(OuvrtDevice *dev)
 {
-	if (!dev->active)
+	g_mutex_lock(&dev->priv->lock);
+
+	dev->priv->stopping = TRUE;
+
+	if (!dev->active) {
+		g_mutex_unlock(&dev->priv->lock);
 		return;
+	}
 
 	dev->active = FALSE;
 
@@ -197,6 +370,112 @@ void ouvrt_device_stop(OuvrtDevice *dev)
 
 	OUVRT_DEVICE_GET_CLASS(dev)->stop(dev);
 	OUVRT_DEVICE_GET_CLASS(dev)->close(dev);
+
+	recorder_stream_free(dev->rec);
+	dev->rec = NULL;
+
+	g_mutex_unlock(&dev->priv->lock);
+}
+
+/*
+ * Sets the scheduling policy for worker threads of all devices of the given
+ * type. It is applied to threads started after this call. Must be called
+ * from the main thread.
+ */
+void ouvrt_device_set_sched_policy(enum device_type type,
+				   const struct device_sched_policy *policy)
+{
+	if (type >= NUM_DEVICE_TYPES)
+		return;
+
+	sched_policies[type] = *policy;
+}
+
+/*
+ * Parses a CPU list such as "0,2-3" into a bit mask.
+ */
+static int parse_cpu_list(const char *list, guint64 *mask)
+{
+	unsigned long first, last;
+	char *end;
+
+	*mask = 0;
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list)
+				return -EINVAL;
+		}
+		if (first > last || last >= 64)
+			return -EINVAL;
+		for (; first <= last; first++)
+			*mask |= 1ULL << first;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+		list = end;
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a scheduling policy description of the form
+ * "type=priority[:cpulist][:mlock]", for example "hmd=60:2-3:mlock", and
+ * sets it for the given device type.
+ */
+int ouvrt_device_parse_sched_policy(const char *arg)
+{
+	struct device_sched_policy policy = { 0 };
+	char **fields;
+	enum device_type type;
+	const char *value;
+	char *end;
+	int i;
+
+	value = strchr(arg, '=');
+	if (!value)
+		return -EINVAL;
+
+	for (type = 0; type < NUM_DEVICE_TYPES; type++) {
+		if (strlen(device_type_names[type]) == (size_t)(value - arg) &&
+		    strncmp(arg, device_type_names[type], value - arg) == 0)
+			break;
+	}
+	if (type == NUM_DEVICE_TYPES)
+		return -EINVAL;
+
+	fields = g_strsplit(value + 1, ":", 0);
+	if (!fields[0])
+		goto err;
+
+	policy.priority = strtol(fields[0], &end, 10);
+	if (end == fields[0] || *end ||
+	    policy.priority < 0 ||
+	    policy.priority > sched_get_priority_max(SCHED_FIFO))
+		goto err;
+
+	for (i = 1; fields[i]; i++) {
+		if (strcmp(fields[i], "mlock") == 0)
+			policy.mlock = TRUE;
+		else if (parse_cpu_list(fields[i], &policy.cpu_mask) < 0)
+			goto err;
+	}
+	g_strfreev(fields);
+
+	ouvrt_device_set_sched_policy(type, &policy);
+
+	return 0;
+
+err:
+	g_strfreev(fields);
+	return -EINVAL;
 }
 
 void ouvrt_device_radio_start_discovery(OuvrtDevice *dev)
@@ -6,6 +6,7 @@
 #ifndef __DEVICE_H__
 #define __DEVICE_H__
 
+#include <gio/gio.h>
 #include <glib.h>
 #include <glib-object.h>
 
@@ -13,6 +14,18 @@ enum device_type {
 	DEVICE_TYPE_HMD,
 	DEVICE_TYPE_CAMERA,
 	DEVICE_TYPE_CONTROLLER,
+	NUM_DEVICE_TYPES,
+};
+
+/*
+ * Scheduling policy applied to the worker threads of all devices of a given
+ * type. A priority of 0 keeps the default SCHED_OTHER policy, an empty CPU
+ * mask keeps the inherited affinity.
+ */
+struct device_sched_policy {
+	int priority;
+	guint64 cpu_mask;
+	gboolean mlock;
 };
 
 #define OUVRT_TYPE_DEVICE		(ouvrt_device_get_type())
@@ -31,6 +44,8 @@ typedef struct _OuvrtDevice		OuvrtDevice;
 typedef struct _OuvrtDeviceClass	OuvrtDeviceClass;
 typedef struct _OuvrtDevicePrivate	OuvrtDevicePrivate;
 
+struct recorder_stream;
+
 struct _OuvrtDevice {
 	GObject parent_instance;
 
@@ -49,6 +64,7 @@ struct _OuvrtDevice {
 		int fds[3];
 	};
 	char *parent_devpath;
+	struct recorder_stream *rec;
 
 	OuvrtDevicePrivate *priv;
 };
@@ -73,9 +89,17 @@ GType ouvrt_device_get_type(void);
 unsigned long ouvrt_device_claim_id(OuvrtDevice *dev, const char *serial);
 int ouvrt_device_open(OuvrtDevice *dev);
 int ouvrt_device_start(OuvrtDevice *dev);
+void ouvrt_device_start_async(OuvrtDevice *dev, GAsyncReadyCallback callback,
+			      gpointer user_data);
+int ouvrt_device_start_finish(OuvrtDevice *dev, GAsyncResult *result);
+void ouvrt_device_wait_pending_starts(void);
 void ouvrt_device_stop(OuvrtDevice *dev);
 void ouvrt_device_close(OuvrtDevice *dev);
 
+void ouvrt_device_set_sched_policy(enum device_type type,
+				   const struct device_sched_policy *policy);
+int ouvrt_device_parse_sched_policy(const char *arg);
+
 void ouvrt_device_radio_start_discovery(OuvrtDevice *dev);
 void ouvrt_device_radio_stop_discovery(OuvrtDevice *dev);
 
@@ -0,0 +1,227 @@
+/*
+ * io_uring backend for HID input reports
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hid-uring.h"
+#include "hidraw.h"
+
+#define HID_URING_MAX_FDS	3
+#define HID_URING_REPORT_SIZE	64
+
+/*
+ * Keeps a chain of HID_REPORT_BATCH reads queued against each hidraw file
+ * descriptor. The reads in a chain are hard-linked, so each one is only
+ * started after the previous one has completed, even if that was a short
+ * read or an error. This keeps a single read per fd in flight and delivers
+ * reports in the order they arrived, while a single io_uring_enter() call
+ * reaps all reports received since the last wakeup and submits new reads.
+ * A new chain is queued when all reads of the previous one have completed.
+ *
+ * The fds are switched to blocking mode while the ring is active, since
+ * io_uring completes reads on O_NONBLOCK files with -EAGAIN.
+ */
+struct hid_uring {
+	struct io_uring ring;
+	int num_fds;
+	int fds[HID_URING_MAX_FDS];
+	int flags[HID_URING_MAX_FDS];
+	unsigned char batch[HID_URING_MAX_FDS][HID_REPORT_BATCH]
+			   [HID_URING_REPORT_SIZE];
+	int lens[HID_URING_MAX_FDS][HID_REPORT_BATCH];
+	int start[HID_URING_MAX_FDS];
+	int completed[HID_URING_MAX_FDS];
+};
+
+/*
+ * Queues a chain of reads into all report slots of the given fd.
+ */
+static int hid_uring_queue_reads(struct hid_uring *uring, int index)
+{
+	struct io_uring_sqe *sqe;
+	int slot;
+
+	for (slot = 0; slot < HID_REPORT_BATCH; slot++) {
+		sqe = io_uring_get_sqe(&uring->ring);
+		if (!sqe)
+			return -EBUSY;
+
+		io_uring_prep_read(sqe, uring->fds[index],
+				   uring->batch[index][slot],
+				   HID_URING_REPORT_SIZE, 0);
+		if (slot < HID_REPORT_BATCH - 1)
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+		sqe->user_data = (uint64_t)index << 32 | slot;
+	}
+
+	uring->start[index] = 0;
+	uring->completed[index] = 0;
+
+	return 0;
+}
+
+/*
+ * Passes the reports received into the slots between start and the last
+ * completed read of the given fd to the callback.
+ */
+static int hid_uring_deliver(struct hid_uring *uring, int index,
+			     hid_uring_reports_cb callback, void *data)
+{
+	int start = uring->start[index];
+	int num = uring->completed[index] - start;
+
+	if (num <= 0)
+		return 0;
+
+	callback(data, index, uring->batch[index][start],
+		 HID_URING_REPORT_SIZE, uring->lens[index] + start, num);
+	uring->start[index] += num;
+
+	return num;
+}
+
+/*
+ * Sets up an io_uring with chains of reads queued against all given hidraw
+ * file descriptors.
+ *
+ * Returns NULL if io_uring is not available, in which case the caller
+ * should fall back to poll() and hid_read_reports().
+ */
+struct hid_uring *hid_uring_new(const int *fds, int num_fds)
+{
+	struct hid_uring *uring;
+	int i;
+	int ret;
+
+	if (num_fds > HID_URING_MAX_FDS)
+		return NULL;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return NULL;
+
+	ret = io_uring_queue_init(HID_URING_MAX_FDS * HID_REPORT_BATCH,
+				  &uring->ring, 0);
+	if (ret < 0) {
+		g_print("io_uring: Failed to set up ring: %d (%s)\n", -ret,
+			strerror(-ret));
+		free(uring);
+		return NULL;
+	}
+
+	uring->num_fds = num_fds;
+	for (i = 0; i < num_fds; i++) {
+		uring->fds[i] = fds[i];
+		uring->flags[i] = fcntl(fds[i], F_GETFL);
+		fcntl(fds[i], F_SETFL, uring->flags[i] & ~O_NONBLOCK);
+		hid_uring_queue_reads(uring, i);
+	}
+
+	ret = io_uring_submit(&uring->ring);
+	if (ret < 0) {
+		g_print("io_uring: Failed to submit reads: %d (%s)\n", -ret,
+			strerror(-ret));
+		hid_uring_free(uring);
+		return NULL;
+	}
+
+	return uring;
+}
+
+static bool hid_uring_error_is_fatal(int error)
+{
+	return error == -ENODEV || error == -EIO || error == -EBADF;
+}
+
+/*
+ * Waits up to timeout milliseconds for reports to arrive, and passes all
+ * completed reports to the callback in per-fd batches, in the order they
+ * were received. Reads that fail with a non-fatal error, such as -EINTR,
+ * are skipped.
+ *
+ * Returns the number of reports received, 0 on timeout, or a negative error
+ * code. -ENODEV is returned if the device was disconnected.
+ */
+int hid_uring_wait(struct hid_uring *uring, int timeout,
+		   hid_uring_reports_cb callback, void *data)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000,
+	};
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int seen = 0;
+	bool fatal = false;
+	int count = 0;
+	int index, slot;
+	int ret;
+	int i;
+
+	ret = io_uring_submit_and_wait_timeout(&uring->ring, &cqe, 1, &ts,
+					       NULL);
+	if (ret == -ETIME)
+		return 0;
+	if (ret < 0 && ret != -EINTR)
+		return ret;
+
+	io_uring_for_each_cqe(&uring->ring, head, cqe) {
+		seen++;
+
+		index = cqe->user_data >> 32;
+		slot = cqe->user_data & 0xffffffff;
+		if (index >= uring->num_fds || slot >= HID_REPORT_BATCH)
+			continue;
+
+		if (cqe->res < 0) {
+			if (hid_uring_error_is_fatal(cqe->res))
+				fatal = true;
+			count += hid_uring_deliver(uring, index, callback,
+						   data);
+			uring->start[index]++;
+		} else {
+			uring->lens[index][slot] = cqe->res;
+		}
+		uring->completed[index]++;
+	}
+	io_uring_cq_advance(&uring->ring, seen);
+
+	for (i = 0; i < uring->num_fds; i++) {
+		count += hid_uring_deliver(uring, i, callback, data);
+		if (uring->completed[i] == HID_REPORT_BATCH && !fatal)
+			hid_uring_queue_reads(uring, i);
+	}
+
+	if (fatal)
+		return -ENODEV;
+
+	return count;
+}
+
+/*
+ * Cancels all queued reads, restores the file status flags, and frees the
+ * io_uring.
+ */
+void hid_uring_free(struct hid_uring *uring)
+{
+	int i;
+
+	if (!uring)
+		return;
+
+	io_uring_queue_exit(&uring->ring);
+	for (i = 0; i < uring->num_fds; i++) {
+		if (uring->flags[i] != -1)
+			fcntl(uring->fds[i], F_SETFL, uring->flags[i]);
+	}
+	free(uring);
+}
@@ -0,0 +1,54 @@
+/*
+ * io_uring backend for HID input reports
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __HID_URING_H__
+#define __HID_URING_H__
+
+#include <errno.h>
+#include <stddef.h>
+
+struct hid_uring;
+
+/*
+ * Called with a batch of num reports received from the HID device at
+ * position index in the fd array passed to hid_uring_new(). Reports are
+ * stored in consecutive len-sized slots of buf, the same layout as filled
+ * by hid_read_reports().
+ */
+typedef void (*hid_uring_reports_cb)(void *data, int index, unsigned char *buf,
+				     size_t len, const int *lens, int num);
+
+#ifdef HAVE_LIBURING
+struct hid_uring *hid_uring_new(const int *fds, int num_fds);
+int hid_uring_wait(struct hid_uring *uring, int timeout,
+		   hid_uring_reports_cb callback, void *data);
+void hid_uring_free(struct hid_uring *uring);
+#else
+static inline struct hid_uring *hid_uring_new(const int *fds, int num_fds)
+{
+	(void)fds;
+	(void)num_fds;
+
+	return NULL;
+}
+
+static inline int hid_uring_wait(struct hid_uring *uring, int timeout,
+				 hid_uring_reports_cb callback, void *data)
+{
+	(void)uring;
+	(void)timeout;
+	(void)callback;
+	(void)data;
+
+	return -ENOSYS;
+}
+
+static inline void hid_uring_free(struct hid_uring *uring)
+{
+	(void)uring;
+}
+#endif /* HAVE_LIBURING */
+
+#endif /* __HID_URING_H__ */
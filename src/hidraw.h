@@ -10,6 +10,12 @@
 #include <linux/hidraw.h>
 #include <sys/ioctl.h>
 #include <time.h>
+#include <unistd.h>
+
+/*
+ * Maximum number of input reports drained from a HID device per wakeup.
+ */
+#define HID_REPORT_BATCH	16
 
 /*
  * Receives a feature report from the HID device.
@@ -52,4 +58,31 @@ static inline int hid_get_feature_report_timeout(int fd, void *buf, size_t len,
 	return ret;
 }
 
+/*
+ * Drains up to num input reports of at most len bytes each from a HID device
+ * opened with O_NONBLOCK into consecutive len-sized slots of buf, storing
+ * the size of each report in lens.
+ *
+ * Returns the number of reports read, which may be 0 if none were pending,
+ * or -1 with errno set if the first read failed.
+ */
+static inline int hid_read_reports(int fd, unsigned char *buf, size_t len,
+				   int *lens, int num)
+{
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		ret = read(fd, buf + i * len, len);
+		if (ret == -1) {
+			if (i == 0 && errno != EAGAIN)
+				return -1;
+			break;
+		}
+		lens[i] = ret;
+	}
+
+	return i;
+}
+
 #endif /* __HIDRAW_H__ */
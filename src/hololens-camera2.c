@@ -105,12 +105,12 @@ static void hololens_camera2_handle_frame(OuvrtHoloLensCamera2 *self,
 		/* Bright frame, headset tracking */
 		debug_stream_frame_push(self->debug1, self->frame,
 					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+					NULL, NULL, NULL, NULL);
 	} else if (exposure == 0) {
 		/* Dark frame, controller tracking */
 		debug_stream_frame_push(self->debug2, self->frame,
 					2 * 640 * 481 + 26,
-					0, NULL, NULL, NULL, NULL);
+					NULL, NULL, NULL, NULL);
 	} else {
 		g_print("%s: Unexpected exposure: %u\n", self->dev.name,
 			exposure);
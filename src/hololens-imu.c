@@ -14,6 +14,7 @@
 
 #include "hololens-imu.h"
 #include "hololens-hid-reports.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
@@ -23,6 +24,7 @@ struct _OuvrtHoloLensIMU {
 	OuvrtDevice dev;
 
 	uint64_t last_timestamp;
+	struct clock_sync clock;
 	struct imu_state imu;
 };
 
@@ -44,6 +46,8 @@ static int hololens_imu_send_command(OuvrtDevice *dev, uint8_t command)
 static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 					  struct hololens_imu_report *report)
 {
+	uint64_t now = clock_sync_host_now();
+
 	if (memcmp(report->gyro_timestamp,
 		   report->accel_timestamp,
 		   sizeof report->gyro_timestamp)) {
@@ -93,6 +97,9 @@ static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 
 		telemetry_send_raw_imu_sample(self->dev.id, &raw);
 
+		clock_sync_update(&self->clock,
+				  clock_sync_unwrap(&self->clock, raw.time), now);
+
 		dt = raw.time - self->last_timestamp;
 
 		/*
@@ -113,7 +120,8 @@ static int hololens_imu_handle_imu_report(OuvrtHoloLensIMU *self,
 		imu.angular_velocity.y = raw.gyro[0] * -(1e-3 / 8.0);
 		imu.angular_velocity.z = raw.gyro[2] * -(1e-3 / 8.0);
 		imu.temperature = temperature * 0.01;
-		imu.time = raw.time * 1e-7;
+		imu.time = 1e-9 * clock_sync_ticks_to_host(&self->clock,
+							   raw.time);
 
 		telemetry_send_imu_sample(self->dev.id, &imu);
 
@@ -355,15 +363,47 @@ static int hololens_imu_start(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Handles a single IMU, control, or debug report.
+ */
+static void hololens_imu_handle_report(OuvrtHoloLensIMU *self,
+				       unsigned char *buf, int len)
+{
+	if (len == HOLOLENS_IMU_REPORT_SIZE_V2 &&
+	    buf[0] == HOLOLENS_IMU_REPORT_ID) {
+		/*
+		 * Debug messages have been moved out of the main IMU
+		 * report in a firmware update.
+		 */
+		memset(buf + HOLOLENS_IMU_REPORT_SIZE_V2, 0,
+		       HOLOLENS_IMU_REPORT_SIZE - HOLOLENS_IMU_REPORT_SIZE_V2);
+		hololens_imu_handle_imu_report(self, (void *)buf);
+	} else if (len == HOLOLENS_IMU_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_IMU_REPORT_ID) {
+		hololens_imu_handle_imu_report(self, (void *)buf);
+	} else if (len == HOLOLENS_CONTROL_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_CONTROL_REPORT_ID) {
+		hololens_imu_handle_control_report(self, (void *)buf);
+	} else if (len == HOLOLENS_DEBUG_REPORT_SIZE &&
+		   buf[0] == HOLOLENS_DEBUG_REPORT_ID) {
+		hololens_imu_handle_debug_report(&self->dev, (void *)buf);
+	} else {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			self->dev.name, len, buf[0]);
+	}
+}
+
 /*
  * Handles HoloLens IMU messages
  */
 static void hololens_imu_thread(OuvrtDevice *dev)
 {
 	OuvrtHoloLensIMU *self = OUVRT_HOLOLENS_IMU(dev);
-	unsigned char buf[HOLOLENS_IMU_REPORT_SIZE];
+	unsigned char buf[HID_REPORT_BATCH][HOLOLENS_IMU_REPORT_SIZE];
+	int len[HID_REPORT_BATCH];
 	struct pollfd fds;
 	int ret;
+	int i;
 
 	while (dev->active) {
 		fds.fd = dev->fd;
@@ -390,37 +430,16 @@ static void hololens_imu_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
+		ret = hid_read_reports(dev->fd, buf[0],
+				       HOLOLENS_IMU_REPORT_SIZE, len,
+				       HID_REPORT_BATCH);
 		if (ret == -1) {
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
 		}
 
-		if (ret == HOLOLENS_IMU_REPORT_SIZE_V2 &&
-		    buf[0] == HOLOLENS_IMU_REPORT_ID) {
-			/*
-			 * Debug messages have been moved out of the main IMU
-			 * report in a firmware update.
-			 */
-			memset(buf + HOLOLENS_IMU_REPORT_SIZE_V2, 0,
-			       HOLOLENS_IMU_REPORT_SIZE -
-			       HOLOLENS_IMU_REPORT_SIZE_V2);
-			hololens_imu_handle_imu_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_IMU_REPORT_SIZE &&
-		    buf[0] == HOLOLENS_IMU_REPORT_ID) {
-			hololens_imu_handle_imu_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_CONTROL_REPORT_SIZE &&
-			   buf[0] == HOLOLENS_CONTROL_REPORT_ID) {
-			hololens_imu_handle_control_report(self, (void *)buf);
-		} else if (ret == HOLOLENS_DEBUG_REPORT_SIZE &&
-			   buf[0] == HOLOLENS_DEBUG_REPORT_ID) {
-			hololens_imu_handle_debug_report(&self->dev,
-							 (void *)buf);
-		} else {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
+		for (i = 0; i < ret; i++)
+			hololens_imu_handle_report(self, buf[i], len[i]);
 	}
 }
 
@@ -451,6 +470,7 @@ ouvrt_hololens_imu_class_init(OuvrtHoloLensIMUClass *klass)
 static void ouvrt_hololens_imu_init(OuvrtHoloLensIMU *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	clock_sync_init(&self->clock, 10000000, 64);
 	self->imu.pose.rotation.w = 1.0;
 }
 
@@ -7,6 +7,7 @@
 
 #include "imu.h"
 #include "maths.h"
+#include "trace.h"
 
 enum pose_mode {
 	ACCEL_ONLY,
@@ -36,6 +37,9 @@ void pose_update(double dt, struct dpose *pose, struct imu_sample *sample)
 {
 	dquat q, dq;
 
+	OUVRT_TRACE(pose_update, (uint64_t)(dt * 1e9),
+		    (uint64_t)(sample->time * 1e9));
+
 	switch (mode) {
 	case ACCEL_ONLY:
 		dquat_from_accel(&q, &sample->acceleration);
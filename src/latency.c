@@ -0,0 +1,190 @@
+/*
+ * Per-device latency statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "latency.h"
+
+/*
+ * Log-linear histogram buckets, similar to HdrHistogram: values below
+ * 2^LATENCY_SUB_BUCKET_BITS ns are counted exactly, larger values are
+ * split into LATENCY_SUB_BUCKETS buckets per power of two, which limits
+ * the relative error to 1/16. Values above 2^LATENCY_MAX_EXPONENT ns
+ * (about 68 s) are counted in the last bucket.
+ */
+#define LATENCY_SUB_BUCKET_BITS		4
+#define LATENCY_SUB_BUCKETS		(1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT		36
+#define LATENCY_NUM_BUCKETS		((LATENCY_MAX_EXPONENT - \
+					  LATENCY_SUB_BUCKET_BITS + 1) * \
+					 LATENCY_SUB_BUCKETS)
+
+#define LATENCY_NUM_DEVICES		256
+
+/*
+ * Histograms are only ever updated with atomic increments, so that device
+ * threads can record concurrently without locking while the main loop
+ * reads them.
+ */
+struct latency_histogram {
+	uint64_t max;
+	uint32_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+struct latency_stats {
+	struct latency_histogram stage[NUM_LATENCY_STAGES];
+};
+
+/*
+ * Allocated on first use and never freed, as device ids are reclaimed by
+ * reconnecting devices and recording threads may race with device removal.
+ */
+static struct latency_stats *latency_devices[LATENCY_NUM_DEVICES];
+
+static const char *latency_stage_names[NUM_LATENCY_STAGES] = {
+	[LATENCY_CAPTURE_TO_DETECT] = "capture-to-detect",
+	[LATENCY_DETECT_TO_POSE] = "detect-to-pose",
+	[LATENCY_IMU_DECODE] = "imu-decode",
+	[LATENCY_TELEMETRY_SEND] = "telemetry-send",
+};
+
+static unsigned int latency_bucket_index(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < LATENCY_SUB_BUCKETS)
+		return ns;
+
+	exp = 63 - __builtin_clzll(ns);
+	if (exp >= LATENCY_MAX_EXPONENT)
+		return LATENCY_NUM_BUCKETS - 1;
+
+	return (exp - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+	       ((ns >> (exp - LATENCY_SUB_BUCKET_BITS)) &
+		(LATENCY_SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the largest value counted in the given bucket.
+ */
+static uint64_t latency_bucket_value(unsigned int index)
+{
+	unsigned int exp, sub;
+
+	if (index < LATENCY_SUB_BUCKETS)
+		return index;
+
+	exp = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+	sub = index % LATENCY_SUB_BUCKETS;
+
+	return ((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) <<
+		(exp - LATENCY_SUB_BUCKET_BITS)) - 1;
+}
+
+static struct latency_stats *latency_stats_get(uint8_t dev_id)
+{
+	struct latency_stats *stats, *expected = NULL;
+
+	stats = __atomic_load_n(&latency_devices[dev_id], __ATOMIC_ACQUIRE);
+	if (stats)
+		return stats;
+
+	stats = g_new0(struct latency_stats, 1);
+	if (!__atomic_compare_exchange_n(&latency_devices[dev_id], &expected,
+					 stats, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		g_free(stats);
+		stats = expected;
+	}
+
+	return stats;
+}
+
+/*
+ * Adds a latency measurement in nanoseconds to the histogram of the given
+ * device and processing stage. Safe to call from any thread.
+ */
+void latency_record(uint8_t dev_id, enum latency_stage stage, uint64_t ns)
+{
+	struct latency_histogram *hist;
+	uint64_t max;
+
+	hist = &latency_stats_get(dev_id)->stage[stage];
+
+	__atomic_fetch_add(&hist->buckets[latency_bucket_index(ns)], 1,
+			   __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Calculates median, 99th percentile, and maximum latency of the given
+ * device and processing stage from a snapshot of its histogram.
+ *
+ * Returns false if no measurements were recorded yet.
+ */
+bool latency_get_summary(uint8_t dev_id, enum latency_stage stage,
+			 struct latency_summary *summary)
+{
+	uint32_t buckets[LATENCY_NUM_BUCKETS];
+	struct latency_histogram *hist;
+	struct latency_stats *stats;
+	uint64_t count = 0, sum = 0;
+	uint64_t rank50, rank99;
+	bool have_p50 = false;
+	unsigned int i;
+
+	memset(summary, 0, sizeof(*summary));
+
+	stats = __atomic_load_n(&latency_devices[dev_id], __ATOMIC_ACQUIRE);
+	if (!stats)
+		return false;
+
+	hist = &stats->stage[stage];
+	for (i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&hist->buckets[i],
+					     __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+	if (!count)
+		return false;
+
+	summary->count = count;
+	summary->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	rank50 = (count * 50 + 99) / 100;
+	rank99 = (count * 99 + 99) / 100;
+	for (i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		if (!buckets[i])
+			continue;
+		sum += buckets[i];
+		if (!have_p50 && sum >= rank50) {
+			summary->p50 = latency_bucket_value(i);
+			have_p50 = true;
+		}
+		if (sum >= rank99) {
+			summary->p99 = latency_bucket_value(i);
+			break;
+		}
+	}
+
+	/* The maximum is exact, bucket values are upper bounds */
+	if (summary->p50 > summary->max)
+		summary->p50 = summary->max;
+	if (summary->p99 > summary->max)
+		summary->p99 = summary->max;
+
+	return true;
+}
+
+const char *latency_stage_name(enum latency_stage stage)
+{
+	return latency_stage_names[stage];
+}
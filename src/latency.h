@@ -0,0 +1,32 @@
+/*
+ * Per-device latency statistics
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum latency_stage {
+	LATENCY_CAPTURE_TO_DETECT,
+	LATENCY_DETECT_TO_POSE,
+	LATENCY_IMU_DECODE,
+	LATENCY_TELEMETRY_SEND,
+	NUM_LATENCY_STAGES,
+};
+
+struct latency_summary {
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+void latency_record(uint8_t dev_id, enum latency_stage stage, uint64_t ns);
+bool latency_get_summary(uint8_t dev_id, enum latency_stage stage,
+			 struct latency_summary *summary);
+const char *latency_stage_name(enum latency_stage stage);
+
+#endif /* __LATENCY_H__ */
@@ -0,0 +1,302 @@
+/*
+ * Lighthouse OOTX frame decoder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <asm/byteorder.h>
+#include <glib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "cache.h"
+#include "lighthouse-ootx.h"
+
+#define LIGHTHOUSE_OOTX_ALL_WORDS	((1 << LIGHTHOUSE_OOTX_WORDS) - 1)
+#define LIGHTHOUSE_OOTX_CACHE_FILE	"lighthouse-calibration.conf"
+
+/*
+ * Each base station sends one data bit per 400000 ticks of the 48 MHz
+ * clock. Capture continues across sync loss of up to 64 bits.
+ */
+#define LIGHTHOUSE_OOTX_BIT_PERIOD	400000
+#define LIGHTHOUSE_OOTX_MAX_MISSED	64
+
+static GMutex cache_mutex;
+static GKeyFile *cache_file;
+static bool cache_save_pending;
+
+/*
+ * Stops frame capture. Already received words are kept to be completed by
+ * the next transmission.
+ */
+void lighthouse_ootx_reset(struct lighthouse_ootx *ootx)
+{
+	ootx->preamble = 0;
+	ootx->word = -1;
+	ootx->bit = 0;
+}
+
+/*
+ * Skips over data bits that were missed while the sync signal was lost.
+ * Words containing missed bits are not stored, but capture continues with
+ * the following words. If too many bits were missed, capture is stopped.
+ */
+static void lighthouse_ootx_skip(struct lighthouse_ootx *ootx,
+				 unsigned int missed)
+{
+	unsigned int pos, first, last, i;
+
+	ootx->preamble = 0;
+
+	if (ootx->word < 0)
+		return;
+
+	if (missed > LIGHTHOUSE_OOTX_MAX_MISSED) {
+		lighthouse_ootx_reset(ootx);
+		return;
+	}
+
+	pos = ootx->word * 17 + ootx->bit;
+	first = pos / 17;
+	last = (pos + missed - 1) / 17;
+	for (i = first; i <= last && i < LIGHTHOUSE_OOTX_WORDS; i++)
+		ootx->lost |= 1 << i;
+
+	pos += missed;
+	ootx->word = pos / 17;
+	ootx->bit = pos % 17;
+	if (ootx->word >= LIGHTHOUSE_OOTX_WORDS)
+		lighthouse_ootx_reset(ootx);
+}
+
+static void lighthouse_ootx_start(struct lighthouse_ootx *ootx)
+{
+	ootx->word = 0;
+	ootx->bit = 0;
+	ootx->received = 0;
+	ootx->lost = 0;
+	ootx->crc = crc32(0L, Z_NULL, 0);
+}
+
+/*
+ * Checks the CRC of a completely assembled frame. If the frame was received
+ * in a single transmission, the CRC was calculated while receiving.
+ */
+static enum lighthouse_ootx_event
+lighthouse_ootx_check_frame(struct lighthouse_ootx *ootx)
+{
+	uint32_t ootx_crc = __le32_to_cpup((__le32 *)(ootx->data + 36));
+	uint32_t crc = ootx->crc;
+
+	if (ootx->received != LIGHTHOUSE_OOTX_ALL_WORDS) {
+		crc = crc32(crc32(0L, Z_NULL, 0), lighthouse_ootx_payload(ootx),
+			    LIGHTHOUSE_OOTX_PAYLOAD_LEN);
+	}
+
+	/* Start over with the next transmission */
+	ootx->valid = 0;
+
+	return (crc == ootx_crc) ? LIGHTHOUSE_OOTX_FRAME :
+				   LIGHTHOUSE_OOTX_CRC_ERROR;
+}
+
+/*
+ * Stores a completely received 16-bit word. Each word contains two bytes,
+ * transmitted MSB-first.
+ */
+static enum lighthouse_ootx_event
+lighthouse_ootx_handle_word(struct lighthouse_ootx *ootx)
+{
+	uint8_t *bytes = ootx->data + 2 * ootx->word;
+	uint32_t mask = 1 << ootx->word;
+	int word = ootx->word;
+
+	/* Skip words with bits missed during sync loss */
+	if (ootx->lost & mask) {
+		if (++ootx->word == LIGHTHOUSE_OOTX_WORDS)
+			ootx->word = -1;
+		return LIGHTHOUSE_OOTX_NONE;
+	}
+
+	/* Drop words from earlier transmissions of a different frame */
+	if ((ootx->valid & mask) &&
+	    (bytes[0] != ootx->shift >> 8 || bytes[1] != (ootx->shift & 0xff)))
+		ootx->valid = ootx->received;
+
+	bytes[0] = ootx->shift >> 8;
+	bytes[1] = ootx->shift & 0xff;
+	ootx->received |= mask;
+	ootx->valid |= mask;
+
+	/* The CRC covers the 33 payload bytes starting with the second word */
+	if (word >= 1 && word <= 17)
+		ootx->crc = crc32(ootx->crc, bytes, word == 17 ? 1 : 2);
+
+	if (++ootx->word == LIGHTHOUSE_OOTX_WORDS)
+		ootx->word = -1;
+
+	/* The first word contains the payload length */
+	if (word == 0 && (bytes[0] | bytes[1] << 8) !=
+			 LIGHTHOUSE_OOTX_PAYLOAD_LEN) {
+		ootx->valid = 0;
+		ootx->word = -1;
+		return LIGHTHOUSE_OOTX_LENGTH_ERROR;
+	}
+
+	if (ootx->valid == LIGHTHOUSE_OOTX_ALL_WORDS)
+		return lighthouse_ootx_check_frame(ootx);
+
+	/* After 4 words we have received the base station serial number */
+	if (word == 3 && (ootx->valid & 0xf) == 0xf)
+		return LIGHTHOUSE_OOTX_SERIAL;
+
+	return LIGHTHOUSE_OOTX_NONE;
+}
+
+/*
+ * Handles a single OOTX data bit, received with each sync pulse at the given
+ * timestamp. A frame starts with a preamble of 17 zero bits followed by a
+ * one. Every 16-bit word is followed by a sync bit that must be one.
+ */
+enum lighthouse_ootx_event
+lighthouse_ootx_handle_bit(struct lighthouse_ootx *ootx, bool data,
+			   uint32_t timestamp)
+{
+	enum lighthouse_ootx_event event = LIGHTHOUSE_OOTX_NONE;
+	uint32_t dt = timestamp - ootx->timestamp;
+	unsigned int missed;
+
+	missed = (dt + LIGHTHOUSE_OOTX_BIT_PERIOD / 2) /
+		 LIGHTHOUSE_OOTX_BIT_PERIOD;
+	if (ootx->timestamp && missed > 1)
+		lighthouse_ootx_skip(ootx, missed - 1);
+	ootx->timestamp = timestamp;
+
+	if (ootx->word >= 0) {
+		if (ootx->bit == 16) {
+			ootx->bit = 0;
+			if (data) {
+				event = lighthouse_ootx_handle_word(ootx);
+			} else {
+				/* Missing sync bit, restart */
+				ootx->word = -1;
+				event = LIGHTHOUSE_OOTX_SYNC_ERROR;
+			}
+		} else {
+			ootx->shift = (ootx->shift << 1) | data;
+			ootx->bit++;
+		}
+	}
+
+	/* Preamble detection */
+	if (data) {
+		if (ootx->preamble > 16)
+			lighthouse_ootx_start(ootx);
+		ootx->preamble = 0;
+	} else {
+		ootx->preamble++;
+	}
+
+	return event;
+}
+
+static void lighthouse_ootx_cache_load(void)
+{
+	gchar *filename;
+
+	cache_file = g_key_file_new();
+	filename = cache_get_filename(LIGHTHOUSE_OOTX_CACHE_FILE);
+	g_key_file_load_from_file(cache_file, filename, G_KEY_FILE_NONE, NULL);
+	g_free(filename);
+}
+
+/*
+ * Looks up the OOTX payload of a base station seen in a previous session.
+ */
+bool lighthouse_ootx_cache_lookup(uint32_t serial, uint8_t *payload)
+{
+	gchar group[9];
+	gchar *hex;
+	bool ret = false;
+	int i;
+
+	g_snprintf(group, sizeof(group), "%08X", serial);
+
+	g_mutex_lock(&cache_mutex);
+
+	if (!cache_file)
+		lighthouse_ootx_cache_load();
+
+	hex = g_key_file_get_string(cache_file, group, "Payload", NULL);
+	if (hex && strlen(hex) == 2 * LIGHTHOUSE_OOTX_PAYLOAD_LEN) {
+		for (i = 0; i < LIGHTHOUSE_OOTX_PAYLOAD_LEN; i++) {
+			payload[i] = g_ascii_xdigit_value(hex[2 * i]) << 4 |
+				     g_ascii_xdigit_value(hex[2 * i + 1]);
+		}
+		ret = true;
+	}
+	g_free(hex);
+
+	g_mutex_unlock(&cache_mutex);
+
+	return ret;
+}
+
+static gboolean lighthouse_ootx_cache_save(gpointer data)
+{
+	GError *error = NULL;
+	gchar *filename;
+
+	(void)data;
+
+	filename = cache_get_filename(LIGHTHOUSE_OOTX_CACHE_FILE);
+
+	g_mutex_lock(&cache_mutex);
+	cache_save_pending = false;
+	if (!g_key_file_save_to_file(cache_file, filename, &error)) {
+		g_print("Lighthouse: Failed to save calibration cache: %s\n",
+			error->message);
+		g_error_free(error);
+	}
+	g_mutex_unlock(&cache_mutex);
+
+	g_free(filename);
+
+	return FALSE;
+}
+
+/*
+ * Stores the OOTX payload of a base station for the next session, unless
+ * the cache is read-only, such as during replay of a recorded session.
+ */
+void lighthouse_ootx_cache_store(uint32_t serial, const uint8_t *payload)
+{
+	gchar hex[2 * LIGHTHOUSE_OOTX_PAYLOAD_LEN + 1];
+	gchar group[9];
+	gchar *old;
+	int i;
+
+	if (cache_is_read_only())
+		return;
+
+	g_snprintf(group, sizeof(group), "%08X", serial);
+	for (i = 0; i < LIGHTHOUSE_OOTX_PAYLOAD_LEN; i++)
+		g_snprintf(hex + 2 * i, 3, "%02x", payload[i]);
+
+	g_mutex_lock(&cache_mutex);
+
+	if (!cache_file)
+		lighthouse_ootx_cache_load();
+
+	old = g_key_file_get_string(cache_file, group, "Payload", NULL);
+	if (!old || strcmp(old, hex) != 0) {
+		g_key_file_set_string(cache_file, group, "Payload", hex);
+		if (!cache_save_pending) {
+			cache_save_pending = true;
+			g_idle_add(lighthouse_ootx_cache_save, NULL);
+		}
+	}
+	g_free(old);
+
+	g_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,60 @@
+/*
+ * Lighthouse OOTX frame decoder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __LIGHTHOUSE_OOTX_H__
+#define __LIGHTHOUSE_OOTX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LIGHTHOUSE_OOTX_PAYLOAD_LEN	33
+
+/*
+ * The OOTX frame consists of a 16-bit length word, the 33-byte payload
+ * padded to 17 words, and a 32-bit CRC, each word followed by a sync bit.
+ */
+#define LIGHTHOUSE_OOTX_WORDS		20
+
+enum lighthouse_ootx_event {
+	LIGHTHOUSE_OOTX_NONE,
+	LIGHTHOUSE_OOTX_SYNC_ERROR,
+	LIGHTHOUSE_OOTX_LENGTH_ERROR,
+	LIGHTHOUSE_OOTX_SERIAL,
+	LIGHTHOUSE_OOTX_FRAME,
+	LIGHTHOUSE_OOTX_CRC_ERROR,
+};
+
+/*
+ * Words received in earlier, interrupted transmissions of the same frame
+ * are kept in the valid mask and completed by later transmissions.
+ */
+struct lighthouse_ootx {
+	uint32_t timestamp;
+	unsigned int preamble;
+	int word;
+	int bit;
+	uint16_t shift;
+	uint32_t received;
+	uint32_t lost;
+	uint32_t valid;
+	uint32_t crc;
+	uint8_t data[2 * LIGHTHOUSE_OOTX_WORDS];
+};
+
+static inline const uint8_t *
+lighthouse_ootx_payload(const struct lighthouse_ootx *ootx)
+{
+	return ootx->data + 2;
+}
+
+void lighthouse_ootx_reset(struct lighthouse_ootx *ootx);
+enum lighthouse_ootx_event
+lighthouse_ootx_handle_bit(struct lighthouse_ootx *ootx, bool data,
+			   uint32_t timestamp);
+
+bool lighthouse_ootx_cache_lookup(uint32_t serial, uint8_t *payload);
+void lighthouse_ootx_cache_store(uint32_t serial, const uint8_t *payload);
+
+#endif /* __LIGHTHOUSE_OOTX_H__ */
@@ -0,0 +1,433 @@
+/*
+ * Lighthouse sweep angle pose solver
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <math.h>
+#include <string.h>
+
+#include "lighthouse-pose.h"
+
+#define NUM_PARAMS		6
+#define MAX_RESIDUALS		64
+#define MAX_ITERATIONS		30
+#define INIT_ITERATIONS		10
+#define JACOBIAN_STEP		1e-6
+
+/* 48 MHz ticks per half rotor revolution, corresponding to 180° */
+#define SWEEP_HALF_PERIOD	400000
+
+/*
+ * Sensor observations of a single base station frame pair. The first
+ * num_both sensors were hit by both sweeps.
+ */
+struct observations {
+	unsigned int num;
+	unsigned int num_both;
+	const vec3 *point[32];
+	const vec3 *normal[32];
+	double angle[32][2];
+	bool valid[32][2];
+};
+
+/*
+ * Converts the sweep pulse offset from the start of the sync pulse to the
+ * sweep angle in radians, relative to the base station's optical axis.
+ */
+double lighthouse_sweep_angle(uint32_t offset, uint16_t duration)
+{
+	double center = offset + 0.5 * duration;
+
+	return (center - SWEEP_HALF_PERIOD / 2) * M_PI / SWEEP_HALF_PERIOD;
+}
+
+/*
+ * Calculates the horizontal and vertical sweep angles at which the given
+ * point in the base station coordinate system is hit, applying the rotor
+ * calibration from the OOTX frame. The base station looks along -z, with x
+ * to the right and y up.
+ */
+void lighthouse_reproject(const struct lighthouse_base_calibration *calibration,
+			  const dvec3 *point, double angles[2])
+{
+	const double xy[2] = {
+		point->x / -point->z,
+		point->y / -point->z,
+	};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const struct lighthouse_rotor_calibration *rotor;
+		const double opposite = xy[1 - i];
+		const double ideal = atan(xy[i]);
+
+		rotor = &calibration->rotor[i];
+		angles[i] = ideal - rotor->phase -
+			    tan(rotor->tilt) * opposite -
+			    rotor->curve * opposite * opposite -
+			    rotor->gibmag * sin(ideal + rotor->gibphase);
+	}
+}
+
+static unsigned int collect_observations(const struct tracking_model *model,
+					 const struct lighthouse_frame frame[2],
+					 struct observations *obs)
+{
+	uint32_t both = frame[0].sweep_ids & frame[1].sweep_ids;
+	uint32_t any = frame[0].sweep_ids | frame[1].sweep_ids;
+	unsigned int pass, id, i, r;
+
+	if (model->num_points < 32)
+		any &= (1U << model->num_points) - 1;
+
+	obs->num = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for (id = 0; id < 32; id++) {
+			if (!(any & (1U << id)) ||
+			    !!(both & (1U << id)) != (pass == 0))
+				continue;
+
+			i = obs->num++;
+			obs->point[i] = &model->points[id];
+			obs->normal[i] = &model->normals[id];
+			for (r = 0; r < 2; r++) {
+				obs->valid[i][r] = frame[r].sweep_ids &
+						   (1U << id);
+				if (obs->valid[i][r]) {
+					obs->angle[i][r] = lighthouse_sweep_angle(
+						frame[r].sweep_offset[id],
+						frame[r].sweep_duration[id]);
+				}
+			}
+		}
+		if (pass == 0)
+			obs->num_both = obs->num;
+	}
+
+	return obs->num_both;
+}
+
+/*
+ * Calculates the angle residuals of all observations for the given pose.
+ * Returns the number of residuals.
+ */
+static unsigned int
+residuals(const struct lighthouse_base_calibration *calibration,
+	  const struct observations *obs, const struct dpose *pose,
+	  double *res)
+{
+	unsigned int i, r, n = 0;
+	double angles[2];
+	dvec3 p;
+
+	for (i = 0; i < obs->num; i++) {
+		p.x = obs->point[i]->x;
+		p.y = obs->point[i]->y;
+		p.z = obs->point[i]->z;
+		dquat_rotate(&p, &pose->rotation, &p);
+		p.x += pose->translation.x;
+		p.y += pose->translation.y;
+		p.z += pose->translation.z;
+
+		if (p.z < -1e-3) {
+			lighthouse_reproject(calibration, &p, angles);
+		} else {
+			/* Behind the base station, penalize heavily */
+			angles[0] = angles[1] = M_PI;
+		}
+
+		for (r = 0; r < 2; r++) {
+			if (obs->valid[i][r])
+				res[n++] = obs->angle[i][r] - angles[r];
+		}
+	}
+
+	return n;
+}
+
+static double sum_of_squares(const double *v, unsigned int n)
+{
+	double sum = 0.0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		sum += v[i] * v[i];
+
+	return sum;
+}
+
+/*
+ * Applies a small rotation (in the base station coordinate system) and a
+ * translation to the pose.
+ */
+static void apply_step(struct dpose *pose, const double *step)
+{
+	const double angle = sqrt(step[0] * step[0] + step[1] * step[1] +
+				  step[2] * step[2]);
+	dquat dq, q;
+
+	if (angle > 0.0) {
+		dvec3 axis = {
+			step[0] / angle,
+			step[1] / angle,
+			step[2] / angle,
+		};
+
+		dquat_from_axis_angle(&dq, &axis, angle);
+		dquat_mult(&q, &dq, &pose->rotation);
+		dquat_normalize(&q);
+		pose->rotation = q;
+	}
+
+	pose->translation.x += step[3];
+	pose->translation.y += step[4];
+	pose->translation.z += step[5];
+}
+
+/*
+ * Solves the symmetric positive definite system A x = b in place using a
+ * Cholesky decomposition. Returns false if A is not positive definite.
+ */
+static bool cholesky_solve(double A[NUM_PARAMS][NUM_PARAMS],
+			   const double *b, double *x)
+{
+	double y[NUM_PARAMS];
+	int i, j, k;
+
+	for (j = 0; j < NUM_PARAMS; j++) {
+		double d = A[j][j];
+
+		for (k = 0; k < j; k++)
+			d -= A[j][k] * A[j][k];
+		if (d <= 0.0)
+			return false;
+		A[j][j] = sqrt(d);
+
+		for (i = j + 1; i < NUM_PARAMS; i++) {
+			double s = A[i][j];
+
+			for (k = 0; k < j; k++)
+				s -= A[i][k] * A[j][k];
+			A[i][j] = s / A[j][j];
+		}
+	}
+
+	for (i = 0; i < NUM_PARAMS; i++) {
+		y[i] = b[i];
+		for (k = 0; k < i; k++)
+			y[i] -= A[i][k] * y[k];
+		y[i] /= A[i][i];
+	}
+
+	for (i = NUM_PARAMS - 1; i >= 0; i--) {
+		x[i] = y[i];
+		for (k = i + 1; k < NUM_PARAMS; k++)
+			x[i] -= A[k][i] * x[k];
+		x[i] /= A[i][i];
+	}
+
+	return true;
+}
+
+/*
+ * Refines the pose with Levenberg-Marquardt iterations on the angle
+ * residuals, using a forward difference Jacobian. Returns the final sum of
+ * squared residuals.
+ */
+static double refine_pose(const struct lighthouse_base_calibration *calibration,
+			  const struct observations *obs, struct dpose *pose,
+			  unsigned int max_iterations, unsigned int *num)
+{
+	double J[MAX_RESIDUALS][NUM_PARAMS];
+	double res[MAX_RESIDUALS], res2[MAX_RESIDUALS];
+	double A[NUM_PARAMS][NUM_PARAMS];
+	double g[NUM_PARAMS], step[NUM_PARAMS];
+	double lambda = 1e-3;
+	double cost, new_cost;
+	struct dpose trial;
+	unsigned int iter, i, j, k, n;
+
+	n = residuals(calibration, obs, pose, res);
+	cost = sum_of_squares(res, n);
+	*num = n;
+
+	for (iter = 0; iter < max_iterations; iter++) {
+		for (k = 0; k < NUM_PARAMS; k++) {
+			memset(step, 0, sizeof(step));
+			step[k] = JACOBIAN_STEP;
+			trial = *pose;
+			apply_step(&trial, step);
+			residuals(calibration, obs, &trial, res2);
+			for (i = 0; i < n; i++)
+				J[i][k] = (res[i] - res2[i]) / JACOBIAN_STEP;
+		}
+
+		for (j = 0; j < NUM_PARAMS; j++) {
+			g[j] = 0.0;
+			for (i = 0; i < n; i++)
+				g[j] += J[i][j] * res[i];
+		}
+
+		for (;;) {
+			for (j = 0; j < NUM_PARAMS; j++) {
+				for (k = 0; k <= j; k++) {
+					double s = 0.0;
+
+					for (i = 0; i < n; i++)
+						s += J[i][j] * J[i][k];
+					A[j][k] = A[k][j] = s;
+				}
+				A[j][j] *= 1.0 + lambda;
+			}
+
+			if (!cholesky_solve(A, g, step))
+				return cost;
+
+			trial = *pose;
+			apply_step(&trial, step);
+			residuals(calibration, obs, &trial, res2);
+			new_cost = sum_of_squares(res2, n);
+			if (new_cost < cost)
+				break;
+
+			lambda *= 10.0;
+			if (lambda > 1e6)
+				return cost;
+		}
+
+		*pose = trial;
+		memcpy(res, res2, n * sizeof(*res));
+		if (cost - new_cost < 1e-12 * cost) {
+			cost = new_cost;
+			break;
+		}
+		cost = new_cost;
+		lambda = fmax(lambda * 0.1, 1e-9);
+	}
+
+	return cost;
+}
+
+/*
+ * Estimates a coarse initial pose from the sensors hit by both sweeps. The
+ * distance is estimated from the angular spread of the sensors compared to
+ * their spread in the model, and the device is turned such that the mean
+ * sensor normal faces the base station. The remaining roll ambiguity is
+ * resolved by refining four candidates rotated by 90° around the viewing
+ * direction.
+ */
+static bool initial_pose(const struct lighthouse_base_calibration *calibration,
+			 const struct observations *obs, struct dpose *pose)
+{
+	double xm = 0.0, ym = 0.0, s_img = 0.0, s_model = 0.0;
+	double best_cost = INFINITY, cost, dist;
+	vec3 centroid = { 0 }, normal = { 0 }, to_base;
+	unsigned int i, k, n;
+	dvec3 c, target;
+	dquat q0, roll, q;
+	struct dpose candidate;
+
+	for (i = 0; i < obs->num_both; i++) {
+		xm += tan(obs->angle[i][0]);
+		ym += tan(obs->angle[i][1]);
+		centroid.x += obs->point[i]->x;
+		centroid.y += obs->point[i]->y;
+		centroid.z += obs->point[i]->z;
+		normal.x += obs->normal[i]->x;
+		normal.y += obs->normal[i]->y;
+		normal.z += obs->normal[i]->z;
+	}
+	xm /= obs->num_both;
+	ym /= obs->num_both;
+	centroid.x /= obs->num_both;
+	centroid.y /= obs->num_both;
+	centroid.z /= obs->num_both;
+
+	for (i = 0; i < obs->num_both; i++) {
+		double dx = tan(obs->angle[i][0]) - xm;
+		double dy = tan(obs->angle[i][1]) - ym;
+		vec3 d = {
+			obs->point[i]->x - centroid.x,
+			obs->point[i]->y - centroid.y,
+			obs->point[i]->z - centroid.z,
+		};
+
+		s_img += dx * dx + dy * dy;
+		s_model += vec3_dot(&d, &d);
+	}
+	if (s_img < 1e-12 || vec3_norm(&normal) < 1e-6)
+		return false;
+
+	dist = sqrt(s_model / s_img);
+	target.x = xm * dist;
+	target.y = ym * dist;
+	target.z = -dist;
+
+	to_base.x = -target.x;
+	to_base.y = -target.y;
+	to_base.z = -target.z;
+	vec3_normalize(&to_base);
+	vec3_normalize(&normal);
+	dquat_from_axes(&q0, &normal, &to_base);
+
+	for (k = 0; k < 4; k++) {
+		dvec3 axis = { to_base.x, to_base.y, to_base.z };
+
+		dquat_from_axis_angle(&roll, &axis, k * M_PI_2);
+		dquat_mult(&q, &roll, &q0);
+
+		c.x = centroid.x;
+		c.y = centroid.y;
+		c.z = centroid.z;
+		dquat_rotate(&c, &q, &c);
+
+		candidate.rotation = q;
+		candidate.translation.x = target.x - c.x;
+		candidate.translation.y = target.y - c.y;
+		candidate.translation.z = target.z - c.z;
+
+		cost = refine_pose(calibration, obs, &candidate,
+				   INIT_ITERATIONS, &n);
+		if (cost < best_cost) {
+			best_cost = cost;
+			*pose = candidate;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Estimates the pose of the tracked device in the base station coordinate
+ * system from a horizontal (frame[0]) and vertical (frame[1]) sweep. If
+ * use_guess is set, pose must contain the previous estimate, otherwise an
+ * initial pose is estimated from scratch.
+ *
+ * Returns true and the RMS angle residual in radians in error on success.
+ */
+bool lighthouse_pose_solve(const struct tracking_model *model,
+			   const struct lighthouse_base_calibration *calibration,
+			   const struct lighthouse_frame frame[2],
+			   struct dpose *pose, bool use_guess, double *error)
+{
+	struct observations obs;
+	unsigned int n;
+	double cost;
+
+	if (!model->num_points ||
+	    collect_observations(model, frame, &obs) <
+	    LIGHTHOUSE_POSE_MIN_SENSORS)
+		return false;
+
+	if (!use_guess && !initial_pose(calibration, &obs, pose))
+		return false;
+
+	cost = refine_pose(calibration, &obs, pose, MAX_ITERATIONS, &n);
+	if (n <= NUM_PARAMS)
+		return false;
+
+	if (error)
+		*error = sqrt(cost / n);
+
+	return true;
+}
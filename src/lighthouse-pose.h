@@ -0,0 +1,26 @@
+/*
+ * Lighthouse sweep angle pose solver
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __LIGHTHOUSE_POSE_H__
+#define __LIGHTHOUSE_POSE_H__
+
+#include <stdbool.h>
+
+#include "imu.h"
+#include "lighthouse.h"
+#include "tracking-model.h"
+
+/* Minimum number of sensors hit by both sweeps to solve a pose */
+#define LIGHTHOUSE_POSE_MIN_SENSORS	4
+
+double lighthouse_sweep_angle(uint32_t offset, uint16_t duration);
+void lighthouse_reproject(const struct lighthouse_base_calibration *calibration,
+			  const dvec3 *point, double angles[2]);
+bool lighthouse_pose_solve(const struct tracking_model *model,
+			   const struct lighthouse_base_calibration *calibration,
+			   const struct lighthouse_frame frame[2],
+			   struct dpose *pose, bool use_guess, double *error);
+
+#endif /* __LIGHTHOUSE_POSE_H__ */
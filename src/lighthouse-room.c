@@ -0,0 +1,443 @@
+/*
+ * Lighthouse base station registration
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "lighthouse-room.h"
+
+#define LIGHTHOUSE_ROOM_CACHE_FILE	"lighthouse-bases.conf"
+#define LIGHTHOUSE_ROOM_MAX_BASES	16
+#define LIGHTHOUSE_ROOM_NUM_SAMPLES	120
+#define LIGHTHOUSE_ROOM_MAX_DEVIATION	0.1
+#define LIGHTHOUSE_ROOM_MAX_MISMATCHES	120
+
+/*
+ * The room coordinate system has its origin at the reference base station,
+ * the first base station seen, with the y axis pointing up. All other base
+ * station poses are registered relative to the reference by combining pose
+ * estimates of the same device from two base stations at the same time.
+ */
+struct room_base {
+	uint32_t serial;
+	vec3 gravity;
+	bool seen;
+	bool reference;
+	bool registered;
+	struct dpose pose;
+
+	unsigned int num_samples;
+	dquat rotation_sum;
+	dvec3 translation_sum;
+	unsigned int num_mismatches;
+};
+
+static GMutex room_mutex;
+static struct room_base room_bases[LIGHTHOUSE_ROOM_MAX_BASES];
+static unsigned int room_num_bases;
+static bool room_save_pending;
+
+static void pose_mult(struct dpose *r, const struct dpose *a,
+		      const struct dpose *b)
+{
+	struct dpose p;
+
+	dquat_mult(&p.rotation, (dquat *)&a->rotation, &b->rotation);
+	dquat_rotate(&p.translation, &a->rotation, &b->translation);
+	p.translation.x += a->translation.x;
+	p.translation.y += a->translation.y;
+	p.translation.z += a->translation.z;
+	*r = p;
+}
+
+static void pose_inverse(struct dpose *r, const struct dpose *a)
+{
+	struct dpose p;
+
+	dquat_conj(&p.rotation, &a->rotation);
+	dquat_rotate(&p.translation, &p.rotation, &a->translation);
+	p.translation.x = -p.translation.x;
+	p.translation.y = -p.translation.y;
+	p.translation.z = -p.translation.z;
+	*r = p;
+}
+
+/*
+ * Returns the rotation that turns the base station's measured up vector
+ * to the room's y axis.
+ */
+static void gravity_alignment(dquat *q, const vec3 *gravity, const dquat *rot)
+{
+	const vec3 up = { 0.0f, 1.0f, 0.0f };
+	dvec3 g = { gravity->x, gravity->y, gravity->z };
+	vec3 v;
+
+	if (gravity->x == 0.0f && gravity->y == 0.0f && gravity->z == 0.0f) {
+		*q = (dquat){ 0.0, 0.0, 0.0, 1.0 };
+		return;
+	}
+
+	dquat_rotate(&g, rot, &g);
+	v.x = g.x;
+	v.y = g.y;
+	v.z = g.z;
+	vec3_normalize(&v);
+	dquat_from_axes(q, &v, &up);
+}
+
+static struct room_base *room_find_base(uint32_t serial)
+{
+	unsigned int i;
+
+	for (i = 0; i < room_num_bases; i++) {
+		if (room_bases[i].serial == serial)
+			return &room_bases[i];
+	}
+
+	return NULL;
+}
+
+static gboolean lighthouse_room_save(gpointer data)
+{
+	struct room_base bases[LIGHTHOUSE_ROOM_MAX_BASES];
+	unsigned int num_bases, i;
+	GError *error = NULL;
+	gchar *filename;
+	GKeyFile *file;
+
+	(void)data;
+
+	g_mutex_lock(&room_mutex);
+	memcpy(bases, room_bases, sizeof(bases));
+	num_bases = room_num_bases;
+	room_save_pending = false;
+	g_mutex_unlock(&room_mutex);
+
+	file = g_key_file_new();
+	for (i = 0; i < num_bases; i++) {
+		struct room_base *base = &bases[i];
+		const double gravity[3] = {
+			base->gravity.x, base->gravity.y, base->gravity.z,
+		};
+		const double rotation[4] = {
+			base->pose.rotation.w, base->pose.rotation.x,
+			base->pose.rotation.y, base->pose.rotation.z,
+		};
+		const double translation[3] = {
+			base->pose.translation.x, base->pose.translation.y,
+			base->pose.translation.z,
+		};
+		gchar group[9];
+
+		if (!base->registered)
+			continue;
+
+		g_snprintf(group, sizeof(group), "%08X", base->serial);
+		g_key_file_set_boolean(file, group, "Reference",
+				       base->reference);
+		g_key_file_set_double_list(file, group, "Gravity",
+					   (gdouble *)gravity, 3);
+		g_key_file_set_double_list(file, group, "Rotation",
+					   (gdouble *)rotation, 4);
+		g_key_file_set_double_list(file, group, "Translation",
+					   (gdouble *)translation, 3);
+	}
+
+	filename = cache_get_filename(LIGHTHOUSE_ROOM_CACHE_FILE);
+	if (!g_key_file_save_to_file(file, filename, &error)) {
+		g_print("Lighthouse: Failed to save base stations: %s\n",
+			error->message);
+		g_error_free(error);
+	}
+	g_free(filename);
+	g_key_file_free(file);
+
+	return FALSE;
+}
+
+/*
+ * Schedules saving the registered base stations from the main loop, unless
+ * the cache is read-only, such as during replay of a recorded session.
+ */
+static void room_schedule_save(void)
+{
+	if (room_save_pending || cache_is_read_only())
+		return;
+
+	room_save_pending = true;
+	g_idle_add(lighthouse_room_save, NULL);
+}
+
+/*
+ * Loads the base station poses registered in a previous session. Called
+ * once from the main thread at startup, before any device is started.
+ */
+void lighthouse_room_load(void)
+{
+	gchar **groups, *filename;
+	GKeyFile *file;
+	gsize num_groups, i;
+
+	g_mutex_lock(&room_mutex);
+
+	filename = cache_get_filename(LIGHTHOUSE_ROOM_CACHE_FILE);
+	file = g_key_file_new();
+	if (!g_key_file_load_from_file(file, filename, G_KEY_FILE_NONE,
+				       NULL)) {
+		g_key_file_free(file);
+		g_free(filename);
+		g_mutex_unlock(&room_mutex);
+		return;
+	}
+
+	groups = g_key_file_get_groups(file, &num_groups);
+	for (i = 0; i < num_groups &&
+		    room_num_bases < LIGHTHOUSE_ROOM_MAX_BASES; i++) {
+		struct room_base *base = &room_bases[room_num_bases];
+		gdouble *gravity, *rotation, *translation;
+		gsize len_g = 0, len_r = 0, len_t = 0;
+
+		gravity = g_key_file_get_double_list(file, groups[i],
+						     "Gravity", &len_g, NULL);
+		rotation = g_key_file_get_double_list(file, groups[i],
+						      "Rotation", &len_r, NULL);
+		translation = g_key_file_get_double_list(file, groups[i],
+							 "Translation", &len_t,
+							 NULL);
+		if (len_g == 3 && len_r == 4 && len_t == 3) {
+			memset(base, 0, sizeof(*base));
+			base->serial = strtoul(groups[i], NULL, 16);
+			base->reference = g_key_file_get_boolean(file,
+								 groups[i],
+								 "Reference",
+								 NULL);
+			base->registered = true;
+			base->gravity.x = gravity[0];
+			base->gravity.y = gravity[1];
+			base->gravity.z = gravity[2];
+			base->pose.rotation.w = rotation[0];
+			base->pose.rotation.x = rotation[1];
+			base->pose.rotation.y = rotation[2];
+			base->pose.rotation.z = rotation[3];
+			dquat_normalize(&base->pose.rotation);
+			base->pose.translation.x = translation[0];
+			base->pose.translation.y = translation[1];
+			base->pose.translation.z = translation[2];
+			room_num_bases++;
+		}
+		g_free(gravity);
+		g_free(rotation);
+		g_free(translation);
+	}
+
+	g_print("Lighthouse: Loaded %u base stations from %s\n",
+		room_num_bases, filename);
+
+	g_strfreev(groups);
+	g_key_file_free(file);
+	g_free(filename);
+
+	g_mutex_unlock(&room_mutex);
+}
+
+static bool room_any_seen_registered(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < room_num_bases; i++) {
+		if (room_bases[i].seen && room_bases[i].registered)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Adds a base station whose OOTX frame was received. If none of the base
+ * stations seen so far are registered from a previous session, the room
+ * setup has changed: forget the cached base stations and make this the
+ * reference.
+ */
+void lighthouse_room_add_base(uint32_t serial, const vec3 *gravity)
+{
+	const dquat identity = { 0.0, 0.0, 0.0, 1.0 };
+	struct room_base *base;
+	unsigned int i, j;
+
+	g_mutex_lock(&room_mutex);
+
+	base = room_find_base(serial);
+	if (base) {
+		base->seen = true;
+		base->gravity = *gravity;
+		goto out;
+	}
+
+	if (!room_any_seen_registered()) {
+		for (i = 0, j = 0; i < room_num_bases; i++) {
+			if (room_bases[i].seen)
+				room_bases[j++] = room_bases[i];
+		}
+		room_num_bases = j;
+	}
+
+	if (room_num_bases == LIGHTHOUSE_ROOM_MAX_BASES)
+		goto out;
+
+	base = &room_bases[room_num_bases++];
+	memset(base, 0, sizeof(*base));
+	base->serial = serial;
+	base->gravity = *gravity;
+	base->seen = true;
+
+	if (!room_any_seen_registered()) {
+		g_print("Lighthouse: Base %X is the reference base station\n",
+			serial);
+		gravity_alignment(&base->pose.rotation, gravity, &identity);
+		base->reference = true;
+		base->registered = true;
+		room_schedule_save();
+	}
+
+out:
+	g_mutex_unlock(&room_mutex);
+}
+
+/*
+ * Accumulates a pose sample of the base station b relative to the already
+ * registered base station a.
+ */
+static void room_add_sample(struct room_base *a, const struct dpose *pose_a,
+			    struct room_base *b, const struct dpose *pose_b)
+{
+	struct dpose inv, sample;
+	dquat *sum = &b->rotation_sum;
+	dquat align, q;
+	double dx, dy, dz;
+
+	pose_inverse(&inv, pose_b);
+	pose_mult(&sample, pose_a, &inv);
+	pose_mult(&sample, &a->pose, &sample);
+
+	if (b->registered) {
+		/* Check whether the base station was moved */
+		dx = sample.translation.x - b->pose.translation.x;
+		dy = sample.translation.y - b->pose.translation.y;
+		dz = sample.translation.z - b->pose.translation.z;
+		if (dx * dx + dy * dy + dz * dz <
+		    LIGHTHOUSE_ROOM_MAX_DEVIATION * LIGHTHOUSE_ROOM_MAX_DEVIATION) {
+			b->num_mismatches = 0;
+			return;
+		}
+		if (++b->num_mismatches < LIGHTHOUSE_ROOM_MAX_MISMATCHES)
+			return;
+
+		g_print("Lighthouse: Base %X moved, registering again\n",
+			b->serial);
+		b->registered = false;
+		b->num_samples = 0;
+		b->num_mismatches = 0;
+	}
+
+	/* Average quaternions in the same hemisphere */
+	if (b->num_samples && dquat_dot(sum, &sample.rotation) < 0.0) {
+		sample.rotation.w = -sample.rotation.w;
+		sample.rotation.x = -sample.rotation.x;
+		sample.rotation.y = -sample.rotation.y;
+		sample.rotation.z = -sample.rotation.z;
+	}
+	if (!b->num_samples) {
+		*sum = (dquat){ 0.0, 0.0, 0.0, 0.0 };
+		b->translation_sum = (dvec3){ 0.0, 0.0, 0.0 };
+	}
+	sum->w += sample.rotation.w;
+	sum->x += sample.rotation.x;
+	sum->y += sample.rotation.y;
+	sum->z += sample.rotation.z;
+	b->translation_sum.x += sample.translation.x;
+	b->translation_sum.y += sample.translation.y;
+	b->translation_sum.z += sample.translation.z;
+
+	if (++b->num_samples < LIGHTHOUSE_ROOM_NUM_SAMPLES)
+		return;
+
+	/*
+	 * Use the base station's own gravity measurement to correct the
+	 * averaged orientation's tilt.
+	 */
+	q = *sum;
+	dquat_normalize(&q);
+	gravity_alignment(&align, &b->gravity, &q);
+	dquat_mult(&b->pose.rotation, &align, &q);
+	dquat_normalize(&b->pose.rotation);
+	b->pose.translation.x = b->translation_sum.x / b->num_samples;
+	b->pose.translation.y = b->translation_sum.y / b->num_samples;
+	b->pose.translation.z = b->translation_sum.z / b->num_samples;
+	b->registered = true;
+	b->num_samples = 0;
+
+	g_print("Lighthouse: Base %X registered at [ %6.3f %6.3f %6.3f ]\n",
+		b->serial, b->pose.translation.x, b->pose.translation.y,
+		b->pose.translation.z);
+
+	room_schedule_save();
+}
+
+/*
+ * Adds simultaneous pose estimates of the same device relative to two base
+ * stations, to register one base station relative to the other.
+ */
+void lighthouse_room_add_observation(uint32_t serial_a,
+				     const struct dpose *pose_a,
+				     uint32_t serial_b,
+				     const struct dpose *pose_b)
+{
+	struct room_base *a, *b;
+
+	g_mutex_lock(&room_mutex);
+
+	a = room_find_base(serial_a);
+	b = room_find_base(serial_b);
+	if (!a || !b || a == b)
+		goto out;
+
+	/*
+	 * Register the unregistered base station relative to the registered
+	 * one, or check that a registered base station has not been moved
+	 * relative to the reference.
+	 */
+	if (a->registered && !b->reference)
+		room_add_sample(a, pose_a, b, pose_b);
+	else if (b->registered && !a->reference)
+		room_add_sample(b, pose_b, a, pose_a);
+
+out:
+	g_mutex_unlock(&room_mutex);
+}
+
+/*
+ * Transforms a device pose relative to the given base station into the room
+ * coordinate system. Returns false if the base station is not registered.
+ */
+bool lighthouse_room_get_pose(uint32_t serial, const struct dpose *pose,
+			      struct dpose *room_pose)
+{
+	struct room_base *base;
+	bool ret = false;
+
+	g_mutex_lock(&room_mutex);
+
+	base = room_find_base(serial);
+	if (base && base->registered) {
+		pose_mult(room_pose, &base->pose, pose);
+		ret = true;
+	}
+
+	g_mutex_unlock(&room_mutex);
+
+	return ret;
+}
@@ -0,0 +1,24 @@
+/*
+ * Lighthouse base station registration
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __LIGHTHOUSE_ROOM_H__
+#define __LIGHTHOUSE_ROOM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "maths.h"
+
+void lighthouse_room_load(void);
+void lighthouse_room_add_base(uint32_t serial, const vec3 *gravity);
+void lighthouse_room_add_observation(uint32_t serial_a,
+				     const struct dpose *pose_a,
+				     uint32_t serial_b,
+				     const struct dpose *pose_b);
+bool lighthouse_room_get_pose(uint32_t serial, const struct dpose *pose,
+			      struct dpose *room_pose);
+
+#endif /* __LIGHTHOUSE_ROOM_H__ */
@@ -4,11 +4,16 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 #include <asm/byteorder.h>
+#include <errno.h>
 #include <glib.h>
 #include <stdint.h>
 #include <string.h>
 #include <zlib.h>
 #include "lighthouse.h"
+#include "lighthouse-ootx.h"
+#include "lighthouse-pose.h"
+#include "lighthouse-room.h"
+#include "log-ring.h"
 #include "maths.h"
 #include "telemetry.h"
 
@@ -25,6 +30,32 @@ struct lighthouse_ootx_report {
 	__le16 gibmag[2];
 } __attribute__((packed));
 
+/*
+ * Only combine horizontal and vertical sweeps less than 21 ms apart, and
+ * use the previous pose as initial guess if it is less than 100 ms old.
+ */
+#define LIGHTHOUSE_POSE_MAX_FRAME_DISTANCE	1000000
+#define LIGHTHOUSE_POSE_MAX_AGE			4800000
+#define LIGHTHOUSE_POSE_MAX_ERROR		0.005
+
+/*
+ * Only use poses relative to both base stations for registration if they
+ * were estimated less than 21 ms apart.
+ */
+#define LIGHTHOUSE_ROOM_MAX_POSE_DISTANCE	1000000
+
+/*
+ * Sweep hits further away from the predicted offset than four standard
+ * deviations of the recent prediction error, but at least 2000 ticks
+ * (about 0.9°), are rejected as reflections. Predictions older than
+ * 100 ms are not used, and after three consecutive frames with only
+ * rejected hits the predictor is restarted to follow sudden movements.
+ */
+#define LIGHTHOUSE_SWEEP_GATE_SIGMAS		4.0
+#define LIGHTHOUSE_SWEEP_GATE_MIN		2000.0
+#define LIGHTHOUSE_SWEEP_MAX_AGE		4800000
+#define LIGHTHOUSE_SWEEP_MAX_REJECTS		3
+
 static unsigned int watchman_id;
 
 static inline float __le16_to_float(__le16 le16)
@@ -61,38 +92,26 @@ static inline gboolean pulse_in_sweep_window(int32_t dt, uint16_t duration)
 	return dt > (55555 - 1000) && (dt + duration) < (346667 + 1000);
 }
 
-static void lighthouse_base_handle_ootx_frame(struct lighthouse_base *base)
+/*
+ * Parses the OOTX frame payload containing the base station calibration.
+ * Returns 0 on success or a negative error code.
+ */
+static int lighthouse_base_handle_ootx_frame(struct lighthouse_base *base,
+					     const uint8_t *payload)
 {
-	struct lighthouse_ootx_report *report = (void *)(base->ootx + 2);
-	uint16_t len = __le16_to_cpup((__le16 *)base->ootx);
-	uint32_t crc = crc32(0L, Z_NULL, 0);
+	const struct lighthouse_ootx_report *report = (const void *)payload;
 	gboolean serial_changed = FALSE;
-	uint32_t ootx_crc;
 	uint16_t version;
 	int ootx_version;
 	vec3 gravity;
 	int i;
 
-	if (len != 33) {
-		g_print("Lighthouse Base %X: unexpected OOTX payload length: %d\n",
-			base->serial, len);
-		return;
-	}
-
-	ootx_crc = __le32_to_cpup((__le32 *)(base->ootx + 36)); /* (len+3)/4*4 */
-	crc = crc32(crc, base->ootx + 2, 33);
-	if (ootx_crc != crc) {
-		g_print("Lighthouse Base %X: CRC error: %08x != %08x\n",
-			base->serial, crc, ootx_crc);
-		return;
-	}
-
 	version = __le16_to_cpu(report->version);
 	ootx_version = version & 0x3f;
 	if (ootx_version != 6) {
 		g_print("Lighthouse Base %X: unexpected OOTX frame version: %d\n",
 			base->serial, ootx_version);
-		return;
+		return -EINVAL;
 	}
 
 	base->firmware_version = version >> 6;
@@ -148,91 +167,217 @@ static void lighthouse_base_handle_ootx_frame(struct lighthouse_base *base)
 		g_print("Lighthouse Base %X: reset count: %d\n", base->serial,
 			base->reset_count);
 	}
-}
 
-static void lighthouse_base_reset(struct lighthouse_base *base)
-{
-	base->data_sync = 0;
-	base->data_word = -1;
-	base->data_bit = 0;
-	memset(base->ootx, 0, sizeof(base->ootx));
+	lighthouse_room_add_base(base->serial, &base->gravity);
+
+	return 0;
 }
 
+/*
+ * Applies the cached calibration of a base station seen in a previous
+ * session as soon as its serial number is received, so that it can be
+ * used before the complete OOTX frame is received.
+ */
 static void
-lighthouse_base_handle_ootx_data_word(struct lighthouse_watchman *watchman,
-				      struct lighthouse_base *base)
+lighthouse_base_handle_ootx_serial(struct lighthouse_watchman *watchman,
+				   struct lighthouse_base *base)
 {
-	uint16_t len = __le16_to_cpup((__le16 *)base->ootx);
+	const struct lighthouse_ootx_report *report =
+		(const void *)lighthouse_ootx_payload(&base->ootx);
+	uint16_t ootx_version = __le16_to_cpu(report->version) & 0x3f;
+	uint32_t serial = __le32_to_cpu(report->serial);
+	uint8_t payload[LIGHTHOUSE_OOTX_PAYLOAD_LEN];
 
-	/* After 4 OOTX words we have received the base station serial number */
-	if (base->data_word == 4) {
-		struct lighthouse_ootx_report *report = (void *)(base->ootx + 2);
-		uint16_t ootx_version = __le16_to_cpu(report->version) & 0x3f;
-		uint32_t serial = __le32_to_cpu(report->serial);
+	if (ootx_version != 6 || serial == base->serial)
+		return;
 
-		if (len != 33) {
-			g_print("%s: unexpected OOTX frame length %d\n",
-				watchman->name, len);
-			return;
-		}
+	g_print("%s: spotted Lighthouse Base %X\n", watchman->name, serial);
 
-		if (ootx_version == 6 && serial != base->serial) {
-			g_print("%s: spotted Lighthouse Base %X\n",
-				watchman->name, serial);
-		}
-	}
-	if (len == 33 && base->data_word == 20) { /* (len + 3)/4 * 2 + 2 */
-		lighthouse_base_handle_ootx_frame(base);
+	if (lighthouse_ootx_cache_lookup(serial, payload)) {
+		g_print("Lighthouse Base %X: using cached calibration\n",
+			serial);
+		lighthouse_base_handle_ootx_frame(base, payload);
 	}
 }
 
 static void
 lighthouse_base_handle_ootx_data_bit(struct lighthouse_watchman *watchman,
 				     struct lighthouse_base *base,
-				     gboolean data)
+				     gboolean data, uint32_t timestamp)
 {
-	if (base->data_word >= (int)sizeof(base->ootx) / 2) {
-		base->data_word = -1;
-	} else if (base->data_word >= 0) {
-		if (base->data_bit == 16) {
-			/* Sync bit */
-			base->data_bit = 0;
-			if (data) {
-				base->data_word++;
-				lighthouse_base_handle_ootx_data_word(watchman,
-								      base);
-			} else {
-				g_print("%s: Missed a sync bit, restarting\n",
-					watchman->name);
-				/* Missing sync bit, restart */
-				base->data_word = -1;
-			}
-		} else if (base->data_bit < 16) {
-			/*
-			 * Each 16-bit payload word contains two bytes,
-			 * transmitted MSB-first.
-			 */
-			if (data) {
-				int idx = 2 * base->data_word +
-					  (base->data_bit >> 3);
+	struct lighthouse_ootx *ootx = &base->ootx;
+	const uint8_t *payload;
+
+	switch (lighthouse_ootx_handle_bit(ootx, data, timestamp)) {
+	case LIGHTHOUSE_OOTX_NONE:
+		break;
+	case LIGHTHOUSE_OOTX_SYNC_ERROR:
+		ouvrt_log("%s: Missed a sync bit, restarting\n",
+			  watchman->name);
+		break;
+	case LIGHTHOUSE_OOTX_LENGTH_ERROR:
+		g_print("%s: unexpected OOTX frame length %d\n",
+			watchman->name, __le16_to_cpup((__le16 *)ootx->data));
+		break;
+	case LIGHTHOUSE_OOTX_SERIAL:
+		lighthouse_base_handle_ootx_serial(watchman, base);
+		break;
+	case LIGHTHOUSE_OOTX_FRAME:
+		payload = lighthouse_ootx_payload(ootx);
+		if (lighthouse_base_handle_ootx_frame(base, payload) == 0)
+			lighthouse_ootx_cache_store(base->serial, payload);
+		break;
+	case LIGHTHOUSE_OOTX_CRC_ERROR:
+		g_print("Lighthouse Base %X: CRC error\n", base->serial);
+		break;
+	}
+}
 
-				base->ootx[idx] |= 0x80 >> (base->data_bit % 8);
-			}
-			base->data_bit++;
-		}
+/*
+ * Estimates the pose relative to the base station from the just completed
+ * sweep frame and the most recent frame of the other rotor.
+ */
+static void lighthouse_base_update_pose(struct lighthouse_watchman *watchman,
+					struct lighthouse_base *base)
+{
+	struct lighthouse_base *other = &watchman->base[base == watchman->base];
+	struct lighthouse_frame *frame = base->frame;
+	uint32_t sync_timestamp = frame[base->active_rotor].sync_timestamp;
+	struct dpose room_pose;
+	bool use_guess;
+	double error;
+
+	if (!watchman->model.num_points ||
+	    sync_timestamp - frame[!base->active_rotor].sync_timestamp >
+	    LIGHTHOUSE_POSE_MAX_FRAME_DISTANCE)
+		return;
+
+	use_guess = base->pose_valid &&
+		    sync_timestamp - base->pose_timestamp <
+		    LIGHTHOUSE_POSE_MAX_AGE;
+
+	base->pose_valid = lighthouse_pose_solve(&watchman->model,
+						 &base->calibration,
+						 base->frame, &base->pose,
+						 use_guess, &error) &&
+			   error < LIGHTHOUSE_POSE_MAX_ERROR;
+	if (!base->pose_valid)
+		return;
+
+	base->pose_timestamp = sync_timestamp;
+
+	/*
+	 * Poses relative to both base stations at about the same time allow
+	 * to register one base station relative to the other.
+	 */
+	if (base->serial && other->serial && other->pose_valid &&
+	    sync_timestamp - other->pose_timestamp <
+	    LIGHTHOUSE_ROOM_MAX_POSE_DISTANCE) {
+		lighthouse_room_add_observation(base->serial, &base->pose,
+						other->serial, &other->pose);
 	}
 
-	/* Preamble detection */
-	if (data) {
-		if (base->data_sync > 16) {
-			/* Preamble detected, restart bit capture */
-			memset(base->ootx, 0, sizeof(base->ootx));
-			base->data_word = 0;
-			base->data_bit = 0;
+	/* Only report poses relative to registered base stations */
+	if (lighthouse_room_get_pose(base->serial, &base->pose, &room_pose))
+		telemetry_send_pose(watchman->id, &room_pose);
+}
+
+/*
+ * Returns the expected sweep pulse center offset at the given sync timestamp
+ * and the maximum allowed distance from it, or false if there is no recent
+ * prediction.
+ */
+static bool
+lighthouse_sweep_predict(struct lighthouse_sweep_predictor *predictor,
+			 uint32_t timestamp, double *offset, double *gate)
+{
+	uint32_t dt = timestamp - predictor->timestamp;
+
+	if (!predictor->valid || dt > LIGHTHOUSE_SWEEP_MAX_AGE)
+		return false;
+
+	*offset = predictor->offset + predictor->velocity * dt;
+	*gate = LIGHTHOUSE_SWEEP_GATE_SIGMAS * sqrt(predictor->variance);
+	if (*gate < LIGHTHOUSE_SWEEP_GATE_MIN)
+		*gate = LIGHTHOUSE_SWEEP_GATE_MIN;
+
+	return true;
+}
+
+/*
+ * Updates the sweep predictor with an accepted sweep pulse center offset.
+ * Velocity and prediction error variance are exponentially smoothed.
+ */
+static void
+lighthouse_sweep_predictor_update(struct lighthouse_sweep_predictor *predictor,
+				  uint32_t timestamp, double offset)
+{
+	uint32_t dt = timestamp - predictor->timestamp;
+	double predicted, gate, error;
+
+	predictor->rejects = 0;
+
+	if (!dt)
+		return;
+
+	if (!lighthouse_sweep_predict(predictor, timestamp, &predicted,
+				      &gate)) {
+		if (predictor->valid && dt <= LIGHTHOUSE_SWEEP_MAX_AGE * 2)
+			predictor->velocity = (offset - predictor->offset) / dt;
+		else
+			predictor->velocity = 0.0;
+		predictor->variance = LIGHTHOUSE_SWEEP_GATE_MIN *
+				      LIGHTHOUSE_SWEEP_GATE_MIN;
+		goto out;
+	}
+
+	error = offset - predicted;
+	predictor->variance += (error * error - predictor->variance) / 8;
+	predictor->velocity += 0.5 * ((offset - predictor->offset) / dt -
+				      predictor->velocity);
+out:
+	predictor->valid = true;
+	predictor->timestamp = timestamp;
+	predictor->offset = offset;
+}
+
+/*
+ * Counts frames in which all hits on a sensor were rejected.
+ */
+static void
+lighthouse_sweep_reject(struct lighthouse_sweep_predictor *predictor,
+			struct lighthouse_frame *frame, uint8_t id)
+{
+	if ((frame->sweep_ids & (1 << id)) ||
+	    predictor->reject_timestamp == frame->sync_timestamp)
+		return;
+
+	predictor->reject_timestamp = frame->sync_timestamp;
+	predictor->rejects++;
+}
+
+/*
+ * Feeds the sweep hits of a completed frame into the per-sensor predictors
+ * and restarts predictors that rejected all hits for too long.
+ */
+static void lighthouse_base_update_predictors(struct lighthouse_base *base,
+					      int rotor)
+{
+	struct lighthouse_frame *frame = &base->frame[rotor];
+	struct lighthouse_sweep_predictor *predictor = base->predictor[rotor];
+	unsigned int id;
+
+	for (id = 0; id < 32; id++) {
+		if (frame->sweep_ids & (1 << id)) {
+			lighthouse_sweep_predictor_update(&predictor[id],
+					frame->sync_timestamp,
+					frame->sweep_offset[id] +
+					frame->sweep_duration[id] / 2);
+		} else if (predictor[id].rejects >=
+			   LIGHTHOUSE_SWEEP_MAX_REJECTS) {
+			predictor[id].valid = false;
+			predictor[id].rejects = 0;
 		}
-		base->data_sync = 0;
-	} else {
-		base->data_sync++;
 	}
 }
 
@@ -256,7 +401,11 @@ static void lighthouse_base_handle_frame(struct lighthouse_watchman *watchman,
 	if (frame->frame_duration > 1000000)
 		return;
 
+	lighthouse_base_update_predictors(base, base->active_rotor);
+
 	telemetry_send_lighthouse_frame(watchman->id, frame);
+
+	lighthouse_base_update_pose(watchman, base);
 }
 
 /*
@@ -286,8 +435,8 @@ static void lighthouse_handle_sync_pulse(struct lighthouse_watchman *watchman,
 		return;
 
 	if (sync->duration < 2750 || sync->duration > 6750) {
-		g_print("%s: Unknown pulse length: %d\n", watchman->name,
-			sync->duration);
+		ouvrt_log("%s: Unknown pulse length: %d\n", watchman->name,
+			  sync->duration);
 		return;
 	}
 	code = (sync->duration - 2750) / 500;
@@ -313,11 +462,13 @@ static void lighthouse_handle_sync_pulse(struct lighthouse_watchman *watchman,
 		} else {
 			/* Irregular sync pulse */
 			if (watchman->last_timestamp)
-				g_print("%s: Irregular sync pulse: %08x -> %08x (%+d)\n",
-					watchman->name, watchman->last_timestamp,
-					sync->timestamp, dt);
-			lighthouse_base_reset(&watchman->base[0]);
-			lighthouse_base_reset(&watchman->base[1]);
+				ouvrt_log("%s: Irregular sync pulse: %08x -> %08x (%+d)\n",
+					  watchman->name, watchman->last_timestamp,
+					  sync->timestamp, dt);
+			/*
+			 * The OOTX decoders skip over the data bits missed
+			 * until the sync signal is regained.
+			 */
 		}
 
 		watchman->last_timestamp = sync->timestamp;
@@ -327,7 +478,8 @@ static void lighthouse_handle_sync_pulse(struct lighthouse_watchman *watchman,
 	base = &watchman->base[channel == 'C'];
 	base->channel = channel;
 	base->last_sync_timestamp = sync->timestamp;
-	lighthouse_base_handle_ootx_data_bit(watchman, base, (code & DATA_BIT));
+	lighthouse_base_handle_ootx_data_bit(watchman, base, (code & DATA_BIT),
+					     sync->timestamp);
 	lighthouse_base_handle_frame(watchman, base, sync->timestamp);
 
 	base->active_rotor = (code & ROTOR_BIT);
@@ -348,13 +500,13 @@ static void lighthouse_handle_sweep_pulse(struct lighthouse_watchman *watchman,
 					  uint16_t duration)
 {
 	struct lighthouse_base *base = watchman->active_base;
+	struct lighthouse_sweep_predictor *predictor;
 	struct lighthouse_frame *frame;
+	double predicted, gate, error;
 	int32_t offset;
 
-	(void)id;
-
 	if (!base) {
-		g_print("%s: sweep without sync\n", watchman->name);
+		ouvrt_log("%s: sweep without sync\n", watchman->name);
 		return;
 	}
 
@@ -367,14 +519,33 @@ static void lighthouse_handle_sweep_pulse(struct lighthouse_watchman *watchman,
 		return;
 
 	if (!pulse_in_sweep_window(offset, duration)) {
-		g_print("%s: sweep offset out of range: rotor %u offset %u duration %u\n",
-			watchman->name, base->active_rotor, offset, duration);
+		ouvrt_log("%s: sweep offset out of range: rotor %u offset %u duration %u\n",
+			  watchman->name, base->active_rotor, offset, duration);
 		return;
 	}
 
-	if (frame->sweep_ids & (1 << id)) {
-		g_print("%s: sensor %u hit twice per frame, assuming reflection\n",
-			watchman->name, id);
+	/*
+	 * Score the hit against the sensor's predicted sweep offset. Reject
+	 * outliers, and of multiple hits per frame keep the one closest to
+	 * the prediction. Without prediction, keep the first hit.
+	 */
+	predictor = &base->predictor[base->active_rotor][id];
+	if (lighthouse_sweep_predict(predictor, frame->sync_timestamp,
+				     &predicted, &gate)) {
+		error = fabs(offset + duration / 2 - predicted);
+		if (error > gate) {
+			lighthouse_sweep_reject(predictor, frame, id);
+			ouvrt_log("%s: sensor %u hit %.0f ticks from prediction, assuming reflection\n",
+				  watchman->name, id, error);
+			return;
+		}
+		if ((frame->sweep_ids & (1 << id)) &&
+		    error >= fabs(frame->sweep_offset[id] +
+				  frame->sweep_duration[id] / 2 - predicted))
+			return;
+	} else if (frame->sweep_ids & (1 << id)) {
+		ouvrt_log("%s: sensor %u hit twice per frame, assuming reflection\n",
+			  watchman->name, id);
 		return;
 	}
 
@@ -406,14 +577,15 @@ static void accumulate_sync_pulse(struct lighthouse_watchman *watchman,
 	}
 }
 
-void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
-				      uint8_t id, uint16_t duration,
-				      uint32_t timestamp)
+/*
+ * Classifies a single pulse as sync or sweep pulse, given its distance dt
+ * from the start of the last accumulated sync pulse.
+ */
+static void
+lighthouse_watchman_classify_pulse(struct lighthouse_watchman *watchman,
+				   uint8_t id, uint16_t duration,
+				   uint32_t timestamp, int32_t dt)
 {
-	int32_t dt;
-
-	dt = timestamp - watchman->last_sync.timestamp;
-
 	if (watchman->sync_lock) {
 		if (watchman->seen_by && dt > watchman->last_sync.duration) {
 			lighthouse_handle_sync_pulse(watchman, &watchman->last_sync);
@@ -434,12 +606,12 @@ void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
 			 */
 			if (dt > 407500) {
 				watchman->sync_lock = FALSE;
-				g_print("%s: late pulse, lost sync\n",
-					watchman->name);
+				ouvrt_log("%s: late pulse, lost sync\n",
+					  watchman->name);
 			} else {
-				g_print("%s: spurious pulse: %08x (%02x %d %u)\n",
-					watchman->name, timestamp, id, dt,
-					duration);
+				ouvrt_log("%s: spurious pulse: %08x (%02x %d %u)\n",
+					  watchman->name, timestamp, id, dt,
+					  duration);
 			}
 			watchman->seen_by = 0;
 		}
@@ -471,6 +643,56 @@ void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
 	}
 }
 
+void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
+				      uint8_t id, uint16_t duration,
+				      uint32_t timestamp)
+{
+	lighthouse_watchman_classify_pulse(watchman, id, duration, timestamp,
+					   timestamp -
+					   watchman->last_sync.timestamp);
+}
+
+/*
+ * Handles all pulses of a single receiver report. The receivers report
+ * pulses in arbitrary order, so they are sorted by timestamp first. Pulses
+ * that overlap the sync pulse currently being accumulated, which are most
+ * of the pulses during a sync flash, are merged into it directly.
+ */
+void lighthouse_watchman_handle_pulses(struct lighthouse_watchman *watchman,
+				       struct lighthouse_pulse *pulses,
+				       unsigned int num)
+{
+	struct lighthouse_pulse pulse;
+	unsigned int i, j;
+	int32_t dt;
+
+	for (i = 1; i < num; i++) {
+		pulse = pulses[i];
+		for (j = i; j > 0 &&
+		     (int32_t)(pulse.timestamp - pulses[j - 1].timestamp) < 0;
+		     j--)
+			pulses[j] = pulses[j - 1];
+		pulses[j] = pulse;
+	}
+
+	for (i = 0; i < num; i++) {
+		dt = pulses[i].timestamp - watchman->last_sync.timestamp;
+
+		if (watchman->sync_lock && watchman->seen_by &&
+		    dt >= 0 && dt <= (int32_t)watchman->last_sync.duration &&
+		    dt + pulses[i].duration < 6500 + 250) {
+			accumulate_sync_pulse(watchman, pulses[i].id,
+					      pulses[i].timestamp,
+					      pulses[i].duration);
+			continue;
+		}
+
+		lighthouse_watchman_classify_pulse(watchman, pulses[i].id,
+						   pulses[i].duration,
+						   pulses[i].timestamp, dt);
+	}
+}
+
 void lighthouse_watchman_init(struct lighthouse_watchman *watchman)
 {
 	watchman->id = watchman_id++;
@@ -479,4 +701,6 @@ void lighthouse_watchman_init(struct lighthouse_watchman *watchman)
 	watchman->last_timestamp = 0;
 	watchman->last_sync.timestamp = 0;
 	watchman->last_sync.duration = 0;
+	lighthouse_ootx_reset(&watchman->base[0].ootx);
+	lighthouse_ootx_reset(&watchman->base[1].ootx);
 }
@@ -13,6 +13,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "imu.h"
+#include "lighthouse-ootx.h"
 #include "maths.h"
 #include "tracking-model.h"
 
@@ -38,11 +40,22 @@ struct lighthouse_frame {
 	uint32_t frame_duration;
 };
 
+/*
+ * Tracks the sweep pulse center offset of a single sensor over consecutive
+ * frames of one rotor to predict where the next hit is expected.
+ */
+struct lighthouse_sweep_predictor {
+	bool valid;
+	uint32_t timestamp;
+	double offset;
+	double velocity;
+	double variance;
+	uint32_t reject_timestamp;
+	unsigned int rejects;
+};
+
 struct lighthouse_base {
-	int data_sync;
-	int data_word;
-	int data_bit;
-	uint8_t ootx[40];
+	struct lighthouse_ootx ootx;
 
 	int firmware_version;
 	uint32_t serial;
@@ -56,6 +69,11 @@ struct lighthouse_base {
 	int active_rotor;
 
 	struct lighthouse_frame frame[2];
+	struct lighthouse_sweep_predictor predictor[2][32];
+
+	struct dpose pose;
+	bool pose_valid;
+	uint32_t pose_timestamp;
 };
 
 struct lighthouse_pulse {
@@ -86,6 +104,9 @@ struct lighthouse_watchman {
 void lighthouse_watchman_handle_pulse(struct lighthouse_watchman *watchman,
 				      uint8_t id, uint16_t duration,
 				      uint32_t timestamp);
+void lighthouse_watchman_handle_pulses(struct lighthouse_watchman *watchman,
+				       struct lighthouse_pulse *pulses,
+				       unsigned int num);
 void lighthouse_watchman_init(struct lighthouse_watchman *watchman);
 
 #endif /* __LIGHTHOUSE_H__ */
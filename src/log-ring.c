@@ -0,0 +1,248 @@
+/*
+ * Deferred logging from real-time threads
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log-ring.h"
+
+#define LOG_RING_NUM_SLOTS		256
+#define LOG_RING_SLOT_SIZE		160
+#define LOG_RING_DRAIN_INTERVAL_US	20000
+
+#define LOG_RATELIMIT_INTERVAL_NS	1000000000ULL
+#define LOG_RATELIMIT_BURST		10
+
+/*
+ * Single producer, single consumer ring of formatted messages. head is only
+ * written by the owning thread, tail only by the drainer thread. Rings are
+ * freed by the drainer after their owning thread exited and all messages
+ * were printed.
+ */
+struct log_ring {
+	struct log_ring *next;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+	gint dead;
+	char slots[LOG_RING_NUM_SLOTS][LOG_RING_SLOT_SIZE];
+};
+
+static void log_ring_release(gpointer data);
+
+static GPrivate log_ring_key = G_PRIVATE_INIT(log_ring_release);
+static struct log_ring *log_rings;
+static GThread *log_ring_thread;
+static gint log_ring_running;
+
+static uint64_t log_ring_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void log_ring_release(gpointer data)
+{
+	struct log_ring *ring = data;
+
+	g_atomic_int_set(&ring->dead, 1);
+}
+
+/*
+ * Returns the ring of the calling thread, registering a new one with the
+ * drainer on first use. New rings are only ever prepended to the list, all
+ * other list modifications are done by the drainer thread.
+ */
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring = g_private_get(&log_ring_key);
+
+	if (ring)
+		return ring;
+
+	ring = g_new0(struct log_ring, 1);
+	g_private_set(&log_ring_key, ring);
+
+	ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	return ring;
+}
+
+/*
+ * Prints all queued messages and frees the rings of exited threads.
+ */
+static void log_ring_drain(void)
+{
+	struct log_ring **link, *ring;
+	unsigned int head, tail, dropped;
+
+	link = &log_rings;
+	while ((ring = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			fputs(ring->slots[tail % LOG_RING_NUM_SLOTS], stdout);
+			__atomic_store_n(&ring->tail, tail + 1,
+					 __ATOMIC_RELEASE);
+		}
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+					      __ATOMIC_RELAXED);
+		if (dropped)
+			printf("(%u messages dropped)\n", dropped);
+
+		/*
+		 * Unlinking the list head races with registration of new
+		 * rings, so only do it if no ring was prepended meanwhile.
+		 */
+		if (g_atomic_int_get(&ring->dead) &&
+		    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail &&
+		    __atomic_compare_exchange_n(link, &ring, ring->next, false,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			g_free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+
+	fflush(stdout);
+}
+
+static gpointer log_ring_thread_func(gpointer data)
+{
+	(void)data;
+
+	while (g_atomic_int_get(&log_ring_running)) {
+		g_usleep(LOG_RING_DRAIN_INTERVAL_US);
+		log_ring_drain();
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts the drainer thread. Until it is started, and after it is stopped,
+ * messages are printed immediately.
+ */
+void log_ring_start(void)
+{
+	if (log_ring_thread)
+		return;
+
+	g_atomic_int_set(&log_ring_running, 1);
+	log_ring_thread = g_thread_new("log-ring", log_ring_thread_func,
+				       NULL);
+}
+
+/*
+ * Stops the drainer thread and prints all remaining messages.
+ */
+void log_ring_stop(void)
+{
+	if (!log_ring_thread)
+		return;
+
+	g_atomic_int_set(&log_ring_running, 0);
+	g_thread_join(log_ring_thread);
+	log_ring_thread = NULL;
+
+	log_ring_drain();
+}
+
+/*
+ * Returns true if the call site may log another message in the current
+ * interval. On the first message of a new interval, returns the number of
+ * messages suppressed in the previous interval.
+ */
+static bool log_ratelimit(struct log_ratelimit *rl, unsigned int *suppressed)
+{
+	uint64_t now = log_ring_now();
+	uint64_t begin = __atomic_load_n(&rl->begin, __ATOMIC_RELAXED);
+
+	*suppressed = 0;
+
+	if (now - begin >= LOG_RATELIMIT_INTERVAL_NS &&
+	    __atomic_compare_exchange_n(&rl->begin, &begin, now, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&rl->suppressed, 0,
+						  __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) >=
+	    LOG_RATELIMIT_BURST) {
+		__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Formats a message into the next free slot of the calling thread's ring.
+ */
+static void log_ring_vpush(struct log_ring *ring, const char *format,
+			   va_list ap)
+{
+	unsigned int head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+	    LOG_RING_NUM_SLOTS) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	vsnprintf(ring->slots[head % LOG_RING_NUM_SLOTS], LOG_RING_SLOT_SIZE,
+		  format, ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_ring_push(struct log_ring *ring, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_ring_vpush(ring, format, ap);
+	va_end(ap);
+}
+
+/*
+ * Logs a rate limited message, without blocking if the drainer thread is
+ * running. Use via the ouvrt_log() macro.
+ */
+void log_ring_printf(struct log_ratelimit *rl, const char *format, ...)
+{
+	unsigned int suppressed;
+	struct log_ring *ring;
+	va_list ap;
+
+	if (!log_ratelimit(rl, &suppressed))
+		return;
+
+	va_start(ap, format);
+	if (g_atomic_int_get(&log_ring_running)) {
+		ring = log_ring_get();
+		if (suppressed)
+			log_ring_push(ring, "(%u similar messages suppressed)\n",
+				      suppressed);
+		log_ring_vpush(ring, format, ap);
+	} else {
+		if (suppressed)
+			printf("(%u similar messages suppressed)\n",
+			       suppressed);
+		vprintf(format, ap);
+	}
+	va_end(ap);
+}
@@ -0,0 +1,39 @@
+/*
+ * Deferred logging from real-time threads
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __LOG_RING_H__
+#define __LOG_RING_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+/*
+ * Per call site rate limit state. At most LOG_RATELIMIT_BURST messages are
+ * logged per second, the number of suppressed messages is reported with the
+ * next message logged after that.
+ */
+struct log_ratelimit {
+	uint64_t begin;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+void log_ring_start(void);
+void log_ring_stop(void);
+void log_ring_printf(struct log_ratelimit *rl, const char *format, ...)
+	G_GNUC_PRINTF(2, 3);
+
+/*
+ * Logs a message from a sensor processing thread without blocking on the
+ * output. Messages are formatted into a per-thread ring buffer and printed
+ * by a background thread. If the ring is full, messages are dropped.
+ */
+#define ouvrt_log(...)							\
+	do {								\
+		static struct log_ratelimit __rl;			\
+		log_ring_printf(&__rl, __VA_ARGS__);			\
+	} while (0)
+
+#endif /* __LOG_RING_H__ */
@@ -82,6 +82,28 @@ static inline void dquat_mult(dquat *r, dquat *p, const dquat *q)
 	r->z = p->w * q->z + p->z * q->w + p->x * q->y - p->y * q->x;
 }
 
+static inline void dquat_conj(dquat *r, const dquat *q)
+{
+	r->w = q->w;
+	r->x = -q->x;
+	r->y = -q->y;
+	r->z = -q->z;
+}
+
+/*
+ * Rotates vector v by the normalized quaternion q.
+ */
+static inline void dquat_rotate(dvec3 *r, const dquat *q, const dvec3 *v)
+{
+	const double tx = 2.0 * (q->y * v->z - q->z * v->y);
+	const double ty = 2.0 * (q->z * v->x - q->x * v->z);
+	const double tz = 2.0 * (q->x * v->y - q->y * v->x);
+
+	r->x = v->x + q->w * tx + q->y * tz - q->z * ty;
+	r->y = v->y + q->w * ty + q->z * tx - q->x * tz;
+	r->z = v->z + q->w * tz + q->x * ty - q->y * tx;
+}
+
 void dquat_from_axis_angle(dquat *quat, const dvec3 *axis, double angle);
 void dquat_from_axes(dquat *q, const vec3 *a, const vec3 *b);
 void dquat_from_gyro(dquat *q, const vec3 *gyro, double dt);
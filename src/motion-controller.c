@@ -12,6 +12,7 @@
 
 #include "motion-controller.h"
 #include "buttons.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
@@ -22,6 +23,7 @@ struct _OuvrtMotionController {
 
 	bool missing;
 	uint64_t last_timestamp;
+	struct clock_sync clock;
 	uint8_t buttons;
 	uint8_t battery;
 	uint8_t touchpad[2];
@@ -98,6 +100,8 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 		.gyro = { gyro[0], gyro[1], gyro[2] },
 	};
 
+	clock_sync_update(&self->clock, raw.time, clock_sync_host_now());
+
 	/*
 	 * Transform from IMU coordinate system into common coordinate system:
 	 *
@@ -110,7 +114,7 @@ static void motion_controller_decode_message(OuvrtMotionController *self,
 	 * TODO: Apply accelerometer scale and bias from the calibration data.
 	 */
 	struct imu_sample sample = {
-		.time = raw.time * 1e-7,
+		.time = 1e-9 * clock_sync_ticks_to_host(&self->clock, raw.time),
 		.acceleration = {
 			.x = accel[0] * STANDARD_GRAVITY / 506200.,
 			.y = accel[2] * STANDARD_GRAVITY / 506200.,
@@ -153,10 +157,12 @@ static int motion_controller_start(G_GNUC_UNUSED OuvrtDevice *dev)
 static void motion_controller_thread(OuvrtDevice *dev)
 {
 	OuvrtMotionController *self = OUVRT_MOTION_CONTROLLER(dev);
-	unsigned char buf[64];
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
 	struct timespec ts;
 	struct pollfd fds;
 	int ret;
+	int i;
 
 	while (dev->active) {
 		fds.fd = dev->fd;
@@ -190,18 +196,22 @@ static void motion_controller_thread(OuvrtDevice *dev)
 			continue;
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
+		ret = hid_read_reports(dev->fd, buf[0], 64, len,
+				       HID_REPORT_BATCH);
 		if (ret == -1) {
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
 		}
-		if (ret != 45 || buf[0] != 0x01) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
 
-		motion_controller_decode_message(self, buf, &ts);
+		for (i = 0; i < ret; i++) {
+			if (len[i] != 45 || buf[i][0] != 0x01) {
+				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+					dev->name, len[i], buf[i][0]);
+				continue;
+			}
+
+			motion_controller_decode_message(self, buf[i], &ts);
+		}
 	}
 }
 
@@ -232,6 +242,7 @@ ouvrt_motion_controller_class_init(OuvrtMotionControllerClass *klass)
 static void ouvrt_motion_controller_init(OuvrtMotionController *self)
 {
 	self->dev.type = DEVICE_TYPE_CONTROLLER;
+	clock_sync_init(&self->clock, 10000000, 64);
 	self->imu.pose.rotation.w = 1.0;
 }
 
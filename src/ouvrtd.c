@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <libudev.h>
 #include <locale.h>
@@ -15,20 +16,30 @@
 #include <stdlib.h>
 #include <sys/fcntl.h>
 
+#include "cache.h"
 #include "dbus.h"
 #include "debug.h"
 #include "device.h"
+#include "device-registry.h"
 #include "usb-ids.h"
 #include "psvr.h"
 #include "rift.h"
 #include "rift-sensor.h"
 #include "camera-dk2.h"
+#include "camera-v4l2.h"
 #include "hololens-camera.h"
 #include "hololens-camera2.h"
 #include "hololens-imu.h"
 #include "motion-controller.h"
 #include "lenovo-explorer.h"
+#include "lighthouse-room.h"
+#include "log-ring.h"
 #include "pipewire.h"
+#include "recorder.h"
+#include "replay.h"
+#include "replay-camera.h"
+#include "replay-rift.h"
+#include "replay-vive-headset.h"
 #include "telemetry.h"
 #include "vive-headset.h"
 #include "vive-headset-mainboard.h"
@@ -160,58 +171,40 @@ static const struct device_match device_matches[NUM_MATCHES] = {
 };
 
 GMainLoop *loop = NULL;
-GList *device_list = NULL;
-static int num_devices;
-
-/*
- * Compares the device's parent against a given parent.
- */
-static gint ouvrt_device_cmp_parent_devpath(OuvrtDevice *dev,
-					    const char *parent_devpath)
-{
-	return g_strcmp0(dev->parent_devpath, parent_devpath);
-}
-
-/*
- * Compares the device's serial against a given serial.
- */
-static gint ouvrt_device_cmp_serial(OuvrtDevice *dev, const char *serial)
-{
-	return g_strcmp0(dev->serial, serial);
-}
 
 /*
  * Links Rift DK2 HMD and Tracker DK2 camera.
  */
 static void ouvrt_link_rift_dk2(OuvrtDevice *dev)
 {
-	GList *link;
+	OuvrtDevice *other;
 	OuvrtRift *rift;
 	OuvrtCameraDK2 *camera;
 
-	link = g_list_find_custom(device_list, dev->serial,
-				  (GCompareFunc)ouvrt_device_cmp_serial);
-	if (!link)
+	other = device_registry_lookup_serial(dev->serial);
+	if (!other)
 		return;
 
 	if (OUVRT_IS_RIFT(dev) &&
-	    OUVRT_IS_CAMERA_DK2(link->data)) {
+	    OUVRT_IS_CAMERA_DK2(other)) {
 		g_print("Associate %s and %s\n", dev->devnode,
-			OUVRT_DEVICE(link->data)->devnode);
+			other->devnode);
 		rift = OUVRT_RIFT(dev);
-		camera = OUVRT_CAMERA_DK2(link->data);
+		camera = OUVRT_CAMERA_DK2(other);
 	} else if (OUVRT_IS_CAMERA_DK2(dev) &&
-		   OUVRT_IS_RIFT(link->data)) {
+		   OUVRT_IS_RIFT(other)) {
 		camera = OUVRT_CAMERA_DK2(dev);
-		rift = OUVRT_RIFT(link->data);
+		rift = OUVRT_RIFT(other);
 	} else {
+		g_object_unref(other);
 		return;
 	}
 
-	g_print("Associate %s and %s\n", dev->devnode,
-		OUVRT_DEVICE(link->data)->devnode);
+	g_print("Associate %s and %s\n", dev->devnode, other->devnode);
 
 	ouvrt_camera_dk2_set_tracker(camera, ouvrt_rift_get_tracker(rift));
+
+	g_object_unref(other);
 }
 
 static void ouvrt_link_rift_sensor_to_rift(gpointer data, gpointer user_data)
@@ -242,26 +235,57 @@ static void ouvrt_link_rift_sensor_to_rift(gpointer data, gpointer user_data)
  */
 static void ouvrt_link_rift_cv1(OuvrtDevice *dev)
 {
-	if (OUVRT_IS_RIFT(dev)) {
-		g_list_foreach(device_list, ouvrt_link_rift_sensor_to_rift, dev);
+	GPtrArray *devices;
+	unsigned int i;
+
+	if (!OUVRT_IS_RIFT(dev) && !OUVRT_IS_RIFT_SENSOR(dev))
 		return;
-	}
 
-	if (OUVRT_IS_RIFT_SENSOR(dev)) {
-		GList *link;
+	devices = device_registry_snapshot();
 
-		for (link = device_list; link != NULL; link = link->next) {
-			if (OUVRT_IS_RIFT(link->data)) {
-				ouvrt_link_rift_sensor_to_rift(dev, link->data);
-				return;
+	if (OUVRT_IS_RIFT(dev)) {
+		g_ptr_array_foreach(devices, ouvrt_link_rift_sensor_to_rift,
+				    dev);
+	} else {
+		for (i = 0; i < devices->len; i++) {
+			if (OUVRT_IS_RIFT(devices->pdata[i])) {
+				ouvrt_link_rift_sensor_to_rift(dev,
+							devices->pdata[i]);
+				break;
 			}
 		}
 	}
+
+	g_ptr_array_unref(devices);
+}
+
+/*
+ * Exports the device via D-Bus when it was started successfully, unless it
+ * was removed while starting.
+ */
+static void ouvrtd_device_started(GObject *source, GAsyncResult *result,
+				  G_GNUC_UNUSED gpointer user_data)
+{
+	OuvrtDevice *d = OUVRT_DEVICE(source);
+	int ret;
+
+	ret = ouvrt_device_start_finish(d, result);
+	if (ret == -ECANCELED)
+		return;
+	if (ret < 0) {
+		g_print("%s: Failed to start: %d\n", d->name, ret);
+		return;
+	}
+
+	if (!device_registry_contains(d))
+		return;
+
+	ouvrt_dbus_export_device(d);
 }
 
 /*
  * Check if an added device matches the table of known hardware, if yes create
- * a new device structure and start the device.
+ * a new device structure and start the device in the background.
  */
 static void ouvrtd_device_add(struct udev_device *dev)
 {
@@ -397,18 +421,18 @@ static void ouvrtd_device_add(struct udev_device *dev)
 	 * device, join the existing device.
 	 */
 	if (device_matches[i].num_interfaces > 1) {
-		GList *link;
+		d = device_registry_lookup_parent_devpath(parent_devpath);
+		if (d) {
+			/* The registry keeps the device alive */
+			g_object_unref(d);
 
-		link = g_list_find_custom(device_list, parent_devpath,
-					  (GCompareFunc)ouvrt_device_cmp_parent_devpath);
-		if (link) {
-			d = OUVRT_DEVICE(link->data);
 			if (d->devnodes[j]) {
 				g_print("udev: Interface %d occupied by %s\n",
 					iface, d->devnodes[j]);
 				return;
 			} else {
 				d->devnodes[j] = g_strdup(devnode);
+				device_registry_add_devnode(d, devnode);
 			}
 
 			for (j = 0; j < device_matches[i].num_interfaces; j++) {
@@ -449,7 +473,8 @@ static void ouvrtd_device_add(struct udev_device *dev)
 
 	ouvrt_link_rift_cv1(d);
 
-	device_list = g_list_append(device_list, d);
+	device_registry_add(d);
+	g_object_unref(d);
 
 	for (j = 0; j < device_matches[i].num_interfaces; j++) {
 		if (d->devnodes[j] == NULL)
@@ -457,43 +482,30 @@ static void ouvrtd_device_add(struct udev_device *dev)
 	}
 
 start:
-	ouvrt_device_start(d);
-	ouvrt_dbus_export_device(d);
-}
-
-/*
- * Compares the device's devnode against a given device node.
- */
-static gint ouvrt_device_cmp_devnode(OuvrtDevice *dev, const char *devnode)
-{
-	return g_strcmp0(dev->devnode, devnode);
+	ouvrt_device_start_async(d, ouvrtd_device_started,
+				 NULL); /* user_data */
 }
 
 /*
- * Check if a removed device matches a registered device structure. If yes,
- * dereference the device to stop it and free the device structure.
+ * Check if a removed device node belongs to a registered device. If yes,
+ * stop the device and dereference it to free the device structure. A start
+ * task still holding a reference returns without starting the device.
  */
 static int ouvrtd_device_remove(struct udev_device *dev)
 {
 	const char *devnode;
 	OuvrtDevice *d;
-	GList *link;
 
 	devnode = udev_device_get_devnode(dev);
-	link = g_list_find_custom(device_list, devnode,
-				  (GCompareFunc)ouvrt_device_cmp_devnode);
-	if (link == NULL)
+	d = device_registry_remove_devnode(devnode);
+	if (d == NULL)
 		return 0;
 
-	d = OUVRT_DEVICE(link->data);
-
 	ouvrt_dbus_unexport_device(d);
 
 	g_print("Removing device: %s\n", devnode);
-	device_list = g_list_remove_link(device_list, link);
+	ouvrt_device_stop(d);
 	g_object_unref(d);
-	g_list_free_1(link);
-	num_devices--;
 
 	return 0;
 }
@@ -629,26 +641,150 @@ static void device_stop(gpointer data, G_GNUC_UNUSED gpointer user_data)
 	ouvrt_device_stop(data);
 }
 
-static void ouvrtd_signal_handler(int sig)
+/*
+ * Stops all registered devices.
+ */
+static void ouvrtd_stop_devices(void)
+{
+	GPtrArray *devices;
+
+	devices = device_registry_snapshot();
+	g_ptr_array_foreach(devices, device_stop,
+			    NULL); /* user_data */
+	g_ptr_array_unref(devices);
+}
+
+/*
+ * Stops all devices and quits when all replayed streams have finished.
+ */
+static gboolean ouvrtd_replay_done(G_GNUC_UNUSED gpointer user_data)
+{
+	g_print("Replay: All streams finished\n");
+
+	ouvrtd_stop_devices();
+
+	g_main_loop_quit(loop);
+
+	return FALSE;
+}
+
+/*
+ * Creates replay devices for all supported streams in the recording, links
+ * replayed cameras to the replayed Rift's tracker, and starts them.
+ */
+static void ouvrtd_replay_startup(struct replay *replay)
+{
+	const struct recorder_stream_info *info;
+	OuvrtReplayRift *rift = NULL;
+	GPtrArray *devices;
+	unsigned int i;
+	OuvrtDevice *d;
+
+	replay_set_done_callback(replay, ouvrtd_replay_done, NULL);
+
+	for (i = 0; i < replay_get_num_streams(replay); i++) {
+		info = replay_get_stream_info(replay, i);
+		if (!info)
+			continue;
+
+		d = NULL;
+		if (info->device_type == DEVICE_TYPE_HMD &&
+		    strncmp(info->name, "Rift", 4) == 0) {
+			d = replay_rift_new(replay, i);
+			if (d && !rift)
+				rift = OUVRT_REPLAY_RIFT(d);
+		} else if (info->device_type == DEVICE_TYPE_HMD &&
+			   strncmp(info->name, "Vive Headset", 12) == 0) {
+			d = replay_vive_headset_new(replay, i);
+		} else if (info->device_type == DEVICE_TYPE_CAMERA) {
+			d = replay_camera_new(replay, i);
+		}
+		if (d == NULL) {
+			g_print("Replay: Skipping stream %u (%.32s)\n", i,
+				info->name);
+			continue;
+		}
+
+		device_registry_add(d);
+		g_object_unref(d);
+	}
+
+	devices = device_registry_snapshot();
+
+	if (!devices->len) {
+		g_print("Replay: No supported streams\n");
+		g_idle_add(ouvrtd_replay_done, NULL);
+		g_ptr_array_unref(devices);
+		return;
+	}
+
+	for (i = 0; i < devices->len; i++) {
+		d = OUVRT_DEVICE(devices->pdata[i]);
+		if (rift && OUVRT_IS_REPLAY_CAMERA(d)) {
+			ouvrt_replay_camera_set_tracker(OUVRT_REPLAY_CAMERA(d),
+					ouvrt_replay_rift_get_tracker(rift));
+		}
+	}
+
+	replay_set_num_active_streams(replay, devices->len);
+
+	for (i = 0; i < devices->len; i++) {
+		d = OUVRT_DEVICE(devices->pdata[i]);
+		if (ouvrt_device_start(d) < 0)
+			replay_stream_done(replay);
+		ouvrt_dbus_export_device(d);
+	}
+
+	g_ptr_array_unref(devices);
+}
+
+/*
+ * Stops all devices and quits on SIGINT. This is dispatched from the main
+ * loop, not from signal context, as stopping devices takes locks.
+ */
+static gboolean ouvrtd_signal_handler(G_GNUC_UNUSED gpointer user_data)
 {
-	signal(sig, SIG_IGN);
 	g_print(" - stopping all devices\n");
 
-	g_list_foreach(device_list, device_stop,
-		       NULL); /* user_data */
+	ouvrtd_stop_devices();
 
 	g_main_loop_quit(loop);
+
+	return FALSE;
 }
 
 static void ouvrtd_usage(void)
 {
 	g_print("ouvrtd [OPTIONS...] ...\n\n"
 		"Positional tracking daemon for Oculus VR Rift DK2.\n\n"
-		"  -h --help          Show this help\n");
+		"  -h --help          Show this help\n"
+		"  -b --camera-buffers=N\n"
+		"                     Number of V4L2 capture buffers to queue\n"
+		"  -r --record=FILE   Record all sensor streams to FILE\n"
+		"  -f --record-frames Also record full camera frames\n"
+		"  -p --replay=FILE   Replay recorded sensor streams from FILE\n"
+		"                     instead of using connected devices\n"
+		"  -x --replay-speed=X\n"
+		"                     Replay at X times real time, or as fast\n"
+		"                     as possible if X is 0\n"
+		"  -s --sched=TYPE=PRIO[:CPUS][:mlock]\n"
+		"                     Run worker threads of hmd, camera, or\n"
+		"                     controller devices with SCHED_FIFO\n"
+		"                     priority PRIO, optionally pinned to the\n"
+		"                     CPU list CPUS and with memory locked\n"
+		"  -u --filter-udp    Apply telemetry subscriptions to the UDP\n"
+		"                     stream, not only to the shared memory ring\n");
 }
 
 static const struct option ouvrtd_options[] = {
 	{ "help", no_argument, NULL, 'h' },
+	{ "camera-buffers", required_argument, NULL, 'b' },
+	{ "record", required_argument, NULL, 'r' },
+	{ "record-frames", no_argument, NULL, 'f' },
+	{ "replay", required_argument, NULL, 'p' },
+	{ "replay-speed", required_argument, NULL, 'x' },
+	{ "sched", required_argument, NULL, 's' },
+	{ "filter-udp", no_argument, NULL, 'u' },
 	{ NULL }
 };
 
@@ -658,6 +794,8 @@ static const struct option ouvrtd_options[] = {
  */
 int main(int argc, char *argv[])
 {
+	struct replay *replay = NULL;
+	double replay_speed = 1.0;
 	struct udev *udev;
 	guint owner_id;
 	int longind;
@@ -670,10 +808,47 @@ int main(int argc, char *argv[])
 	telemetry_init(&argc, &argv);
 
 	do {
-		ret = getopt_long(argc, argv, "h", ouvrtd_options, &longind);
+		ret = getopt_long(argc, argv, "hb:r:fp:x:s:u", ouvrtd_options, &longind);
 		switch (ret) {
 		case -1:
 			break;
+		case 'b':
+			if (ouvrt_camera_v4l2_set_default_num_buffers(
+					atoi(optarg)) < 0) {
+				g_print("Invalid number of camera buffers: '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			if (recorder_open(optarg) < 0)
+				exit(1);
+			break;
+		case 'f':
+			recorder_set_record_frames(true);
+			break;
+		case 'p':
+			replay = replay_open(optarg);
+			if (!replay)
+				exit(1);
+			break;
+		case 'x':
+			replay_speed = g_ascii_strtod(optarg, NULL);
+			if (replay_speed < 0.0) {
+				g_print("Invalid replay speed: '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			if (ouvrt_device_parse_sched_policy(optarg) < 0) {
+				g_print("Invalid scheduling policy: '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'u':
+			telemetry_set_filter_udp(true);
+			break;
 		case 'h':
 		default:
 			ouvrtd_usage();
@@ -681,7 +856,9 @@ int main(int argc, char *argv[])
 		}
 	} while (ret != -1);
 
-	signal(SIGINT, ouvrtd_signal_handler);
+	g_unix_signal_add(SIGINT, ouvrtd_signal_handler, NULL);
+
+	log_ring_start();
 
 	udev = udev_new();
 	if (!udev)
@@ -690,12 +867,27 @@ int main(int argc, char *argv[])
 	loop = g_main_loop_new(NULL, TRUE);
 	owner_id = ouvrt_dbus_own_name();
 
-	ouvrtd_startup(udev);
+	lighthouse_room_load();
+
+	if (replay) {
+		/* Do not let a recorded setup replace the cached one */
+		cache_set_read_only(true);
+		replay_set_speed(replay, replay_speed);
+		ouvrtd_replay_startup(replay);
+	} else {
+		ouvrtd_startup(udev);
+	}
 	g_main_loop_run(loop);
 
+	/* Make sure no device starts up behind the teardown below */
+	ouvrt_device_wait_pending_starts();
+
 	g_bus_unown_name(owner_id);
 	udev_unref(udev);
 	g_main_loop_unref(loop);
+	recorder_close();
+	replay_close(replay);
+	log_ring_stop();
 	telemetry_deinit();
 	pipewire_deinit();
 	debug_stream_deinit();
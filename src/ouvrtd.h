@@ -1,13 +0,0 @@
-/*
- * Main loop and device enumeration
- * Copyright 2015 Philipp Zabel
- * SPDX-License-Identifier: GPL-2.0-or-later
- */
-#ifndef __OUVRTD_H__
-#define __OUVRTD_H__
-
-#include <glib.h>
-
-extern GList *device_list;
-
-#endif /* __OUVRTD_H__ */
@@ -218,16 +218,14 @@ bool debug_stream_connected(struct debug_stream *stream)
 }
 
 void debug_stream_frame_push(struct debug_stream *stream, void *src,
-			     size_t size, size_t attach_offset,
-			     struct blobservation *ob, dquat *rot, dvec3 *trans,
-			     double timestamps[3])
+			     size_t size, struct blobservation *ob,
+			     dquat *rot, dvec3 *trans, double timestamps[4])
 {
 	struct spa_meta_header *h;
 	struct pw_buffer *buf;
 	struct spa_buffer *b;
 
 	(void)size;
-	(void)attach_offset;
 	(void)ob;
 	(void)rot;
 	(void)trans;
@@ -12,6 +12,7 @@
 
 #include "psvr.h"
 #include "psvr-hid-reports.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
@@ -41,6 +42,7 @@ struct _OuvrtPSVR {
 	uint8_t state;
 	uint8_t last_seq;
 	uint32_t last_timestamp;
+	struct clock_sync clock;
 	struct imu_state imu;
 	vec3 acc_bias;
 	vec3 acc_scale;
@@ -172,8 +174,10 @@ static void psvr_decode_sensor_message(OuvrtPSVR *self,
 	uint16_t volume = __le16_to_cpu(message->volume);
 	uint16_t button_raw = __be16_to_cpu(message->button_raw);
 	uint16_t proximity = __le16_to_cpu(message->proximity);
+	uint64_t now = clock_sync_host_now();
 	struct raw_imu_sample raw;
 	struct imu_sample imu;
+	uint64_t ticks;
 	int32_t dt;
 	int i;
 
@@ -230,6 +234,10 @@ static void psvr_decode_sensor_message(OuvrtPSVR *self,
 
 		telemetry_send_raw_imu_sample(self->dev.id, &raw);
 
+		/* µs, wraps every ~16.8 s */
+		ticks = clock_sync_unwrap(&self->clock, raw.time);
+		clock_sync_update(&self->clock, ticks, now);
+
 		dt = raw.time - self->last_timestamp;
 		if (dt < 0)
 			dt += (1 << 24);
@@ -262,7 +270,7 @@ static void psvr_decode_sensor_message(OuvrtPSVR *self,
 		imu.angular_velocity.x = raw.gyro[1] *  (16.0 / 16384);
 		imu.angular_velocity.y = raw.gyro[0] *  (16.0 / 16384);
 		imu.angular_velocity.z = raw.gyro[2] * -(16.0 / 16384);
-		imu.time = 1e-6 * raw.time;
+		imu.time = 1e-9 * clock_sync_ticks_to_host(&self->clock, ticks);
 
 		telemetry_send_imu_sample(self->dev.id, &imu);
 
@@ -661,6 +669,7 @@ static void ouvrt_psvr_init(OuvrtPSVR *self)
 	self->power = false;
 	self->vrmode = false;
 	self->state = PSVR_STATE_POWER_OFF;
+	clock_sync_init(&self->clock, 1000000, 24);
 	self->imu.pose.rotation.w = 1.0;
 
 	/* ±2g range */
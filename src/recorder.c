@@ -0,0 +1,510 @@
+/*
+ * Session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "clock-sync.h"
+#include "recorder.h"
+
+#define ALIGN(x, a)	(((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* Minimum number of the largest events seen so far that fit into a chunk */
+#define RECORDER_CHUNK_EVENTS	8
+
+/*
+ * A stream appends events to its current chunk without locking, as only
+ * the device thread owning the stream writes to it. When the current chunk
+ * is full, the stream switches to a spare chunk that the recorder thread
+ * has allocated, mapped, and prefaulted in advance, and hands the full
+ * chunk to the recorder thread to be unmapped and added to the index.
+ * spare is set by the recorder thread and cleared by the device thread.
+ * spare_pending is only accessed by the device thread.
+ */
+struct recorder_stream {
+	uint16_t id;
+	struct recorder_chunk_header *chunk;
+	uint64_t chunk_offset;
+	size_t chunk_size;
+	struct recorder_chunk_header *spare;
+	uint64_t spare_offset;
+	bool spare_pending;
+};
+
+enum recorder_job_type {
+	RECORDER_JOB_FINISH,
+	RECORDER_JOB_UNMAP,
+	RECORDER_JOB_PREPARE,
+	RECORDER_JOB_FREE,
+	RECORDER_JOB_STOP,
+};
+
+struct recorder_job {
+	enum recorder_job_type type;
+	struct recorder_stream *stream;
+	struct recorder_chunk_header *chunk;
+	uint64_t offset;
+	size_t size;
+};
+
+/*
+ * The mutex protects the file size, the index, and the stream counts. The
+ * recorder is only closed when no streams are live anymore.
+ */
+static GMutex recorder_mutex;
+static GCond recorder_cond;
+static unsigned int recorder_num_live_streams;
+static bool recorder_closing;
+static GAsyncQueue *recorder_queue;
+static GThread *recorder_thread;
+static int recorder_fd = -1;
+static uint64_t recorder_size;
+static uint64_t recorder_start_time;
+static unsigned int recorder_num_streams;
+static struct recorder_index_entry *recorder_index;
+static unsigned int recorder_num_index_entries;
+static bool recorder_frames;
+
+/*
+ * Adds a completed chunk to the index and unmaps it.
+ */
+static void recorder_finish_chunk(struct recorder_chunk_header *chunk,
+				  uint64_t offset)
+{
+	struct recorder_index_entry *entry;
+
+	g_mutex_lock(&recorder_mutex);
+	recorder_index = g_renew(struct recorder_index_entry, recorder_index,
+				 recorder_num_index_entries + 1);
+	entry = &recorder_index[recorder_num_index_entries++];
+	entry->offset = offset;
+	entry->first_time = chunk->first_time;
+	entry->last_time = chunk->last_time;
+	entry->size = chunk->size;
+	entry->stream = chunk->stream;
+	entry->reserved = 0;
+	g_mutex_unlock(&recorder_mutex);
+
+	munmap(chunk, chunk->size);
+}
+
+/*
+ * Grows the file by chunk_size bytes and maps the new space as an empty
+ * chunk for the given stream.
+ *
+ * Returns the chunk and its file offset, or NULL on error.
+ */
+static struct recorder_chunk_header *recorder_map_chunk(uint16_t stream,
+							 size_t chunk_size,
+							 uint64_t *offset)
+{
+	struct recorder_chunk_header *chunk;
+	int ret;
+
+	g_mutex_lock(&recorder_mutex);
+	*offset = recorder_size;
+	ret = ftruncate(recorder_fd, *offset + chunk_size);
+	if (ret == 0)
+		recorder_size = *offset + chunk_size;
+	g_mutex_unlock(&recorder_mutex);
+	if (ret < 0) {
+		g_print("Recorder: Failed to grow file: %d\n", errno);
+		return NULL;
+	}
+
+	chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     recorder_fd, *offset);
+	if (chunk == MAP_FAILED) {
+		g_print("Recorder: Failed to map chunk: %d\n", errno);
+		return NULL;
+	}
+
+	chunk->magic = RECORDER_CHUNK_MAGIC;
+	chunk->stream = stream;
+	chunk->size = chunk_size;
+	chunk->used = sizeof(*chunk);
+
+	return chunk;
+}
+
+/*
+ * Maps a spare chunk for the stream and touches all its pages, so that the
+ * device thread does not take any page faults when writing to it.
+ */
+static void recorder_prepare_spare(struct recorder_stream *stream,
+				   size_t chunk_size)
+{
+	struct recorder_chunk_header *chunk;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t offset;
+	size_t i;
+
+	chunk = recorder_map_chunk(stream->id, chunk_size, &offset);
+	if (!chunk)
+		return;
+
+	for (i = page_size; i < chunk_size; i += page_size)
+		((volatile uint8_t *)chunk)[i] = 0;
+
+	stream->spare_offset = offset;
+	g_atomic_pointer_set(&stream->spare, chunk);
+}
+
+/*
+ * Runs all chunk allocation, unmapping, and index bookkeeping off the
+ * device threads, in the order the jobs were queued.
+ */
+static gpointer recorder_thread_func(gpointer data)
+{
+	struct recorder_job *job;
+	bool stop = false;
+
+	(void)data;
+
+	while (!stop) {
+		job = g_async_queue_pop(recorder_queue);
+
+		switch (job->type) {
+		case RECORDER_JOB_FINISH:
+			recorder_finish_chunk(job->chunk, job->offset);
+			break;
+		case RECORDER_JOB_UNMAP:
+			munmap(job->chunk, job->chunk->size);
+			break;
+		case RECORDER_JOB_PREPARE:
+			recorder_prepare_spare(job->stream, job->size);
+			break;
+		case RECORDER_JOB_FREE:
+			if (job->stream->spare)
+				munmap(job->stream->spare,
+				       job->stream->spare->size);
+			g_free(job->stream);
+			break;
+		case RECORDER_JOB_STOP:
+			stop = true;
+			break;
+		}
+
+		g_free(job);
+	}
+
+	return NULL;
+}
+
+static void recorder_queue_job(enum recorder_job_type type,
+			       struct recorder_stream *stream,
+			       struct recorder_chunk_header *chunk,
+			       uint64_t offset, size_t size)
+{
+	struct recorder_job *job = g_new(struct recorder_job, 1);
+
+	job->type = type;
+	job->stream = stream;
+	job->chunk = chunk;
+	job->offset = offset;
+	job->size = size;
+	g_async_queue_push(recorder_queue, job);
+}
+
+/*
+ * Creates the recording file and writes the file header. Streams created
+ * after this call are recorded.
+ */
+int recorder_open(const char *filename)
+{
+	struct recorder_file_header header = {
+		.magic = RECORDER_MAGIC,
+		.version = RECORDER_VERSION,
+		.header_size = RECORDER_HEADER_SIZE,
+	};
+	int fd;
+	int ret;
+
+	if (recorder_fd >= 0)
+		return -EBUSY;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		g_print("Recorder: Failed to open %s: %d (%s)\n", filename,
+			errno, strerror(errno));
+		return -errno;
+	}
+
+	recorder_start_time = clock_sync_host_now();
+	header.start_time = recorder_start_time;
+
+	ret = pwrite(fd, &header, sizeof(header), 0);
+	if (ret != sizeof(header) ||
+	    ftruncate(fd, RECORDER_HEADER_SIZE) < 0) {
+		g_print("Recorder: Failed to write header: %d\n", errno);
+		close(fd);
+		return -EIO;
+	}
+
+	g_mutex_init(&recorder_mutex);
+	recorder_size = RECORDER_HEADER_SIZE;
+	recorder_num_streams = 0;
+	recorder_closing = false;
+	recorder_fd = fd;
+
+	recorder_queue = g_async_queue_new();
+	recorder_thread = g_thread_new("recorder", recorder_thread_func, NULL);
+
+	g_print("Recorder: Recording to %s\n", filename);
+
+	return 0;
+}
+
+/*
+ * Enables recording of full camera frames in addition to blob lists.
+ * Must be called before any camera streams are started.
+ */
+void recorder_set_record_frames(bool enable)
+{
+	recorder_frames = enable;
+}
+
+bool recorder_record_frames(void)
+{
+	return recorder_fd >= 0 && recorder_frames;
+}
+
+/*
+ * Hands the current chunk to the recorder thread and switches to a new
+ * chunk large enough to hold an event of the given size. Usually this is
+ * the spare chunk, and the recorder thread is asked to prepare the next
+ * one. Only if no suitable spare chunk is ready yet, a new chunk is mapped
+ * synchronously. The chunk size grows with the largest event seen, so that
+ * even streams of camera frames only switch chunks every few events.
+ */
+static void recorder_stream_new_chunk(struct recorder_stream *stream,
+				      size_t size)
+{
+	struct recorder_chunk_header *spare;
+	size_t min_size;
+
+	if (!g_atomic_pointer_get(&recorder_queue))
+		return;
+
+	if (stream->chunk) {
+		recorder_queue_job(RECORDER_JOB_FINISH, NULL, stream->chunk,
+				   stream->chunk_offset, 0);
+		stream->chunk = NULL;
+	}
+
+	min_size = ALIGN(sizeof(*spare) + RECORDER_CHUNK_EVENTS * size,
+			 sysconf(_SC_PAGESIZE));
+	if (stream->chunk_size < min_size)
+		stream->chunk_size = min_size;
+
+	spare = g_atomic_pointer_get(&stream->spare);
+	if (spare) {
+		g_atomic_pointer_set(&stream->spare, NULL);
+		stream->spare_pending = false;
+		if (spare->size - spare->used >= size) {
+			stream->chunk = spare;
+			stream->chunk_offset = stream->spare_offset;
+		} else {
+			recorder_queue_job(RECORDER_JOB_UNMAP, NULL, spare, 0,
+					   0);
+		}
+	}
+
+	if (!stream->chunk)
+		stream->chunk = recorder_map_chunk(stream->id,
+						   stream->chunk_size,
+						   &stream->chunk_offset);
+
+	if (!stream->spare_pending) {
+		recorder_queue_job(RECORDER_JOB_PREPARE, stream, NULL, 0,
+				   stream->chunk_size);
+		stream->spare_pending = true;
+	}
+}
+
+void __recorder_write(struct recorder_stream *stream, uint16_t type,
+		      uint64_t time, const void *header, size_t header_len,
+		      const void *data, size_t len)
+{
+	struct recorder_chunk_header *chunk = stream->chunk;
+	struct recorder_event *event;
+	size_t size;
+
+	size = sizeof(*event) + ALIGN(header_len + len, 8);
+	if (!chunk || chunk->used + size > chunk->size) {
+		recorder_stream_new_chunk(stream, size);
+		chunk = stream->chunk;
+		if (!chunk)
+			return;
+	}
+
+	event = (struct recorder_event *)((uint8_t *)chunk + chunk->used);
+	event->type = type;
+	event->stream = stream->id;
+	event->size = header_len + len;
+	event->time = time;
+	if (header_len)
+		memcpy(event + 1, header, header_len);
+	if (len)
+		memcpy((uint8_t *)(event + 1) + header_len, data, len);
+
+	if (!chunk->num_events)
+		chunk->first_time = time;
+	chunk->last_time = time;
+	chunk->num_events++;
+	chunk->used += size;
+}
+
+void __recorder_write_hid_reports(struct recorder_stream *stream,
+				  int interface, const unsigned char *buf,
+				  size_t len, const int *lens, int num)
+{
+	struct recorder_hid_report report = { .interface = interface };
+	uint64_t now = clock_sync_host_now();
+	int i;
+
+	for (i = 0; i < num; i++) {
+		__recorder_write(stream, RECORDER_EVENT_HID_REPORT, now,
+				 &report, sizeof(report), buf + i * len,
+				 lens[i]);
+	}
+}
+
+void __recorder_write_lighthouse_pulse(struct recorder_stream *stream,
+				       uint8_t sensor_id, uint16_t duration,
+				       uint32_t timestamp)
+{
+	struct recorder_lighthouse_pulse pulse = {
+		.timestamp = timestamp,
+		.duration = duration,
+		.sensor_id = sensor_id,
+	};
+
+	__recorder_write(stream, RECORDER_EVENT_LIGHTHOUSE_PULSE,
+			 clock_sync_host_now(), &pulse, sizeof(pulse), NULL, 0);
+}
+
+/*
+ * Creates a new stream for a device and records its description. Returns
+ * NULL if no recording is active.
+ */
+struct recorder_stream *recorder_stream_new(uint32_t device_type,
+					    uint32_t device_id,
+					    const char *name,
+					    const char *serial)
+{
+	struct recorder_stream_info info = {
+		.device_type = device_type,
+		.device_id = device_id,
+	};
+	struct recorder_stream *stream;
+
+	if (name)
+		g_strlcpy(info.name, name, sizeof(info.name));
+	if (serial)
+		g_strlcpy(info.serial, serial, sizeof(info.serial));
+
+	g_mutex_lock(&recorder_mutex);
+	if (recorder_fd < 0 || recorder_closing) {
+		g_mutex_unlock(&recorder_mutex);
+		return NULL;
+	}
+	stream = g_new0(struct recorder_stream, 1);
+	stream->chunk_size = RECORDER_CHUNK_SIZE;
+	stream->id = recorder_num_streams++;
+	recorder_num_live_streams++;
+	g_mutex_unlock(&recorder_mutex);
+
+	__recorder_write(stream, RECORDER_EVENT_STREAM, clock_sync_host_now(),
+			 &info, sizeof(info), NULL, 0);
+
+	return stream;
+}
+
+/*
+ * Hands the stream's last chunk and the stream itself to the recorder
+ * thread, which completes the chunk and frees the stream.
+ */
+void recorder_stream_free(struct recorder_stream *stream)
+{
+	if (!stream)
+		return;
+
+	if (stream->chunk)
+		recorder_queue_job(RECORDER_JOB_FINISH, NULL, stream->chunk,
+				   stream->chunk_offset, 0);
+	recorder_queue_job(RECORDER_JOB_FREE, stream, NULL, 0, 0);
+
+	g_mutex_lock(&recorder_mutex);
+	recorder_num_live_streams--;
+	g_cond_broadcast(&recorder_cond);
+	g_mutex_unlock(&recorder_mutex);
+}
+
+/*
+ * Writes the chunk index and closes the recording. No new streams are
+ * created once this is called. If streams are still live, waits up to a
+ * second for them to be freed, and otherwise leaves the recording open
+ * without an index, as the device threads may still be writing to it.
+ */
+void recorder_close(void)
+{
+	struct recorder_file_header header = {
+		.magic = RECORDER_MAGIC,
+		.version = RECORDER_VERSION,
+		.header_size = RECORDER_HEADER_SIZE,
+	};
+	GAsyncQueue *queue = recorder_queue;
+	unsigned int num_live;
+	gint64 end_time;
+	size_t size;
+	ssize_t ret;
+
+	if (recorder_fd < 0)
+		return;
+
+	end_time = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
+	g_mutex_lock(&recorder_mutex);
+	recorder_closing = true;
+	while (recorder_num_live_streams &&
+	       g_cond_wait_until(&recorder_cond, &recorder_mutex, end_time))
+		;
+	num_live = recorder_num_live_streams;
+	g_mutex_unlock(&recorder_mutex);
+	if (num_live) {
+		g_print("Recorder: %u streams still active, not closing\n",
+			num_live);
+		return;
+	}
+
+	recorder_queue_job(RECORDER_JOB_STOP, NULL, NULL, 0, 0);
+	g_thread_join(recorder_thread);
+	recorder_thread = NULL;
+	g_atomic_pointer_set(&recorder_queue, NULL);
+	g_async_queue_unref(queue);
+
+	size = recorder_num_index_entries * sizeof(*recorder_index);
+	ret = pwrite(recorder_fd, recorder_index, size, recorder_size);
+	if (ret == (ssize_t)size) {
+		header.start_time = recorder_start_time;
+		header.index_offset = recorder_size;
+		header.num_index_entries = recorder_num_index_entries;
+		header.num_streams = recorder_num_streams;
+		ret = pwrite(recorder_fd, &header, sizeof(header), 0);
+	}
+	if (ret < 0)
+		g_print("Recorder: Failed to write index: %d\n", errno);
+
+	close(recorder_fd);
+	recorder_fd = -1;
+	g_free(recorder_index);
+	recorder_index = NULL;
+	recorder_num_index_entries = 0;
+	g_mutex_clear(&recorder_mutex);
+}
@@ -0,0 +1,192 @@
+/*
+ * Session recorder
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDER_MAGIC			"OUVRTREC"
+#define RECORDER_VERSION		1
+#define RECORDER_HEADER_SIZE		4096
+#define RECORDER_CHUNK_MAGIC		0x4b4e4843 /* "CHNK" */
+#define RECORDER_CHUNK_SIZE		(1 << 20)
+
+/*
+ * A recording starts with the file header, padded to RECORDER_HEADER_SIZE,
+ * followed by page aligned chunks. Each chunk belongs to a single stream,
+ * usually one device, and contains a sequence of events ordered by time.
+ * The chunk index is written after the last chunk when the recording is
+ * closed. If index_offset is zero, the recording was not closed properly
+ * and readers have to walk the chunks using their size field instead.
+ *
+ * All structures are stored in native byte order and layout, so that a
+ * recording can be mapped and read in place on the recording machine.
+ */
+struct recorder_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t start_time;
+	uint64_t index_offset;
+	uint64_t num_index_entries;
+	uint32_t num_streams;
+	uint32_t reserved;
+};
+
+struct recorder_chunk_header {
+	uint32_t magic;
+	uint16_t stream;
+	uint16_t reserved;
+	uint32_t size;
+	uint32_t used;
+	uint32_t num_events;
+	uint32_t reserved2;
+	uint64_t first_time;
+	uint64_t last_time;
+};
+
+struct recorder_index_entry {
+	uint64_t offset;
+	uint64_t first_time;
+	uint64_t last_time;
+	uint32_t size;
+	uint16_t stream;
+	uint16_t reserved;
+};
+
+/*
+ * Events start with this header, followed by size bytes of payload, padded
+ * to a multiple of 8 bytes. time is CLOCK_MONOTONIC in ns.
+ */
+struct recorder_event {
+	uint16_t type;
+	uint16_t stream;
+	uint32_t size;
+	uint64_t time;
+};
+
+enum recorder_event_type {
+	/* struct recorder_stream_info, first event of every stream */
+	RECORDER_EVENT_STREAM,
+	/* struct recorder_hid_report, followed by the report */
+	RECORDER_EVENT_HID_REPORT,
+	/* struct imu_sample */
+	RECORDER_EVENT_IMU_SAMPLE,
+	/* struct recorder_lighthouse_pulse */
+	RECORDER_EVENT_LIGHTHOUSE_PULSE,
+	/* struct recorder_exposure */
+	RECORDER_EVENT_EXPOSURE,
+	/* struct recorder_frame, followed by the 8-bit grayscale image */
+	RECORDER_EVENT_FRAME,
+	/* struct recorder_blobs, followed by num_blobs struct blob */
+	RECORDER_EVENT_BLOBS,
+};
+
+struct recorder_stream_info {
+	uint32_t device_type;
+	uint32_t device_id;
+	char name[32];
+	char serial[32];
+};
+
+struct recorder_hid_report {
+	uint8_t interface;
+	uint8_t reserved[3];
+};
+
+struct recorder_lighthouse_pulse {
+	uint32_t timestamp;
+	uint16_t duration;
+	uint8_t sensor_id;
+	uint8_t reserved;
+};
+
+struct recorder_exposure {
+	uint32_t device_timestamp;
+	int32_t led_pattern_phase;
+};
+
+/*
+ * sequence is the frame sequence number or, for cameras that do not provide
+ * one, the device timestamp of the frame.
+ */
+struct recorder_frame {
+	uint32_t sequence;
+	uint16_t width;
+	uint16_t height;
+};
+
+struct recorder_blobs {
+	uint32_t sequence;
+	uint32_t num_blobs;
+};
+
+struct recorder_stream;
+
+int recorder_open(const char *filename);
+void recorder_set_record_frames(bool enable);
+bool recorder_record_frames(void);
+void recorder_close(void);
+
+struct recorder_stream *recorder_stream_new(uint32_t device_type,
+					    uint32_t device_id,
+					    const char *name,
+					    const char *serial);
+void recorder_stream_free(struct recorder_stream *stream);
+
+void __recorder_write(struct recorder_stream *stream, uint16_t type,
+		      uint64_t time, const void *header, size_t header_len,
+		      const void *data, size_t len);
+void __recorder_write_hid_reports(struct recorder_stream *stream,
+				  int interface, const unsigned char *buf,
+				  size_t len, const int *lens, int num);
+void __recorder_write_lighthouse_pulse(struct recorder_stream *stream,
+				       uint8_t sensor_id, uint16_t duration,
+				       uint32_t timestamp);
+
+/*
+ * Appends an event with a small fixed header and optional variable length
+ * data to the stream. Does nothing if the stream is NULL, which is the case
+ * if no recording is active, so calls can stay in the hot path.
+ */
+static inline void recorder_write(struct recorder_stream *stream,
+				  uint16_t type, uint64_t time,
+				  const void *header, size_t header_len,
+				  const void *data, size_t len)
+{
+	if (stream)
+		__recorder_write(stream, type, time, header, header_len, data,
+				 len);
+}
+
+/*
+ * Appends a batch of HID reports as returned by hid_read_reports(), all
+ * with the current time.
+ */
+static inline void recorder_write_hid_reports(struct recorder_stream *stream,
+					      int interface,
+					      const unsigned char *buf,
+					      size_t len, const int *lens,
+					      int num)
+{
+	if (stream)
+		__recorder_write_hid_reports(stream, interface, buf, len, lens,
+					     num);
+}
+
+static inline void
+recorder_write_lighthouse_pulse(struct recorder_stream *stream,
+				uint8_t sensor_id, uint16_t duration,
+				uint32_t timestamp)
+{
+	if (stream)
+		__recorder_write_lighthouse_pulse(stream, sensor_id, duration,
+						  timestamp);
+}
+
+#endif /* __RECORDER_H__ */
@@ -0,0 +1,191 @@
+/*
+ * Replayed tracking camera
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "replay-camera.h"
+#include "blobwatch.h"
+#include "debug.h"
+#include "replay.h"
+
+struct _OuvrtReplayCamera {
+	OuvrtCamera camera;
+
+	struct replay *replay;
+	unsigned int stream;
+	uint8_t *frame;
+};
+
+G_DEFINE_TYPE(OuvrtReplayCamera, ouvrt_replay_camera, OUVRT_TYPE_CAMERA)
+
+/*
+ * Determines the frame size from the first recorded frame and sets up the
+ * debug stream accordingly.
+ */
+static int replay_camera_start(OuvrtDevice *dev)
+{
+	OuvrtReplayCamera *self = OUVRT_REPLAY_CAMERA(dev);
+	OuvrtCamera *camera = &self->camera;
+	const struct recorder_frame *frame;
+	const struct recorder_event *event;
+	struct replay_cursor cursor;
+
+	replay_cursor_init(&cursor, self->replay, self->stream);
+	while ((event = replay_cursor_next(&cursor))) {
+		if (event->type != RECORDER_EVENT_FRAME ||
+		    event->size < sizeof(*frame))
+			continue;
+		frame = replay_event_data(event);
+		camera->width = frame->width;
+		camera->height = frame->height;
+		break;
+	}
+
+	if (!camera->width) {
+		g_print("%s: No frames recorded, nothing to replay\n",
+			dev->name);
+	} else {
+		struct debug_stream_desc desc = {
+			.width = camera->width,
+			.height = camera->height,
+			.format = FORMAT_GRAY,
+			.framerate = { camera->framerate, 1 },
+		};
+
+		self->frame = g_malloc(camera->width * camera->height);
+		camera->debug = debug_stream_new(&desc);
+	}
+
+	replay_stream_start(self->replay);
+
+	return 0;
+}
+
+/*
+ * Feeds recorded frames into the blob tracker. Recorded blob lists are
+ * skipped, they are recomputed from the frames.
+ */
+static void replay_camera_thread(OuvrtDevice *dev)
+{
+	OuvrtReplayCamera *self = OUVRT_REPLAY_CAMERA(dev);
+	OuvrtCamera *camera = &self->camera;
+	const struct recorder_frame *frame;
+	const struct recorder_event *event;
+	struct blobservation *ob;
+	struct replay_cursor cursor;
+	double timestamps[4] = { 0 };
+	dquat rot = { 0 };
+	dvec3 trans = { 0 };
+	struct timespec tp;
+	size_t size;
+
+	replay_cursor_init(&cursor, self->replay, self->stream);
+
+	while (dev->active && (event = replay_cursor_next(&cursor))) {
+		if (event->type != RECORDER_EVENT_FRAME ||
+		    event->size < sizeof(*frame))
+			continue;
+
+		frame = replay_event_data(event);
+		size = (size_t)frame->width * frame->height;
+		if (frame->width != camera->width ||
+		    frame->height != camera->height ||
+		    event->size < sizeof(*frame) + size)
+			continue;
+
+		replay_wait(self->replay, event->time);
+
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
+
+		memcpy(self->frame, frame + 1, size);
+		camera->sequence = frame->sequence;
+
+		ob = NULL;
+		if (camera->tracker) {
+			ouvrt_tracker_process_frame(camera->tracker,
+						    self->frame, camera->width,
+						    camera->height, event->time,
+						    &ob);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
+		timestamps[3] = timestamps[2];
+
+		debug_stream_frame_push(camera->debug, self->frame, size, ob,
+					&rot, &trans, timestamps);
+	}
+
+	g_print("%s: Replay finished\n", dev->name);
+	replay_stream_done(self->replay);
+}
+
+static void replay_camera_stop(OuvrtDevice *dev)
+{
+	OuvrtReplayCamera *self = OUVRT_REPLAY_CAMERA(dev);
+
+	self->camera.debug = debug_stream_unref(self->camera.debug);
+	g_free(self->frame);
+	self->frame = NULL;
+}
+
+/*
+ * Links the camera to the tracker of a replayed HMD.
+ */
+void ouvrt_replay_camera_set_tracker(OuvrtReplayCamera *self,
+				     OuvrtTracker *tracker)
+{
+	g_set_object(&self->camera.tracker, tracker);
+}
+
+static void ouvrt_replay_camera_dispose(GObject *object)
+{
+	OuvrtReplayCamera *self = OUVRT_REPLAY_CAMERA(object);
+
+	g_clear_object(&self->camera.tracker);
+	G_OBJECT_CLASS(ouvrt_replay_camera_parent_class)->dispose(object);
+}
+
+static void ouvrt_replay_camera_class_init(OuvrtReplayCameraClass *klass)
+{
+	G_OBJECT_CLASS(klass)->dispose = ouvrt_replay_camera_dispose;
+	OUVRT_DEVICE_CLASS(klass)->start = replay_camera_start;
+	OUVRT_DEVICE_CLASS(klass)->thread = replay_camera_thread;
+	OUVRT_DEVICE_CLASS(klass)->stop = replay_camera_stop;
+}
+
+static void ouvrt_replay_camera_init(OuvrtReplayCamera *self)
+{
+	self->camera.dev.type = DEVICE_TYPE_CAMERA;
+	self->camera.framerate = 60;
+}
+
+/*
+ * Allocates a replay device for a recorded camera stream.
+ *
+ * Returns the newly allocated replay device.
+ */
+OuvrtDevice *replay_camera_new(struct replay *replay, unsigned int stream)
+{
+	const struct recorder_stream_info *info;
+	OuvrtReplayCamera *self;
+
+	info = replay_get_stream_info(replay, stream);
+	if (!info)
+		return NULL;
+
+	self = g_object_new(OUVRT_TYPE_REPLAY_CAMERA, NULL);
+	self->replay = replay;
+	self->stream = stream;
+	self->camera.dev.name = strndup(info->name, sizeof(info->name));
+	if (info->serial[0])
+		self->camera.dev.serial = strndup(info->serial,
+						  sizeof(info->serial));
+
+	return &self->camera.dev;
+}
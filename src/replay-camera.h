@@ -0,0 +1,29 @@
+/*
+ * Replayed tracking camera
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __REPLAY_CAMERA_H__
+#define __REPLAY_CAMERA_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "camera.h"
+
+struct replay;
+
+G_BEGIN_DECLS
+
+#define OUVRT_TYPE_REPLAY_CAMERA (ouvrt_replay_camera_get_type())
+G_DECLARE_FINAL_TYPE(OuvrtReplayCamera, ouvrt_replay_camera, OUVRT, \
+		     REPLAY_CAMERA, OuvrtCamera)
+
+OuvrtDevice *replay_camera_new(struct replay *replay, unsigned int stream);
+
+void ouvrt_replay_camera_set_tracker(OuvrtReplayCamera *self,
+				     OuvrtTracker *tracker);
+
+G_END_DECLS
+
+#endif /* __REPLAY_CAMERA_H__ */
@@ -0,0 +1,158 @@
+/*
+ * Replayed Oculus Rift HMD
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay-rift.h"
+#include "hidraw.h"
+#include "replay.h"
+#include "rift.h"
+
+/*
+ * Wraps a Rift device that is never started. Recorded sensor reports are
+ * fed into its decoder instead of reports read from the hidraw device.
+ * The LED model is read from the headset in rift_start and not recorded,
+ * so no LEDs are registered with the tracker and replayed camera frames
+ * only yield blobs, but no poses.
+ */
+struct _OuvrtReplayRift {
+	OuvrtDevice dev;
+
+	OuvrtRift *rift;
+	struct replay *replay;
+	unsigned int stream;
+};
+
+G_DEFINE_TYPE(OuvrtReplayRift, ouvrt_replay_rift, OUVRT_TYPE_DEVICE)
+
+static int replay_rift_start(OuvrtDevice *dev)
+{
+	OuvrtReplayRift *self = OUVRT_REPLAY_RIFT(dev);
+
+	replay_stream_start(self->replay);
+
+	return 0;
+}
+
+/*
+ * Feeds recorded IMU interface reports into the Rift sensor message decoder,
+ * in batches as they were received.
+ */
+static void replay_rift_thread(OuvrtDevice *dev)
+{
+	OuvrtReplayRift *self = OUVRT_REPLAY_RIFT(dev);
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
+	const struct recorder_hid_report *report;
+	const struct recorder_event *event;
+	struct replay_cursor cursor;
+	uint64_t time = 0;
+	int num = 0;
+
+	/* Decoded samples are attributed to the replay device */
+	OUVRT_DEVICE(self->rift)->id = dev->id;
+
+	replay_cursor_init(&cursor, self->replay, self->stream);
+
+	while (dev->active) {
+		event = replay_cursor_next(&cursor);
+
+		if (num && (!event || event->time != time ||
+			    num == HID_REPORT_BATCH)) {
+			ouvrt_rift_decode_sensor_reports(self->rift,
+							 (void *)buf, len, num,
+							 time);
+			num = 0;
+		}
+
+		if (!event)
+			break;
+
+		if (event->type != RECORDER_EVENT_HID_REPORT ||
+		    event->size < sizeof(*report))
+			continue;
+
+		report = replay_event_data(event);
+		if (report->interface != 0)
+			continue;
+
+		if (!num) {
+			time = event->time;
+			replay_wait(self->replay, time);
+		}
+
+		len[num] = MIN(event->size - sizeof(*report), sizeof(buf[0]));
+		memcpy(buf[num], report + 1, len[num]);
+		num++;
+	}
+
+	g_print("%s: Replay finished\n", dev->name);
+	replay_stream_done(self->replay);
+}
+
+static void replay_rift_stop(G_GNUC_UNUSED OuvrtDevice *dev)
+{
+}
+
+OuvrtTracker *ouvrt_replay_rift_get_tracker(OuvrtReplayRift *self)
+{
+	return ouvrt_rift_get_tracker(self->rift);
+}
+
+static void ouvrt_replay_rift_dispose(GObject *object)
+{
+	OuvrtReplayRift *self = OUVRT_REPLAY_RIFT(object);
+
+	g_clear_object(&self->rift);
+	G_OBJECT_CLASS(ouvrt_replay_rift_parent_class)->dispose(object);
+}
+
+static void ouvrt_replay_rift_class_init(OuvrtReplayRiftClass *klass)
+{
+	G_OBJECT_CLASS(klass)->dispose = ouvrt_replay_rift_dispose;
+	OUVRT_DEVICE_CLASS(klass)->start = replay_rift_start;
+	OUVRT_DEVICE_CLASS(klass)->thread = replay_rift_thread;
+	OUVRT_DEVICE_CLASS(klass)->stop = replay_rift_stop;
+}
+
+static void ouvrt_replay_rift_init(OuvrtReplayRift *self)
+{
+	self->dev.type = DEVICE_TYPE_HMD;
+}
+
+/*
+ * Allocates a replay device for a recorded Rift DK2 or CV1 stream.
+ *
+ * Returns the newly allocated replay device.
+ */
+OuvrtDevice *replay_rift_new(struct replay *replay, unsigned int stream)
+{
+	const struct recorder_stream_info *info;
+	OuvrtReplayRift *self;
+	OuvrtDevice *rift;
+
+	info = replay_get_stream_info(replay, stream);
+	if (!info)
+		return NULL;
+
+	if (strstr(info->name, "DK2"))
+		rift = rift_dk2_new(NULL);
+	else
+		rift = rift_cv1_new(NULL);
+	if (!rift)
+		return NULL;
+
+	self = g_object_new(OUVRT_TYPE_REPLAY_RIFT, NULL);
+	self->rift = OUVRT_RIFT(rift);
+	self->replay = replay;
+	self->stream = stream;
+	self->dev.name = strndup(info->name, sizeof(info->name));
+	if (info->serial[0])
+		self->dev.serial = strndup(info->serial, sizeof(info->serial));
+	rift->name = strdup(self->dev.name);
+
+	return &self->dev;
+}
@@ -0,0 +1,29 @@
+/*
+ * Replayed Oculus Rift HMD
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __REPLAY_RIFT_H__
+#define __REPLAY_RIFT_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "device.h"
+#include "tracker.h"
+
+struct replay;
+
+G_BEGIN_DECLS
+
+#define OUVRT_TYPE_REPLAY_RIFT (ouvrt_replay_rift_get_type())
+G_DECLARE_FINAL_TYPE(OuvrtReplayRift, ouvrt_replay_rift, OUVRT, REPLAY_RIFT, \
+		     OuvrtDevice)
+
+OuvrtDevice *replay_rift_new(struct replay *replay, unsigned int stream);
+
+OuvrtTracker *ouvrt_replay_rift_get_tracker(OuvrtReplayRift *self);
+
+G_END_DECLS
+
+#endif /* __REPLAY_RIFT_H__ */
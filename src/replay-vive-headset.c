@@ -0,0 +1,170 @@
+/*
+ * Replayed HTC Vive Headset
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay-vive-headset.h"
+#include "vive-hid-reports.h"
+#include "vive-imu.h"
+#include "imu.h"
+#include "lighthouse.h"
+#include "replay.h"
+
+struct _OuvrtReplayViveHeadset {
+	OuvrtDevice dev;
+
+	struct vive_imu imu;
+	struct lighthouse_watchman watchman;
+	struct replay *replay;
+	unsigned int stream;
+};
+
+G_DEFINE_TYPE(OuvrtReplayViveHeadset, ouvrt_replay_vive_headset,
+	      OUVRT_TYPE_DEVICE)
+
+static int replay_vive_headset_start(OuvrtDevice *dev)
+{
+	OuvrtReplayViveHeadset *self = OUVRT_REPLAY_VIVE_HEADSET(dev);
+
+	self->watchman.name = dev->name;
+	replay_stream_start(self->replay);
+
+	return 0;
+}
+
+/*
+ * Pulses from one receiver report are recorded back to back. Collect
+ * consecutive pulses recorded within this interval to decode them as a
+ * batch, like the live device does.
+ */
+#define PULSE_BATCH_INTERVAL_NS		100000
+#define PULSE_BATCH_SIZE		16
+
+static void replay_vive_headset_flush_pulses(OuvrtReplayViveHeadset *self,
+					     struct lighthouse_pulse *pulses,
+					     unsigned int *num)
+{
+	if (!*num)
+		return;
+
+	lighthouse_watchman_handle_pulses(&self->watchman, pulses, *num);
+	*num = 0;
+}
+
+/*
+ * Feeds recorded IMU reports and Lighthouse pulses into the decoders.
+ */
+static void replay_vive_headset_thread(OuvrtDevice *dev)
+{
+	OuvrtReplayViveHeadset *self = OUVRT_REPLAY_VIVE_HEADSET(dev);
+	const struct recorder_lighthouse_pulse *pulse;
+	const struct recorder_hid_report *report;
+	const struct recorder_event *event;
+	struct lighthouse_pulse pulses[PULSE_BATCH_SIZE];
+	struct replay_cursor cursor;
+	unsigned int num_pulses = 0;
+	uint64_t pulse_time = 0;
+	const uint8_t *buf;
+
+	replay_cursor_init(&cursor, self->replay, self->stream);
+
+	while (dev->active && (event = replay_cursor_next(&cursor))) {
+		if (num_pulses &&
+		    (event->type != RECORDER_EVENT_LIGHTHOUSE_PULSE ||
+		     event->time - pulse_time > PULSE_BATCH_INTERVAL_NS ||
+		     num_pulses == PULSE_BATCH_SIZE))
+			replay_vive_headset_flush_pulses(self, pulses,
+							 &num_pulses);
+
+		switch (event->type) {
+		case RECORDER_EVENT_HID_REPORT:
+			if (event->size != sizeof(*report) + 52)
+				break;
+			report = replay_event_data(event);
+			buf = (const uint8_t *)(report + 1);
+			if (report->interface != 0 ||
+			    buf[0] != VIVE_IMU_REPORT_ID)
+				break;
+			replay_wait(self->replay, event->time);
+			vive_imu_decode_message(dev, &self->imu, buf, 52);
+			break;
+		case RECORDER_EVENT_LIGHTHOUSE_PULSE:
+			if (event->size < sizeof(*pulse))
+				break;
+			pulse = replay_event_data(event);
+			if (!num_pulses) {
+				replay_wait(self->replay, event->time);
+				pulse_time = event->time;
+			}
+			pulses[num_pulses].id = pulse->sensor_id;
+			pulses[num_pulses].duration = pulse->duration;
+			pulses[num_pulses].timestamp = pulse->timestamp;
+			num_pulses++;
+			break;
+		}
+	}
+
+	replay_vive_headset_flush_pulses(self, pulses, &num_pulses);
+
+	g_print("%s: Replay finished\n", dev->name);
+	replay_stream_done(self->replay);
+}
+
+static void replay_vive_headset_stop(G_GNUC_UNUSED OuvrtDevice *dev)
+{
+}
+
+static void ouvrt_replay_vive_headset_class_init(OuvrtReplayViveHeadsetClass *klass)
+{
+	OUVRT_DEVICE_CLASS(klass)->start = replay_vive_headset_start;
+	OUVRT_DEVICE_CLASS(klass)->thread = replay_vive_headset_thread;
+	OUVRT_DEVICE_CLASS(klass)->stop = replay_vive_headset_stop;
+}
+
+/*
+ * The range modes and IMU calibration are read from the headset and are not
+ * part of the recording. Assume the ±2000°/s and ±4g ranges the headset
+ * reports in practice, without bias and scale correction.
+ */
+static void ouvrt_replay_vive_headset_init(OuvrtReplayViveHeadset *self)
+{
+	self->dev.type = DEVICE_TYPE_HMD;
+	self->imu.sequence = 0;
+	self->imu.time = 0;
+	clock_sync_init(&self->imu.clock, 48000000, 32);
+	self->imu.state.pose.rotation.w = 1.0;
+	self->imu.gyro_range = M_PI / 180.0 * 2000;
+	self->imu.accel_range = STANDARD_GRAVITY * 4;
+	self->imu.acc_scale = (vec3){ 1.0, 1.0, 1.0 };
+	self->imu.gyro_scale = (vec3){ 1.0, 1.0, 1.0 };
+	lighthouse_watchman_init(&self->watchman);
+}
+
+/*
+ * Allocates a replay device for a recorded Vive Headset stream.
+ *
+ * Returns the newly allocated replay device.
+ */
+OuvrtDevice *replay_vive_headset_new(struct replay *replay,
+				     unsigned int stream)
+{
+	const struct recorder_stream_info *info;
+	OuvrtReplayViveHeadset *self;
+
+	info = replay_get_stream_info(replay, stream);
+	if (!info)
+		return NULL;
+
+	self = g_object_new(OUVRT_TYPE_REPLAY_VIVE_HEADSET, NULL);
+	self->replay = replay;
+	self->stream = stream;
+	self->dev.name = strndup(info->name, sizeof(info->name));
+	if (info->serial[0])
+		self->dev.serial = strndup(info->serial, sizeof(info->serial));
+
+	return &self->dev;
+}
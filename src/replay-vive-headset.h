@@ -0,0 +1,27 @@
+/*
+ * Replayed HTC Vive Headset
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __REPLAY_VIVE_HEADSET_H__
+#define __REPLAY_VIVE_HEADSET_H__
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "device.h"
+
+struct replay;
+
+G_BEGIN_DECLS
+
+#define OUVRT_TYPE_REPLAY_VIVE_HEADSET (ouvrt_replay_vive_headset_get_type())
+G_DECLARE_FINAL_TYPE(OuvrtReplayViveHeadset, ouvrt_replay_vive_headset, \
+		     OUVRT, REPLAY_VIVE_HEADSET, OuvrtDevice)
+
+OuvrtDevice *replay_vive_headset_new(struct replay *replay,
+				     unsigned int stream);
+
+G_END_DECLS
+
+#endif /* __REPLAY_VIVE_HEADSET_H__ */
@@ -0,0 +1,348 @@
+/*
+ * Session replay
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock-sync.h"
+#include "replay.h"
+
+struct replay_chunk {
+	const struct recorder_chunk_header *header;
+	uint64_t offset;
+};
+
+/*
+ * A recording mapped read-only, with its chunks sorted by stream and file
+ * offset, which is the order in which each stream's chunks were written.
+ */
+struct replay {
+	const uint8_t *map;
+	size_t size;
+
+	struct replay_chunk *chunks;
+	unsigned int num_chunks;
+	const struct recorder_stream_info **streams;
+	unsigned int num_streams;
+	uint64_t start_time;
+
+	double speed;
+	uint64_t start_host;
+	gint num_active;
+	GSourceFunc done;
+	gpointer done_data;
+};
+
+static int compare_chunks(const void *a, const void *b)
+{
+	const struct replay_chunk *x = a;
+	const struct replay_chunk *y = b;
+
+	if (x->header->stream != y->header->stream)
+		return x->header->stream - y->header->stream;
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Adds the chunk at the given offset, if it is valid.
+ */
+static void replay_add_chunk(struct replay *replay, uint64_t offset)
+{
+	const struct recorder_chunk_header *chunk;
+	struct replay_chunk *c;
+
+	if (offset > replay->size ||
+	    replay->size - offset < sizeof(*chunk))
+		return;
+
+	chunk = (const void *)(replay->map + offset);
+	if (chunk->magic != RECORDER_CHUNK_MAGIC ||
+	    chunk->size > replay->size - offset ||
+	    chunk->used > chunk->size || chunk->used < sizeof(*chunk))
+		return;
+
+	replay->chunks = g_renew(struct replay_chunk, replay->chunks,
+				 replay->num_chunks + 1);
+	c = &replay->chunks[replay->num_chunks++];
+	c->header = chunk;
+	c->offset = offset;
+}
+
+/*
+ * Collects all chunks from the index or, if the recording was not closed
+ * properly, by walking the chunks from the start of the file.
+ */
+static void replay_collect_chunks(struct replay *replay)
+{
+	const struct recorder_file_header *header = (const void *)replay->map;
+	const struct recorder_chunk_header *chunk;
+	const struct recorder_index_entry *index;
+	uint64_t offset;
+	uint64_t i;
+
+	if (header->index_offset &&
+	    header->index_offset <= replay->size &&
+	    header->num_index_entries <= (replay->size - header->index_offset) /
+					 sizeof(*index)) {
+		index = (const void *)(replay->map + header->index_offset);
+		for (i = 0; i < header->num_index_entries; i++)
+			replay_add_chunk(replay, index[i].offset);
+		return;
+	}
+
+	g_print("Replay: No index, scanning chunks\n");
+
+	offset = header->header_size;
+	while (offset + sizeof(*chunk) <= replay->size) {
+		chunk = (const void *)(replay->map + offset);
+		if (chunk->magic != RECORDER_CHUNK_MAGIC || !chunk->size)
+			break;
+		replay_add_chunk(replay, offset);
+		offset += chunk->size;
+	}
+}
+
+/*
+ * Maps a recording and collects its streams.
+ *
+ * Returns the replay, or NULL on error.
+ */
+struct replay *replay_open(const char *filename)
+{
+	const struct recorder_file_header *header;
+	const struct recorder_chunk_header *chunk;
+	const struct recorder_event *event;
+	struct replay *replay;
+	struct stat st;
+	unsigned int i;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_print("Replay: Failed to open %s: %d (%s)\n", filename,
+			errno, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < RECORDER_HEADER_SIZE) {
+		g_print("Replay: %s is too short\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		g_print("Replay: Failed to map %s: %d\n", filename, errno);
+		return NULL;
+	}
+
+	header = map;
+	if (memcmp(header->magic, RECORDER_MAGIC, sizeof(header->magic)) ||
+	    header->version != RECORDER_VERSION ||
+	    header->header_size < sizeof(*header)) {
+		g_print("Replay: %s is not a supported recording\n", filename);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	replay = g_new0(struct replay, 1);
+	replay->map = map;
+	replay->size = st.st_size;
+	replay->speed = 1.0;
+	replay->start_time = UINT64_MAX;
+
+	replay_collect_chunks(replay);
+	qsort(replay->chunks, replay->num_chunks, sizeof(*replay->chunks),
+	      compare_chunks);
+
+	for (i = 0; i < replay->num_chunks; i++) {
+		chunk = replay->chunks[i].header;
+		if (chunk->num_events && chunk->first_time < replay->start_time)
+			replay->start_time = chunk->first_time;
+		if (chunk->stream >= replay->num_streams) {
+			replay->streams = g_renew(const struct recorder_stream_info *,
+						  replay->streams,
+						  chunk->stream + 1);
+			memset(replay->streams + replay->num_streams, 0,
+			       (chunk->stream + 1 - replay->num_streams) *
+			       sizeof(*replay->streams));
+			replay->num_streams = chunk->stream + 1;
+		}
+		event = (const void *)(chunk + 1);
+		if (!replay->streams[chunk->stream] && chunk->num_events &&
+		    event->type == RECORDER_EVENT_STREAM &&
+		    event->size >= sizeof(struct recorder_stream_info))
+			replay->streams[chunk->stream] = replay_event_data(event);
+	}
+
+	g_print("Replay: %s contains %u streams in %u chunks\n", filename,
+		replay->num_streams, replay->num_chunks);
+
+	return replay;
+}
+
+/*
+ * Unmaps the recording. All replay devices must have been stopped.
+ */
+void replay_close(struct replay *replay)
+{
+	if (!replay)
+		return;
+
+	munmap((void *)replay->map, replay->size);
+	g_free(replay->chunks);
+	g_free(replay->streams);
+	g_free(replay);
+}
+
+unsigned int replay_get_num_streams(struct replay *replay)
+{
+	return replay->num_streams;
+}
+
+/*
+ * Returns the device description recorded for the stream, or NULL if the
+ * stream's first chunk is missing.
+ */
+const struct recorder_stream_info *
+replay_get_stream_info(struct replay *replay, unsigned int stream)
+{
+	if (stream >= replay->num_streams)
+		return NULL;
+
+	return replay->streams[stream];
+}
+
+/*
+ * Sets the replay speed relative to real time. A speed of 0 replays all
+ * events as fast as possible.
+ */
+void replay_set_speed(struct replay *replay, double speed)
+{
+	replay->speed = speed;
+}
+
+/*
+ * Sets a callback to be called from the main loop when all replay streams
+ * have reached their end.
+ */
+void replay_set_done_callback(struct replay *replay, GSourceFunc callback,
+			      gpointer data)
+{
+	replay->done = callback;
+	replay->done_data = data;
+}
+
+/*
+ * Sets the number of streams that are going to be replayed. Must be called
+ * before any replay device is started, so that streams ending early do not
+ * signal the end of the replay while other streams are still starting.
+ */
+void replay_set_num_active_streams(struct replay *replay, unsigned int num)
+{
+	g_atomic_int_set(&replay->num_active, num);
+}
+
+/*
+ * Called by replay devices when they start replaying a stream. The first
+ * call starts the replay clock shared by all streams.
+ */
+void replay_stream_start(struct replay *replay)
+{
+	uint64_t expected = 0;
+
+	__atomic_compare_exchange_n(&replay->start_host, &expected,
+				    clock_sync_host_now(), false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by replay devices when they reach the end of their stream, or
+ * instead of starting if they fail to start. The last call queues the done
+ * callback.
+ */
+void replay_stream_done(struct replay *replay)
+{
+	if (g_atomic_int_dec_and_test(&replay->num_active) && replay->done)
+		g_idle_add(replay->done, replay->done_data);
+}
+
+/*
+ * Sleeps until the given recorded event time is due, according to the
+ * replay speed.
+ */
+void replay_wait(struct replay *replay, uint64_t time)
+{
+	struct timespec ts;
+	uint64_t start_host;
+	uint64_t target;
+
+	if (replay->speed <= 0.0 || time < replay->start_time)
+		return;
+
+	start_host = __atomic_load_n(&replay->start_host, __ATOMIC_RELAXED);
+	target = start_host + (time - replay->start_time) / replay->speed;
+	ts.tv_sec = target / 1000000000;
+	ts.tv_nsec = target % 1000000000;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			       NULL) == EINTR)
+		;
+}
+
+void replay_cursor_init(struct replay_cursor *cursor, struct replay *replay,
+			unsigned int stream)
+{
+	cursor->replay = replay;
+	cursor->stream = stream;
+	cursor->offset = sizeof(struct recorder_chunk_header);
+
+	for (cursor->chunk = 0; cursor->chunk < replay->num_chunks;
+	     cursor->chunk++) {
+		if (replay->chunks[cursor->chunk].header->stream == stream)
+			break;
+	}
+}
+
+/*
+ * Returns the next event of the stream, or NULL at the end of the stream.
+ */
+const struct recorder_event *replay_cursor_next(struct replay_cursor *cursor)
+{
+	struct replay *replay = cursor->replay;
+	const struct recorder_chunk_header *chunk;
+	const struct recorder_event *event;
+	size_t size;
+
+	while (cursor->chunk < replay->num_chunks) {
+		chunk = replay->chunks[cursor->chunk].header;
+		if (chunk->stream != cursor->stream)
+			return NULL;
+
+		if (chunk->used - cursor->offset >= sizeof(*event)) {
+			event = (const void *)((const uint8_t *)chunk +
+					       cursor->offset);
+			size = sizeof(*event) + ((event->size + 7) & ~7U);
+			if (size <= chunk->used - cursor->offset) {
+				cursor->offset += size;
+				return event;
+			}
+		}
+
+		cursor->chunk++;
+		cursor->offset = sizeof(*chunk);
+	}
+
+	return NULL;
+}
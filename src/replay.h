@@ -0,0 +1,53 @@
+/*
+ * Session replay
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "recorder.h"
+
+struct replay;
+
+/*
+ * Iterates over the events of a single stream in a recording.
+ */
+struct replay_cursor {
+	struct replay *replay;
+	unsigned int stream;
+	unsigned int chunk;
+	uint32_t offset;
+};
+
+struct replay *replay_open(const char *filename);
+void replay_close(struct replay *replay);
+
+unsigned int replay_get_num_streams(struct replay *replay);
+const struct recorder_stream_info *
+replay_get_stream_info(struct replay *replay, unsigned int stream);
+
+void replay_set_speed(struct replay *replay, double speed);
+void replay_set_done_callback(struct replay *replay, GSourceFunc callback,
+			      gpointer data);
+void replay_set_num_active_streams(struct replay *replay, unsigned int num);
+void replay_stream_start(struct replay *replay);
+void replay_stream_done(struct replay *replay);
+void replay_wait(struct replay *replay, uint64_t time);
+
+void replay_cursor_init(struct replay_cursor *cursor, struct replay *replay,
+			unsigned int stream);
+const struct recorder_event *replay_cursor_next(struct replay_cursor *cursor);
+
+/*
+ * Returns a pointer to the payload of a recorded event.
+ */
+static inline const void *replay_event_data(const struct recorder_event *event)
+{
+	return event + 1;
+}
+
+#endif /* __REPLAY_H__ */
@@ -12,6 +12,7 @@
 #include "rift-hid-reports.h"
 #include "rift-radio.h"
 #include "buttons.h"
+#include "cache.h"
 #include "hidraw.h"
 #include "imu.h"
 #include "json.h"
@@ -195,7 +196,11 @@ int rift_radio_get_address(int fd, uint8_t address[5])
 	return 0;
 }
 
-int rift_get_firmware_version(int fd)
+/*
+ * Reads the headset firmware version into the 11-byte firmware_version
+ * string.
+ */
+int rift_get_firmware_version(int fd, char *firmware_version)
 {
 	struct rift_radio_data_report report = {
 		.id = RIFT_RADIO_DATA_REPORT_ID,
@@ -208,10 +213,11 @@ int rift_get_firmware_version(int fd)
 	if (ret < 0)
 		return ret;
 
-	g_print("Rift: Firmware version ");
-	for (i = 14; i < 24 && g_ascii_isalnum(report.payload[i]); i++)
-		g_print("%c", report.payload[i]);
-	g_print("\n");
+	for (i = 0; i < 10 && g_ascii_isalnum(report.payload[14 + i]); i++)
+		firmware_version[i] = report.payload[14 + i];
+	firmware_version[i] = '\0';
+
+	g_print("Rift: Firmware version %s\n", firmware_version);
 
 	return 0;
 }
@@ -300,8 +306,13 @@ static const struct button_map touch_right_button_map[4] = {
 	{ RIFT_TOUCH_CONTROLLER_BUTTON_STICK, OUVRT_BUTTON_JOYSTICK },
 };
 
+/*
+ * Decodes a Touch controller message received at host time now. The sample
+ * timestamps count microseconds and are mapped to CLOCK_MONOTONIC.
+ */
 static void rift_decode_touch_message(struct rift_touch_controller *touch,
-				      const struct rift_radio_message *message)
+				      const struct rift_radio_message *message,
+				      uint64_t now)
 {
 	uint32_t timestamp = __le32_to_cpu(message->touch.timestamp);
 	int16_t accel[3] = {
@@ -341,6 +352,10 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 	      gyro[0] || gyro[1] || gyro[2]))
 		return;
 
+	uint64_t ticks = clock_sync_unwrap(&touch->clock, timestamp);
+
+	clock_sync_update(&touch->clock, ticks, now);
+
 	struct imu_sample *sample = &touch->imu.sample;
 	struct rift_touch_calibration *c = &touch->calibration;
 	const double a[3] = {
@@ -372,7 +387,7 @@ static void rift_decode_touch_message(struct rift_touch_controller *touch,
 			  c->gyro_calibration[7] * g[1] +
 			  c->gyro_calibration[8] * g[2];
 
-	sample->time = timestamp;
+	sample->time = 1e-9 * clock_sync_ticks_to_host(&touch->clock, ticks);
 	sample->acceleration.x = ax;
 	sample->acceleration.y = ay;
 	sample->acceleration.z = az;
@@ -569,15 +584,74 @@ static int rift_touch_parse_calibration(struct rift_touch_controller *touch,
 	return 0;
 }
 
+/* "TOUC" */
+#define RIFT_TOUCH_CALIBRATION_CACHE_MAGIC	0x43554f54
+#define RIFT_TOUCH_CALIBRATION_CACHE_VERSION	1
+
+/*
+ * Loads the parsed calibration and tracking model from the binary cache,
+ * which contains struct rift_touch_calibration followed by the serialized
+ * tracking model.
+ */
+static int rift_touch_map_calibration(struct rift_touch_controller *touch,
+				      const char *name)
+{
+	const struct rift_touch_calibration *c;
+	struct cache_mapping map;
+	ssize_t ret;
+
+	if (!cache_map(name, RIFT_TOUCH_CALIBRATION_CACHE_MAGIC,
+		       RIFT_TOUCH_CALIBRATION_CACHE_VERSION, &map))
+		return -ENOENT;
+
+	if (map.size < sizeof(*c)) {
+		cache_unmap(&map);
+		return -ENOENT;
+	}
+
+	c = map.data;
+	ret = tracking_model_deserialize(&touch->model, c + 1,
+					 map.size - sizeof(*c));
+	if (ret < 0) {
+		cache_unmap(&map);
+		return -ENOENT;
+	}
+
+	touch->calibration = *c;
+
+	cache_unmap(&map);
+
+	return 0;
+}
+
+/*
+ * Stores the parsed calibration and tracking model in the binary cache.
+ */
+static void rift_touch_cache_calibration(struct rift_touch_controller *touch,
+					 const char *name)
+{
+	struct rift_touch_calibration *c;
+	size_t size;
+
+	size = sizeof(*c) + tracking_model_serialized_size(&touch->model);
+	c = g_malloc(size);
+	*c = touch->calibration;
+	tracking_model_serialize(&touch->model, c + 1);
+
+	cache_write_binary(name, RIFT_TOUCH_CALIBRATION_CACHE_MAGIC,
+			   RIFT_TOUCH_CALIBRATION_CACHE_VERSION, c, size);
+
+	g_free(c);
+}
+
 static int rift_touch_get_calibration(struct rift_touch_controller *touch,
 				      int fd)
 {
 	struct rift_wireless_device *dev = &touch->base;
 	uint8_t hash[16];
 	char hash_string[33];
-	gboolean success;
-	char *path;
-	char *filename;
+	char *bin_name;
+	char *name;
 	char *json;
 	int ret;
 	int i;
@@ -596,14 +670,19 @@ static int rift_touch_get_calibration(struct rift_touch_controller *touch,
 
 	g_print("Rift: %s: calibration hash: %s\n", dev->name, hash_string);
 
-	path = g_strdup_printf("%s/ouvrt", g_get_user_cache_dir());
+	name = g_strdup_printf("%.14s_%s.%ctouch", dev->serial, hash_string,
+			       (dev->id == RIFT_TOUCH_CONTROLLER_LEFT) ? 'l' : 'r');
+	bin_name = g_strconcat(name, ".bin", NULL);
 
-	filename = g_strdup_printf("%s/%.14s_%s.%ctouch", path, dev->serial,
-				   hash_string,
-				   (dev->id == RIFT_TOUCH_CONTROLLER_LEFT) ? 'l' : 'r');
+	if (rift_touch_map_calibration(touch, bin_name) == 0) {
+		g_print("Rift: %s: read cached binary calibration data\n",
+			dev->name);
+		g_free(bin_name);
+		g_free(name);
+		return 0;
+	}
 
-	success = g_file_get_contents(filename, &json, NULL, NULL);
-	if (success) {
+	if (cache_read(name, &json, NULL)) {
 		g_print("Rift: %s: read cached calibration data\n", dev->name);
 	} else {
 		uint16_t length;
@@ -612,22 +691,22 @@ static int rift_touch_get_calibration(struct rift_touch_controller *touch,
 
 		ret = rift_radio_read_calibration(fd, dev->id, &json, &length);
 		if (ret < 0) {
-			g_free(filename);
-			g_free(path);
+			g_free(bin_name);
+			g_free(name);
 			return ret;
 		}
 
-		g_mkdir_with_parents(path, 0755);
-		g_file_set_contents(filename, json, length, NULL);
+		cache_write(name, json, length);
 
 		g_print("Rift: %s: wrote calibration data cache\n", dev->name);
 	}
 
-	g_free(filename);
-	g_free(path);
+	g_free(name);
 
-	rift_touch_parse_calibration(touch, json, &touch->calibration);
+	if (rift_touch_parse_calibration(touch, json, &touch->calibration) == 0)
+		rift_touch_cache_calibration(touch, bin_name);
 
+	g_free(bin_name);
 	g_free(json);
 
 	return 0;
@@ -787,7 +866,8 @@ int rift_decode_pairing_message(struct rift_radio *radio, int fd,
 }
 
 int rift_decode_radio_message(struct rift_radio *radio, int fd,
-			      const struct rift_radio_message *message)
+			      const struct rift_radio_message *message,
+			      uint64_t now)
 {
 	if (radio->pairing)
 		return rift_decode_pairing_message(radio, fd, message);
@@ -810,7 +890,7 @@ int rift_decode_radio_message(struct rift_radio *radio, int fd,
 		}
 		if (!radio->touch[0].base.active && message->touch.timestamp)
 			rift_radio_activate(&radio->touch[0].base, fd);
-		rift_decode_touch_message(&radio->touch[0], message);
+		rift_decode_touch_message(&radio->touch[0], message, now);
 	} else if (message->device_type == RIFT_TOUCH_CONTROLLER_RIGHT) {
 		if (!radio->touch[1].base.present) {
 			g_print("Rift: %s present (%sactive)\n",
@@ -820,7 +900,7 @@ int rift_decode_radio_message(struct rift_radio *radio, int fd,
 		}
 		if (!radio->touch[1].base.active && message->touch.timestamp)
 			rift_radio_activate(&radio->touch[1].base, fd);
-		rift_decode_touch_message(&radio->touch[1], message);
+		rift_decode_touch_message(&radio->touch[1], message, now);
 	} else {
 		g_print("%s: unknown device %02x:", radio->name,
 			message->device_type);
@@ -831,7 +911,8 @@ int rift_decode_radio_message(struct rift_radio *radio, int fd,
 }
 
 void rift_decode_radio_report(struct rift_radio *radio, int fd,
-			      const unsigned char *buf, size_t len)
+			      const unsigned char *buf, size_t len,
+			      uint64_t now)
 {
 	const struct rift_radio_report *report = (const void *)buf;
 	int ret;
@@ -840,7 +921,8 @@ void rift_decode_radio_report(struct rift_radio *radio, int fd,
 	if (report->id == RIFT_RADIO_REPORT_ID) {
 		for (i = 0; i < 2; i++) {
 			ret = rift_decode_radio_message(radio, fd,
-							&report->message[i]);
+							&report->message[i],
+							now);
 			if (ret < 0) {
 				rift_dump_report(buf, len);
 				return;
@@ -864,7 +946,9 @@ void rift_radio_init(struct rift_radio *radio)
 	radio->touch[0].base.name = "Touch Controller L";
 	radio->touch[0].base.id = RIFT_TOUCH_CONTROLLER_LEFT;
 	radio->touch[0].imu.pose.rotation.w = 1.0;
+	clock_sync_init(&radio->touch[0].clock, 1000000, 32);
 	radio->touch[1].base.name = "Touch Controller R";
 	radio->touch[1].base.id = RIFT_TOUCH_CONTROLLER_RIGHT;
 	radio->touch[1].imu.pose.rotation.w = 1.0;
+	clock_sync_init(&radio->touch[1].clock, 1000000, 32);
 }
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+#include "clock-sync.h"
 #include "imu.h"
 #include "tracking-model.h"
 
@@ -57,6 +58,7 @@ struct rift_touch_controller {
 	struct rift_touch_calibration calibration;
 	struct tracking_model model;
 	struct imu_state imu;
+	struct clock_sync clock;
 	uint32_t last_timestamp;
 	float trigger;
 	float grip;
@@ -79,10 +81,11 @@ struct rift_radio {
 };
 
 int rift_radio_get_address(int fd, uint8_t address[5]);
-int rift_get_firmware_version(int fd);
+int rift_get_firmware_version(int fd, char *firmware_version);
 
 void rift_decode_radio_report(struct rift_radio *radio, int fd,
-			      const unsigned char *buf, size_t len);
+			      const unsigned char *buf, size_t len,
+			      uint64_t now);
 void rift_radio_init(struct rift_radio *radio);
 
 #endif /* __RIFT_RADIO_H__ */
@@ -21,6 +21,9 @@
 #include "usb-ids.h"
 #include "uvc.h"
 #include "debug.h"
+#include "latency.h"
+#include "recorder.h"
+#include "trace.h"
 
 #define RIFT_SENSOR_WIDTH	1280
 #define RIFT_SENSOR_HEIGHT	960
@@ -154,22 +157,57 @@ static void default_frame_callback(OuvrtRiftSensor *self)
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+	OUVRT_TRACE(frame_dequeue, self->dev.id, self->pts, self->time);
+
 	/*
 	 * Find bright blobs in the camera image and identify individual LEDs
 	 * using the estimated pose at time of exposure or, if that is not
 	 * available, using the LED blinking pattern.
 	 */
 	struct blobservation *ob = NULL;
+
+	if (recorder_record_frames()) {
+		struct recorder_frame frame = {
+			.sequence = self->pts,
+			.width = RIFT_SENSOR_WIDTH,
+			.height = RIFT_SENSOR_HEIGHT,
+		};
+
+		recorder_write(self->dev.rec, RECORDER_EVENT_FRAME, self->time,
+			       &frame, sizeof(frame), self->frame,
+			       RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT);
+	}
+
 	if (self->tracker) {
+		OUVRT_TRACE(blob_detect_start, self->dev.id, self->time);
 		ouvrt_tracker_process_frame(self->tracker,
 					    self->frame, RIFT_SENSOR_WIDTH,
 					    RIFT_SENSOR_HEIGHT, self->time,
 					    &ob);
+		OUVRT_TRACE(blob_detect_end, self->dev.id, self->time,
+			    ob ? ob->num_blobs : 0);
+	}
+
+	if (ob) {
+		struct recorder_blobs blobs = {
+			.sequence = self->pts,
+			.num_blobs = ob->num_blobs,
+		};
+
+		recorder_write(self->dev.rec, RECORDER_EVENT_BLOBS, self->time,
+			       &blobs, sizeof(blobs), ob->blobs,
+			       ob->num_blobs * sizeof(struct blob));
 	}
 
 	clock_gettime(CLOCK_MONOTONIC, &tp);
 	timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
+	if (self->tracker) {
+		latency_record(self->dev.id, LATENCY_CAPTURE_TO_DETECT,
+			       tp.tv_sec * 1000000000ULL + tp.tv_nsec -
+			       self->time);
+	}
+
 	dquat rot = { 0 };
 	dvec3 trans = { 0 };
 
@@ -179,8 +217,6 @@ static void default_frame_callback(OuvrtRiftSensor *self)
 	timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
 
 	debug_stream_frame_push(self->debug, self->frame,
-				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT +
-				sizeof(struct ouvrt_debug_attachment),
 				RIFT_SENSOR_WIDTH * RIFT_SENSOR_HEIGHT,
 				ob, &rot, &trans, timestamps);
 }
@@ -395,8 +431,7 @@ static int rift_sensor_start(OuvrtDevice *dev)
 	}
 
 	self->frame_size = RIFT_SENSOR_FRAME_SIZE;
-	self->frame = calloc(1, self->frame_size +
-			     sizeof(struct ouvrt_debug_attachment));
+	self->frame = calloc(1, self->frame_size);
 	if (!self->frame)
 		return -ENOMEM;
 
@@ -16,13 +16,20 @@
 #include "rift.h"
 #include "rift-hid-reports.h"
 #include "rift-radio.h"
+#include "cache.h"
+#include "clock-sync.h"
 #include "debug.h"
 #include "device.h"
+#include "hid-uring.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "latency.h"
 #include "maths.h"
 #include "leds.h"
+#include "log-ring.h"
+#include "recorder.h"
 #include "telemetry.h"
+#include "trace.h"
 #include "tracker.h"
 
 /* 44 LEDs + 1 IMU on CV1 */
@@ -42,12 +49,13 @@ struct _OuvrtRift {
 	vec3 imu_position;
 
 	unsigned char uuid[20];
+	unsigned char flash[6][64];
 	int report_rate;
 	int report_interval;
 	gboolean flicker;
 	bool reboot;
 	uint8_t boot_mode;
-	uint64_t last_message_time;
+	struct clock_sync clock;
 	uint64_t last_sample_timestamp;
 	uint32_t last_exposure_timestamp;
 	int32_t last_exposure_count;
@@ -514,7 +522,7 @@ static int rift_cv1_power_down(OuvrtRift *rift, uint8_t components)
  */
 static void rift_decode_sensor_message(OuvrtRift *rift,
 				       const unsigned char *buf,
-				       size_t len, struct timespec *ts)
+				       size_t len, uint64_t message_time)
 {
 	struct rift_sensor_message *message = (void *)buf;
 	uint8_t num_samples;
@@ -528,16 +536,14 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 	uint8_t led_pattern_phase;
 	uint16_t exposure_count;
 	uint32_t exposure_timestamp;
-	uint64_t message_time;
 	struct imu_sample sample;
+	uint64_t ticks;
 	int32_t dt;
 	int i;
 
 	if (len < sizeof(*message))
 		return;
 
-	message_time = ts->tv_sec * 1000000000 + ts->tv_nsec;
-
 	num_samples = message->num_samples;
 	sample_count = __le16_to_cpu(message->sample_count);
 	/* 10⁻²°C */
@@ -546,7 +552,9 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 
 	sample_timestamp = __le32_to_cpu(message->timestamp);
 	/* µs, wraps every ~72 min */
-	sample.time = 1e-6 * sample_timestamp;
+	ticks = clock_sync_unwrap(&rift->clock, sample_timestamp);
+	clock_sync_update(&rift->clock, ticks, message_time);
+	sample.time = 1e-9 * clock_sync_ticks_to_host(&rift->clock, ticks);
 
 	dt = sample_timestamp - rift->last_sample_timestamp;
 	/* µs, wraps every ~600k years */
@@ -554,19 +562,18 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 
 	if ((dt < num_samples * rift->report_interval - 75) ||
 	    (dt > num_samples * rift->report_interval + 75)) {
-		rift->last_message_time = message_time;
 		if (rift->last_sample_timestamp - dt == 0)
 			return;
 		if (dt < 0)
-			g_print("Rift: got %u samples after %d µs\n",
-				num_samples, dt);
+			ouvrt_log("Rift: got %u samples after %d µs\n",
+				  num_samples, dt);
 		else if (dt + 1 >= (num_samples + 1) * rift->report_interval)
-			g_print("Rift: got %u samples after %d µs, %u samples lost\n",
-				num_samples, dt,
-				(dt + 1) / rift->report_interval - num_samples);
+			ouvrt_log("Rift: got %u samples after %d µs, %u samples lost\n",
+				  num_samples, dt,
+				  (dt + 1) / rift->report_interval - num_samples);
 		else
-			g_print("Rift: got %u samples after %d µs, too much jitter\n",
-				num_samples, dt);
+			ouvrt_log("Rift: got %u samples after %d µs, too much jitter\n",
+				  num_samples, dt);
 		return;
 	}
 
@@ -594,6 +601,9 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 			       &sample.angular_velocity);
 
 		telemetry_send_imu_sample(rift->dev.id, &sample);
+		recorder_write(rift->dev.rec, RECORDER_EVENT_IMU_SAMPLE,
+			       sample.time * 1e9, &sample, sizeof(sample),
+			       NULL, 0);
 
 		pose_update(1e-6 / num_samples * dt, &rift->imu.pose, &sample);
 
@@ -603,11 +613,16 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 	}
 
 	if (exposure_count != rift->last_exposure_count) {
-		int32_t sample_expo_dt = (int32_t)sample_timestamp -
-					 exposure_timestamp;
-		uint64_t exposure_time = message_time - (message_time -
-					 rift->last_message_time) *
-					 sample_expo_dt / dt;
+		uint64_t exposure_time = clock_sync_raw_to_host(&rift->clock,
+							exposure_timestamp);
+		struct recorder_exposure exposure = {
+			.device_timestamp = exposure_timestamp,
+			.led_pattern_phase = led_pattern_phase,
+		};
+
+		recorder_write(rift->dev.rec, RECORDER_EVENT_EXPOSURE,
+			       exposure_time, &exposure, sizeof(exposure),
+			       NULL, 0);
 
 		ouvrt_tracker_add_exposure(rift->tracker, exposure_timestamp,
 					   exposure_time, led_pattern_phase);
@@ -616,14 +631,60 @@ static void rift_decode_sensor_message(OuvrtRift *rift,
 		rift->last_exposure_count = exposure_count;
 	}
 
-	rift->last_message_time = message_time;
-
 	(void)frame_id;
 	(void)frame_timestamp;
 	(void)frame_count;
 	(void)sample_count;
 }
 
+/*
+ * Decodes a batch of sensor messages drained from the IMU interface in a
+ * single wakeup. All messages share the same receive time, so each earlier
+ * message is backdated by the distance of its sample timestamp to the one
+ * of the last message in the batch.
+ */
+static void rift_decode_sensor_messages(OuvrtRift *rift,
+					const unsigned char (*buf)[64],
+					const int *len, int num, uint64_t time)
+{
+	const struct rift_sensor_message *message;
+	uint64_t start = clock_sync_host_now();
+	uint32_t last_timestamp = 0;
+	int32_t dt;
+	int i;
+
+	OUVRT_TRACE(imu_decode_start, rift->dev.id, time, num);
+
+	for (i = num - 1; i >= 0; i--) {
+		if (len[i] < 64)
+			continue;
+		message = (void *)buf[i];
+		last_timestamp = __le32_to_cpu(message->timestamp);
+		break;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (len[i] < 64) {
+			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+				rift->dev.name, len[i], buf[i][0]);
+			continue;
+		}
+
+		message = (void *)buf[i];
+		dt = last_timestamp - __le32_to_cpu(message->timestamp);
+		if (dt < 0)
+			dt = 0;
+
+		rift_decode_sensor_message(rift, buf[i], 64,
+					   time - 1000 * (uint64_t)dt);
+	}
+
+	OUVRT_TRACE(imu_decode_end, rift->dev.id, time);
+
+	latency_record(rift->dev.id, LATENCY_IMU_DECODE,
+		       clock_sync_host_now() - start);
+}
+
 static int rift_get_boot_mode(OuvrtRift *rift)
 {
 	struct rift_bootload_report report = {
@@ -682,12 +743,58 @@ static int rift_read_flash(OuvrtRift *rift, uint8_t index, unsigned char *buf)
 	return 0;
 }
 
+/*
+ * Reads the CV1 flash blocks into rift->flash, or copies them from the cache
+ * if this headset was seen before with the same firmware version. Without
+ * serial number or firmware version, the blocks are always read.
+ */
+static int rift_read_flash_blocks(OuvrtRift *rift, const char *firmware_version)
+{
+	static const unsigned char index[6] = { 0, 5, 3, 4, 36, 33 };
+	gchar *cached;
+	gchar *name = NULL;
+	gsize length;
+	int ret;
+	int i;
+
+	if (rift->dev.serial && firmware_version[0]) {
+		name = g_strdup_printf("rift-%s-%s.flash", rift->dev.serial,
+				       firmware_version);
+		if (cache_read(name, &cached, &length)) {
+			if (length == sizeof(rift->flash)) {
+				g_print("Rift: Read cached flash blocks\n");
+				memcpy(rift->flash, cached, length);
+				g_free(cached);
+				g_free(name);
+				return 0;
+			}
+			g_free(cached);
+		}
+	}
+
+	for (i = 0; i < 6; i++) {
+		ret = rift_read_flash(rift, index[i], rift->flash[i]);
+		if (ret < 0) {
+			g_free(name);
+			return ret;
+		}
+		/* TODO: figure out what to do with these */
+	}
+
+	if (name)
+		cache_write(name, rift->flash, sizeof(rift->flash));
+	g_free(name);
+
+	return 0;
+}
+
 /*
  * Enables the IR tracking LEDs and registers them with the tracker.
  */
 static int rift_start(OuvrtDevice *dev)
 {
 	OuvrtRift *rift = OUVRT_RIFT(dev);
+	char firmware_version[10 + 1] = "";
 	int ret;
 
 	if (rift->type == RIFT_CV1) {
@@ -713,7 +820,8 @@ static int rift_start(OuvrtDevice *dev)
 	if (rift->type == RIFT_CV1) {
 		ret = rift_get_boot_mode(rift);
 		if (ret == RIFT_BOOT_NORMAL)
-			rift_get_firmware_version(dev->fds[0]);
+			rift_get_firmware_version(dev->fds[0],
+						  firmware_version);
 	}
 
 	ret = rift_get_ranges(rift);
@@ -731,16 +839,9 @@ static int rift_start(OuvrtDevice *dev)
 	}
 
 	if (rift->type == RIFT_CV1) {
-		unsigned char index[6] = { 0, 5, 3, 4, 36, 33 };
-		unsigned char buf[64];
-		int i;
-
-		for (i = 0; i < 6; i++) {
-			ret = rift_read_flash(rift, index[i], buf);
-			if (ret < 0)
-				return ret;
-			/* TODO: figure out what to do with these */
-		}
+		ret = rift_read_flash_blocks(rift, firmware_version);
+		if (ret < 0)
+			return ret;
 	}
 
 	ret = rift_get_led_patterns(rift);
@@ -783,15 +884,83 @@ static int rift_start(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Decodes a radio report received at host time now and claims device ids for
+ * newly active wireless devices.
+ */
+static void rift_handle_radio_report(OuvrtRift *rift,
+				     const unsigned char *buf, int len,
+				     uint64_t now)
+{
+	OuvrtDevice *dev = &rift->dev;
+	struct rift_wireless_device *c;
+
+	if (len != 64 ||
+	    (buf[0] != RIFT_RADIO_REPORT_ID &&
+	     buf[0] != RIFT_RADIO_UNKNOWN_MESSAGE_ID)) {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
+		return;
+	}
+
+	rift_decode_radio_report(&rift->radio, dev->fds[1], buf, len, now);
+
+	c = &rift->radio.remote.base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+	c = &rift->radio.touch[0].base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+	c = &rift->radio.touch[1].base;
+	if (c->active && !c->dev_id)
+		c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+}
+
+/*
+ * Decodes a batch of previously received sensor reports as if they had
+ * arrived on the IMU interface at the given host time. Used to replay
+ * recorded sessions with their recorded receive time, so that exposures
+ * share the time base of the recorded camera frames.
+ */
+void ouvrt_rift_decode_sensor_reports(OuvrtRift *rift,
+				      const unsigned char *buf,
+				      const int *lens, int num, uint64_t time)
+{
+	rift_decode_sensor_messages(rift, (void *)buf, lens, num, time);
+}
+
+/*
+ * Handles a batch of reports received from the IMU (index 0) or radio
+ * (index 1) interface.
+ */
+static void rift_handle_reports(void *data, int index, unsigned char *buf,
+				size_t len, const int *lens, int num)
+{
+	OuvrtRift *rift = data;
+	uint64_t now = clock_sync_host_now();
+	int i;
+
+	recorder_write_hid_reports(rift->dev.rec, index, buf, len, lens, num);
+
+	if (index == 0) {
+		rift_decode_sensor_messages(rift, (void *)buf, lens, num, now);
+	} else {
+		for (i = 0; i < num; i++)
+			rift_handle_radio_report(rift, buf + i * len, lens[i],
+						 now);
+	}
+}
+
 /*
  * Keeps the Rift active.
  */
 static void rift_thread(OuvrtDevice *dev)
 {
 	OuvrtRift *rift = OUVRT_RIFT(dev);
-	unsigned char buf[64];
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
+	struct hid_uring *uring;
 	struct pollfd fds[2];
-	struct timespec ts;
 	int count;
 	int ret;
 
@@ -799,7 +968,27 @@ static void rift_thread(OuvrtDevice *dev)
 	rift_send_keepalive(rift);
 	count = 0;
 
+	uring = hid_uring_new(dev->fds, dev->fds[1] == -1 ? 1 : 2);
+	if (uring)
+		g_print("%s: Using io_uring\n", dev->name);
+
 	while (dev->active) {
+		if (uring) {
+			ret = hid_uring_wait(uring, 1000, rift_handle_reports,
+					     rift);
+			if (ret == -ENODEV)
+				break;
+			if (ret <= 0 || count > 9 * rift->report_rate) {
+				if (ret <= 0)
+					g_print("Rift: Resending keepalive\n");
+				rift_send_keepalive(rift);
+				count = 0;
+				continue;
+			}
+			count += ret;
+			continue;
+		}
+
 		fds[0].fd = dev->fds[0];
 		fds[0].events = POLLIN;
 		fds[0].revents = 0;
@@ -808,7 +997,6 @@ static void rift_thread(OuvrtDevice *dev)
 		fds[1].revents = 0;
 
 		ret = poll(fds, 2, 1000);
-		clock_gettime(CLOCK_MONOTONIC, &ts);
 		if (ret == -1 || ret == 0 ||
 		    count > 9 * rift->report_rate) {
 			if (ret == -1 || ret == 0)
@@ -823,53 +1011,31 @@ static void rift_thread(OuvrtDevice *dev)
 			break;
 
 		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[0], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
 				continue;
 			}
-			if (ret < 64) {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
 
-			rift_decode_sensor_message(rift, buf, sizeof(buf), &ts);
-			count++;
+			rift_handle_reports(rift, 0, buf[0], 64, len, ret);
+			count += ret;
 		}
 		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[1], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
 				continue;
 			}
 
-			if (ret != 64 ||
-			    (buf[0] != RIFT_RADIO_REPORT_ID &&
-			     buf[0] != RIFT_RADIO_UNKNOWN_MESSAGE_ID)) {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
-
-			rift_decode_radio_report(&rift->radio, dev->fds[1],
-						 buf, sizeof(buf));
-
-			struct rift_wireless_device *c;
-
-			c = &rift->radio.remote.base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[0].base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
-			c = &rift->radio.touch[1].base;
-			if (c->active && !c->dev_id)
-				c->dev_id = ouvrt_device_claim_id(dev, c->serial);
+			rift_handle_reports(rift, 1, buf[0], 64, len, ret);
 		}
 	}
+
+	hid_uring_free(uring);
 }
 
 /*
@@ -979,6 +1145,9 @@ static void ouvrt_rift_init(OuvrtRift *self)
 	self->dev.type = DEVICE_TYPE_HMD;
 	self->flicker = false;
 	self->last_sample_timestamp = 0;
+	self->report_rate = 1000;
+	self->report_interval = 1000;
+	clock_sync_init(&self->clock, 1000000, 32);
 	rift_radio_init(&self->radio);
 	self->imu.pose.rotation.w = 1.0;
 }
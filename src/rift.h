@@ -22,5 +22,8 @@ OuvrtDevice *rift_cv1_new(const char *devnode);
 
 void ouvrt_rift_set_flicker(OuvrtRift *camera, gboolean flicker);
 OuvrtTracker *ouvrt_rift_get_tracker(OuvrtRift *rift);
+void ouvrt_rift_decode_sensor_reports(OuvrtRift *rift,
+				      const unsigned char *buf,
+				      const int *lens, int num, uint64_t time);
 
 #endif /* __RIFT_H__ */
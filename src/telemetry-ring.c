@@ -0,0 +1,143 @@
+/*
+ * Shared memory telemetry ring
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "telemetry-ring.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+static struct telemetry_ring_header *telemetry_ring;
+static int telemetry_ring_fd = -1;
+
+/*
+ * Creates the memfd backed telemetry ring. The memfd is sealed against
+ * resizing, so that consumers can not make the daemon fault on its mapping,
+ * and against new writable mappings. If the kernel does not support this
+ * (F_SEAL_FUTURE_WRITE needs Linux 5.1), the ring is not created and thus
+ * never exported to consumers.
+ */
+int telemetry_ring_init(void)
+{
+	struct telemetry_ring_header *ring;
+	size_t size = telemetry_ring_size();
+	int fd, ret;
+
+	if (telemetry_ring)
+		return -EBUSY;
+
+	fd = memfd_create("ouvrt-telemetry", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		g_print("Telemetry: Failed to create memfd: %d (%s)\n", errno,
+			strerror(errno));
+		return -errno;
+	}
+
+	ret = ftruncate(fd, size);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0 ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL) < 0) {
+		ret = -errno;
+		g_print("Telemetry: Failed to seal memfd: %d (%s)\n", -ret,
+			strerror(-ret));
+		munmap(ring, size);
+		close(fd);
+		return ret;
+	}
+
+	ring->magic = TELEMETRY_RING_MAGIC;
+	ring->version = TELEMETRY_RING_VERSION;
+	ring->slot_size = TELEMETRY_RING_SLOT_SIZE;
+	ring->num_slots = TELEMETRY_RING_NUM_SLOTS;
+
+	telemetry_ring = ring;
+	telemetry_ring_fd = fd;
+
+	return 0;
+}
+
+/*
+ * Returns the slot for the given sequence number. Unlike the consumer side
+ * telemetry_ring_slot(), this does not trust the layout fields in the shared
+ * header, which consumers could overwrite.
+ */
+static struct telemetry_ring_slot *
+telemetry_ring_producer_slot(struct telemetry_ring_header *ring, uint64_t seq)
+{
+	return (struct telemetry_ring_slot *)((uint8_t *)(ring + 1) +
+		(seq % TELEMETRY_RING_NUM_SLOTS) * TELEMETRY_RING_SLOT_SIZE);
+}
+
+/*
+ * Copies a telemetry record into the next slot of the ring. Never blocks,
+ * the oldest records are overwritten if consumers do not keep up.
+ */
+void telemetry_ring_write(const void *record, size_t len)
+{
+	struct telemetry_ring_header *ring = telemetry_ring;
+	struct telemetry_ring_slot *slot;
+	uint64_t seq;
+
+	if (!ring)
+		return;
+
+	if (len > TELEMETRY_RING_MAX_RECORD) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	seq = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	slot = telemetry_ring_producer_slot(ring, seq);
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->len = len;
+	memcpy(slot->data, record, len);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the memfd backing the telemetry ring, or -1 if it is not
+ * available.
+ */
+int telemetry_ring_get_fd(void)
+{
+	return telemetry_ring_fd;
+}
+
+/*
+ * Unmaps the telemetry ring and closes the memfd.
+ */
+void telemetry_ring_deinit(void)
+{
+	if (!telemetry_ring)
+		return;
+
+	munmap(telemetry_ring, telemetry_ring_size());
+	close(telemetry_ring_fd);
+	telemetry_ring = NULL;
+	telemetry_ring_fd = -1;
+}
@@ -0,0 +1,114 @@
+/*
+ * Shared memory telemetry ring
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __TELEMETRY_RING_H__
+#define __TELEMETRY_RING_H__
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TELEMETRY_RING_MAGIC		0x5456554f /* "OUVT" */
+#define TELEMETRY_RING_VERSION		2
+#define TELEMETRY_RING_NUM_SLOTS	4096
+#define TELEMETRY_RING_SLOT_SIZE	336
+#define TELEMETRY_RING_MAX_RECORD	(TELEMETRY_RING_SLOT_SIZE - 16)
+
+/*
+ * The shared memory region starts with this header, followed by num_slots
+ * slots of slot_size bytes each. head is the sequence number of the next
+ * record to be written. Producers claim sequence numbers by incrementing
+ * head atomically, so multiple device threads can write concurrently.
+ */
+struct telemetry_ring_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t num_slots;
+	uint32_t reserved;
+	uint64_t head;
+	uint64_t dropped;
+	uint8_t padding[32];
+};
+
+/*
+ * A slot contains a single TELEMETRY_PACKET_* record in the compact encoding
+ * described in telemetry-wire.h, delta encoded against a freshly reset
+ * context so that each slot can be decoded on its own. seq is 0 while the
+ * slot is being written, and set to the record's sequence number plus one
+ * when the record is complete.
+ */
+struct telemetry_ring_slot {
+	uint64_t seq;
+	uint16_t len;
+	uint8_t reserved[6];
+	uint8_t data[TELEMETRY_RING_MAX_RECORD];
+};
+
+static inline struct telemetry_ring_slot *
+telemetry_ring_slot(const struct telemetry_ring_header *ring, uint64_t seq)
+{
+	return (struct telemetry_ring_slot *)((uint8_t *)(ring + 1) +
+		(seq % ring->num_slots) * ring->slot_size);
+}
+
+static inline size_t telemetry_ring_size(void)
+{
+	return sizeof(struct telemetry_ring_header) +
+	       TELEMETRY_RING_NUM_SLOTS * TELEMETRY_RING_SLOT_SIZE;
+}
+
+/*
+ * Reads the record with sequence number *tail into buf, which must hold at
+ * least TELEMETRY_RING_MAX_RECORD bytes. For use by consumers that mapped
+ * the ring read-only.
+ *
+ * Returns the record length and increments *tail on success, 0 if the
+ * record has not been written yet, or -EOVERFLOW if the record has already
+ * been overwritten, in which case *tail is moved to the oldest record that
+ * is still available.
+ */
+static inline int telemetry_ring_read(const struct telemetry_ring_header *ring,
+				      uint64_t *tail, void *buf)
+{
+	struct telemetry_ring_slot *slot = telemetry_ring_slot(ring, *tail);
+	uint64_t head;
+	uint64_t seq;
+	uint16_t len;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != *tail + 1) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head > *tail + ring->num_slots) {
+			*tail = head - ring->num_slots;
+			return -EOVERFLOW;
+		}
+		return 0;
+	}
+
+	len = slot->len;
+	if (len > TELEMETRY_RING_MAX_RECORD)
+		len = TELEMETRY_RING_MAX_RECORD;
+	memcpy(buf, slot->data, len);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		*tail = head > ring->num_slots ? head - ring->num_slots : 0;
+		return -EOVERFLOW;
+	}
+
+	(*tail)++;
+
+	return len;
+}
+
+int telemetry_ring_init(void);
+void telemetry_ring_write(const void *record, size_t len);
+int telemetry_ring_get_fd(void);
+void telemetry_ring_deinit(void);
+
+#endif /* __TELEMETRY_RING_H__ */
@@ -0,0 +1,471 @@
+/*
+ * Compact telemetry wire format
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "telemetry.h"
+#include "telemetry-wire.h"
+
+/*
+ * Resets the delta encoding state at the start of a datagram or ring slot.
+ */
+void telemetry_wire_reset(struct telemetry_wire_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+static inline uint64_t zigzag_encode(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		out[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+
+	return len;
+}
+
+static size_t put_svarint(uint8_t *out, int64_t value)
+{
+	return put_varint(out, zigzag_encode(value));
+}
+
+static size_t put_float(uint8_t *out, float value)
+{
+	uint32_t u;
+
+	memcpy(&u, &value, sizeof(u));
+	out[0] = u;
+	out[1] = u >> 8;
+	out[2] = u >> 16;
+	out[3] = u >> 24;
+
+	return 4;
+}
+
+static size_t put_vec3(uint8_t *out, const vec3 *v)
+{
+	put_float(out, v->x);
+	put_float(out + 4, v->y);
+	put_float(out + 8, v->z);
+
+	return 12;
+}
+
+static size_t put_header(uint8_t *out, uint8_t type, uint8_t dev_id)
+{
+	out[0] = type;
+	out[1] = dev_id;
+
+	return 2;
+}
+
+size_t telemetry_wire_encode_raw_buffer(struct telemetry_wire_context *ctx,
+					uint8_t *out, uint8_t dev_id,
+					const void *buf, size_t len)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_RAW_BUFFER, dev_id);
+
+	(void)ctx;
+
+	n += put_varint(out + n, len);
+	memcpy(out + n, buf, len);
+
+	return n + len;
+}
+
+/*
+ * Raw IMU sample timestamps are in device ticks. They are delta encoded only
+ * against the previous raw sample of the same device.
+ */
+size_t telemetry_wire_encode_raw_imu_sample(struct telemetry_wire_context *ctx,
+					    uint8_t *out, uint8_t dev_id,
+					    const struct raw_imu_sample *raw)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_RAW_IMU_SAMPLE, dev_id);
+	uint64_t prev = 0;
+	int i;
+
+	if (ctx->have_device_time && ctx->device_dev_id == dev_id)
+		prev = ctx->device_time;
+	n += put_svarint(out + n, (int64_t)(raw->time - prev));
+	ctx->have_device_time = true;
+	ctx->device_dev_id = dev_id;
+	ctx->device_time = raw->time;
+
+	for (i = 0; i < 3; i++)
+		n += put_svarint(out + n, raw->acc[i]);
+	for (i = 0; i < 3; i++)
+		n += put_svarint(out + n, raw->gyro[i]);
+
+	return n;
+}
+
+#define IMU_SAMPLE_MAGNETIC_FIELD	0x01
+#define IMU_SAMPLE_TEMPERATURE		0x02
+
+/*
+ * IMU sample timestamps are host CLOCK_MONOTONIC, sent as ns delta. The
+ * magnetic field and temperature are only sent if the device provides them.
+ */
+size_t telemetry_wire_encode_imu_sample(struct telemetry_wire_context *ctx,
+					uint8_t *out, uint8_t dev_id,
+					const struct imu_sample *sample)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_IMU_SAMPLE, dev_id);
+	uint64_t time = llround(sample->time * 1e9);
+	uint8_t flags = 0;
+
+	if (sample->magnetic_field.x != 0.0f ||
+	    sample->magnetic_field.y != 0.0f ||
+	    sample->magnetic_field.z != 0.0f)
+		flags |= IMU_SAMPLE_MAGNETIC_FIELD;
+	if (sample->temperature != 0.0f)
+		flags |= IMU_SAMPLE_TEMPERATURE;
+
+	out[n++] = flags;
+	n += put_svarint(out + n, (int64_t)(time - ctx->host_time));
+	ctx->host_time = time;
+
+	n += put_vec3(out + n, &sample->acceleration);
+	n += put_vec3(out + n, &sample->angular_velocity);
+	if (flags & IMU_SAMPLE_MAGNETIC_FIELD)
+		n += put_vec3(out + n, &sample->magnetic_field);
+	if (flags & IMU_SAMPLE_TEMPERATURE)
+		n += put_float(out + n, sample->temperature);
+
+	return n;
+}
+
+size_t telemetry_wire_encode_pose(struct telemetry_wire_context *ctx,
+				  uint8_t *out, uint8_t dev_id,
+				  const struct dpose *pose)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_POSE, dev_id);
+
+	(void)ctx;
+
+	n += put_float(out + n, pose->rotation.x);
+	n += put_float(out + n, pose->rotation.y);
+	n += put_float(out + n, pose->rotation.z);
+	n += put_float(out + n, pose->rotation.w);
+	n += put_float(out + n, pose->translation.x);
+	n += put_float(out + n, pose->translation.y);
+	n += put_float(out + n, pose->translation.z);
+
+	return n;
+}
+
+/*
+ * Lighthouse frames carry sweep offset and duration only for the sensors
+ * set in sweep_ids, in ascending sensor order.
+ */
+size_t telemetry_wire_encode_lighthouse_frame(struct telemetry_wire_context *ctx,
+					      uint8_t *out, uint8_t dev_id,
+					      const struct lighthouse_frame *frame)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_LIGHTHOUSE_FRAME, dev_id);
+	uint32_t prev = 0;
+	int i;
+
+	if (ctx->have_lighthouse_time && ctx->lighthouse_dev_id == dev_id)
+		prev = ctx->lighthouse_time;
+	n += put_svarint(out + n, (int32_t)(frame->sync_timestamp - prev));
+	ctx->have_lighthouse_time = true;
+	ctx->lighthouse_dev_id = dev_id;
+	ctx->lighthouse_time = frame->sync_timestamp;
+
+	n += put_varint(out + n, frame->sync_duration);
+	n += put_varint(out + n, frame->sync_ids);
+	n += put_varint(out + n, frame->frame_duration);
+	n += put_varint(out + n, frame->sweep_ids);
+	for (i = 0; i < 32; i++) {
+		if (!(frame->sweep_ids & (1U << i)))
+			continue;
+		n += put_varint(out + n, frame->sweep_offset[i]);
+		n += put_varint(out + n, frame->sweep_duration[i]);
+	}
+
+	return n;
+}
+
+size_t telemetry_wire_encode_buttons(struct telemetry_wire_context *ctx,
+				     uint8_t *out, uint8_t dev_id,
+				     const uint8_t *buttons, int num_buttons)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_BUTTONS, dev_id);
+
+	(void)ctx;
+
+	n += put_varint(out + n, num_buttons);
+	memcpy(out + n, buttons, num_buttons);
+
+	return n + num_buttons;
+}
+
+size_t telemetry_wire_encode_axis(struct telemetry_wire_context *ctx,
+				  uint8_t *out, uint8_t dev_id, int index,
+				  const float *axis, int num_axis)
+{
+	size_t n = put_header(out, TELEMETRY_PACKET_AXIS, dev_id);
+	int i;
+
+	(void)ctx;
+
+	out[n++] = index;
+	n += put_varint(out + n, num_axis);
+	for (i = 0; i < num_axis; i++)
+		n += put_float(out + n, axis[i]);
+
+	return n;
+}
+
+/*
+ * Bounds checked reader for the decoder.
+ */
+struct wire_reader {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+	bool error;
+};
+
+static uint8_t get_u8(struct wire_reader *r)
+{
+	if (r->pos >= r->len) {
+		r->error = true;
+		return 0;
+	}
+
+	return r->buf[r->pos++];
+}
+
+static uint64_t get_varint(struct wire_reader *r)
+{
+	uint64_t value = 0;
+	unsigned int shift;
+	uint8_t byte;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		byte = get_u8(r);
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return value;
+	}
+
+	r->error = true;
+	return 0;
+}
+
+static int64_t get_svarint(struct wire_reader *r)
+{
+	return zigzag_decode(get_varint(r));
+}
+
+static float get_float(struct wire_reader *r)
+{
+	uint32_t u;
+	float value;
+
+	u = get_u8(r);
+	u |= get_u8(r) << 8;
+	u |= get_u8(r) << 16;
+	u |= (uint32_t)get_u8(r) << 24;
+	memcpy(&value, &u, sizeof(value));
+
+	return value;
+}
+
+static void get_vec3(struct wire_reader *r, vec3 *v)
+{
+	v->x = get_float(r);
+	v->y = get_float(r);
+	v->z = get_float(r);
+}
+
+static void get_bytes(struct wire_reader *r, uint8_t *out, size_t len)
+{
+	if (len > r->len - r->pos) {
+		r->error = true;
+		return;
+	}
+
+	memcpy(out, r->buf + r->pos, len);
+	r->pos += len;
+}
+
+/*
+ * Decodes a single record from buf into record, updating the delta decoding
+ * state in ctx.
+ *
+ * Returns the number of bytes consumed, or -EINVAL if the record is
+ * truncated or malformed.
+ */
+int telemetry_wire_decode(struct telemetry_wire_context *ctx,
+			  const uint8_t *buf, size_t len,
+			  struct telemetry_record *record)
+{
+	struct wire_reader r = { .buf = buf, .len = len };
+	struct lighthouse_frame *frame;
+	struct imu_sample *sample;
+	struct dpose *pose;
+	uint64_t count;
+	uint32_t prev;
+	uint8_t flags;
+	int i;
+
+	memset(record, 0, sizeof(*record));
+	record->type = get_u8(&r);
+	record->dev_id = get_u8(&r);
+	if (r.error)
+		return -EINVAL;
+
+	switch (record->type) {
+	case TELEMETRY_PACKET_RAW_BUFFER:
+		count = get_varint(&r);
+		if (count > sizeof(record->raw_buffer.data))
+			return -EINVAL;
+		record->raw_buffer.len = count;
+		get_bytes(&r, record->raw_buffer.data, count);
+		break;
+	case TELEMETRY_PACKET_RAW_IMU_SAMPLE:
+		record->raw_imu_sample.time = get_svarint(&r);
+		if (ctx->have_device_time && ctx->device_dev_id == record->dev_id)
+			record->raw_imu_sample.time += ctx->device_time;
+		ctx->have_device_time = true;
+		ctx->device_dev_id = record->dev_id;
+		ctx->device_time = record->raw_imu_sample.time;
+		for (i = 0; i < 3; i++)
+			record->raw_imu_sample.acc[i] = get_svarint(&r);
+		for (i = 0; i < 3; i++)
+			record->raw_imu_sample.gyro[i] = get_svarint(&r);
+		break;
+	case TELEMETRY_PACKET_IMU_SAMPLE:
+		sample = &record->imu_sample;
+		flags = get_u8(&r);
+		ctx->host_time += get_svarint(&r);
+		sample->time = ctx->host_time * 1e-9;
+		get_vec3(&r, &sample->acceleration);
+		get_vec3(&r, &sample->angular_velocity);
+		if (flags & IMU_SAMPLE_MAGNETIC_FIELD)
+			get_vec3(&r, &sample->magnetic_field);
+		if (flags & IMU_SAMPLE_TEMPERATURE)
+			sample->temperature = get_float(&r);
+		break;
+	case TELEMETRY_PACKET_POSE:
+		pose = &record->pose;
+		pose->rotation.x = get_float(&r);
+		pose->rotation.y = get_float(&r);
+		pose->rotation.z = get_float(&r);
+		pose->rotation.w = get_float(&r);
+		pose->translation.x = get_float(&r);
+		pose->translation.y = get_float(&r);
+		pose->translation.z = get_float(&r);
+		break;
+	case TELEMETRY_PACKET_LIGHTHOUSE_FRAME:
+		frame = &record->lighthouse_frame;
+		prev = 0;
+		if (ctx->have_lighthouse_time &&
+		    ctx->lighthouse_dev_id == record->dev_id)
+			prev = ctx->lighthouse_time;
+		frame->sync_timestamp = prev + (uint32_t)get_svarint(&r);
+		ctx->have_lighthouse_time = true;
+		ctx->lighthouse_dev_id = record->dev_id;
+		ctx->lighthouse_time = frame->sync_timestamp;
+		frame->sync_duration = get_varint(&r);
+		frame->sync_ids = get_varint(&r);
+		frame->frame_duration = get_varint(&r);
+		frame->sweep_ids = get_varint(&r);
+		for (i = 0; i < 32; i++) {
+			if (!(frame->sweep_ids & (1U << i)))
+				continue;
+			frame->sweep_offset[i] = get_varint(&r);
+			frame->sweep_duration[i] = get_varint(&r);
+		}
+		break;
+	case TELEMETRY_PACKET_BUTTONS:
+		count = get_varint(&r);
+		if (count > sizeof(record->buttons.buttons))
+			return -EINVAL;
+		record->buttons.num = count;
+		get_bytes(&r, record->buttons.buttons, count);
+		break;
+	case TELEMETRY_PACKET_AXIS:
+		record->axis.index = get_u8(&r);
+		count = get_varint(&r);
+		if (count > TELEMETRY_WIRE_MAX_AXIS)
+			return -EINVAL;
+		record->axis.num = count;
+		for (i = 0; i < record->axis.num; i++)
+			record->axis.axis[i] = get_float(&r);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (r.error)
+		return -EINVAL;
+
+	return r.pos;
+}
+
+/*
+ * Decodes a TELEMETRY_PACKET_BATCH datagram and calls callback for each
+ * contained record.
+ *
+ * Returns the number of decoded records, -EPROTO if the datagram has an
+ * unsupported version, or -EINVAL if it is malformed.
+ */
+int telemetry_wire_decode_datagram(const uint8_t *buf, size_t len,
+				   telemetry_record_cb callback, void *data)
+{
+	struct telemetry_wire_context ctx;
+	struct telemetry_record record;
+	unsigned int count, i;
+	size_t pos = 3;
+	size_t size;
+	int ret;
+
+	if (len < 3 || buf[0] != TELEMETRY_PACKET_BATCH)
+		return -EINVAL;
+	if (buf[1] != TELEMETRY_WIRE_VERSION)
+		return -EPROTO;
+
+	count = buf[2];
+	telemetry_wire_reset(&ctx);
+
+	for (i = 0; i < count; i++) {
+		if (len - pos < 2)
+			return -EINVAL;
+		size = buf[pos] | (buf[pos + 1] << 8);
+		pos += 2;
+		if (size > len - pos)
+			return -EINVAL;
+
+		ret = telemetry_wire_decode(&ctx, buf + pos, size, &record);
+		if (ret < 0)
+			return ret;
+		pos += size;
+
+		if (callback)
+			callback(data, &record);
+	}
+
+	return count;
+}
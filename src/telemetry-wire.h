@@ -0,0 +1,113 @@
+/*
+ * Compact telemetry wire format
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __TELEMETRY_WIRE_H__
+#define __TELEMETRY_WIRE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "lighthouse.h"
+
+#define TELEMETRY_WIRE_VERSION		1
+
+/* Upper bound for the size of a single encoded record */
+#define TELEMETRY_WIRE_MAX_RECORD	320
+#define TELEMETRY_WIRE_MAX_RAW_BUFFER	256
+#define TELEMETRY_WIRE_MAX_BUTTONS	256
+#define TELEMETRY_WIRE_MAX_AXIS		16
+/*
+ * Maximum number of bytes by which a delta encoded record can be larger than
+ * the same record encoded with a freshly reset context.
+ */
+#define TELEMETRY_WIRE_MAX_DELTA	10
+
+/*
+ * Records start with the TELEMETRY_PACKET_* type and the device id byte,
+ * followed by the type specific payload. All multi-byte fields are little
+ * endian. Integers are LEB128 varints, signed values are zigzag encoded.
+ * Floating point values are IEEE 754 single precision.
+ *
+ * Timestamps are encoded as difference to the previous timestamp of the
+ * same kind in the same encoding context. A context covers one datagram
+ * or one shared memory ring slot, so every datagram can be decoded on its
+ * own. The first timestamp in a context is relative to zero.
+ */
+struct telemetry_wire_context {
+	/* Host CLOCK_MONOTONIC time of the last IMU sample, in ns */
+	uint64_t host_time;
+	/* Device timestamp of the last raw IMU sample */
+	bool have_device_time;
+	uint8_t device_dev_id;
+	uint64_t device_time;
+	/* Sync pulse timestamp of the last Lighthouse frame */
+	bool have_lighthouse_time;
+	uint8_t lighthouse_dev_id;
+	uint32_t lighthouse_time;
+};
+
+/*
+ * A decoded telemetry record.
+ */
+struct telemetry_record {
+	uint8_t type;
+	uint8_t dev_id;
+	union {
+		struct {
+			uint8_t data[TELEMETRY_WIRE_MAX_RAW_BUFFER];
+			size_t len;
+		} raw_buffer;
+		struct raw_imu_sample raw_imu_sample;
+		struct imu_sample imu_sample;
+		struct dpose pose;
+		struct lighthouse_frame lighthouse_frame;
+		struct {
+			uint8_t buttons[TELEMETRY_WIRE_MAX_BUTTONS];
+			int num;
+		} buttons;
+		struct {
+			int index;
+			float axis[TELEMETRY_WIRE_MAX_AXIS];
+			int num;
+		} axis;
+	};
+};
+
+typedef void (*telemetry_record_cb)(void *data,
+				    const struct telemetry_record *record);
+
+void telemetry_wire_reset(struct telemetry_wire_context *ctx);
+
+size_t telemetry_wire_encode_raw_buffer(struct telemetry_wire_context *ctx,
+					uint8_t *out, uint8_t dev_id,
+					const void *buf, size_t len);
+size_t telemetry_wire_encode_raw_imu_sample(struct telemetry_wire_context *ctx,
+					    uint8_t *out, uint8_t dev_id,
+					    const struct raw_imu_sample *raw);
+size_t telemetry_wire_encode_imu_sample(struct telemetry_wire_context *ctx,
+					uint8_t *out, uint8_t dev_id,
+					const struct imu_sample *sample);
+size_t telemetry_wire_encode_pose(struct telemetry_wire_context *ctx,
+				  uint8_t *out, uint8_t dev_id,
+				  const struct dpose *pose);
+size_t telemetry_wire_encode_lighthouse_frame(struct telemetry_wire_context *ctx,
+					      uint8_t *out, uint8_t dev_id,
+					      const struct lighthouse_frame *frame);
+size_t telemetry_wire_encode_buttons(struct telemetry_wire_context *ctx,
+				     uint8_t *out, uint8_t dev_id,
+				     const uint8_t *buttons, int num_buttons);
+size_t telemetry_wire_encode_axis(struct telemetry_wire_context *ctx,
+				  uint8_t *out, uint8_t dev_id, int index,
+				  const float *axis, int num_axis);
+
+int telemetry_wire_decode(struct telemetry_wire_context *ctx,
+			  const uint8_t *buf, size_t len,
+			  struct telemetry_record *record);
+int telemetry_wire_decode_datagram(const uint8_t *buf, size_t len,
+				   telemetry_record_cb callback, void *data);
+
+#endif /* __TELEMETRY_WIRE_H__ */
@@ -3,149 +3,693 @@
  * Copyright 2017 Philipp Zabel
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
+#define _GNU_SOURCE
 #include <errno.h>
+#include <glib.h>
+#include <stdbool.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "imu.h"
+#include "latency.h"
 #include "lighthouse.h"
 #include "telemetry.h"
+#include "telemetry-ring.h"
+#include "telemetry-wire.h"
+#include "trace.h"
 
 #define TELEMETRY_ADDRESS			INADDR_LOOPBACK
 
+/* Keep batch datagrams below the Ethernet MTU for remote consumers */
+#define TELEMETRY_MAX_DATAGRAM_SIZE		1472
+#define TELEMETRY_MAX_DATAGRAMS			16
+#define TELEMETRY_FLUSH_DEADLINE_NS		2000000
+
+#define TELEMETRY_NUM_DEVICES			256
+#define TELEMETRY_NOT_SUBSCRIBED		UINT64_MAX
+
+/*
+ * Per-thread buffer that coalesces telemetry records into batch datagrams,
+ * which are sent with a single sendmmsg() call when the buffer is full or
+ * the oldest record has been waiting for longer than the flush deadline.
+ * The lock is only contended if the flusher thread sends the datagrams of
+ * a thread that stopped producing records before the deadline.
+ */
+struct telemetry_buffer {
+	GMutex lock;
+	unsigned char data[TELEMETRY_MAX_DATAGRAMS]
+			  [TELEMETRY_MAX_DATAGRAM_SIZE];
+	struct iovec iov[TELEMETRY_MAX_DATAGRAMS];
+	struct mmsghdr msg[TELEMETRY_MAX_DATAGRAMS];
+	unsigned int num_datagrams;
+	uint64_t deadline;
+	bool wake_flusher;
+	struct telemetry_wire_context ctx;
+};
+
+static void telemetry_buffer_free(gpointer data);
+
 static struct sockaddr_in telemetry_addr;
 static int telemetry_fd;
+static GPrivate telemetry_buffer_key = G_PRIVATE_INIT(telemetry_buffer_free);
+
+/*
+ * The flusher thread sends the queued datagrams of all buffers whose flush
+ * deadline has passed. It sleeps until the earliest pending deadline, or
+ * until woken by a thread queueing into an empty buffer while it is idle.
+ * The flusher mutex must be taken before any buffer lock.
+ */
+static GMutex telemetry_flusher_mutex;
+static GCond telemetry_flusher_cond;
+static GList *telemetry_buffers;
+static GThread *telemetry_flusher;
+static bool telemetry_flusher_stop;
+static gint telemetry_flusher_idle;
+
+/*
+ * A consumer's request for the records of one or all devices, of the packet
+ * types in the types bit mask, at most once per interval ns.
+ */
+struct telemetry_subscription {
+	unsigned int id;
+	int dev_id;
+	uint32_t types;
+	uint64_t interval;
+};
+
+/* Subscriptions are only changed from the main loop */
+static GList *telemetry_subscriptions;
+static unsigned int telemetry_next_subscription_id = 1;
+
+/*
+ * The minimum requested interval per device and packet type, derived from
+ * the subscriptions, and the time each record was last produced. Read and
+ * written atomically by the device threads.
+ */
+static int telemetry_filter;
+static uint64_t telemetry_interval[TELEMETRY_NUM_DEVICES]
+				  [TELEMETRY_NUM_PACKET_TYPES];
+static uint64_t telemetry_last[TELEMETRY_NUM_DEVICES]
+			      [TELEMETRY_NUM_PACKET_TYPES];
+
+#define TELEMETRY_SINK_RING			(1 << 0)
+#define TELEMETRY_SINK_UDP			(1 << 1)
+
+/* Whether the subscriptions apply to the UDP stream as well */
+static bool telemetry_filter_udp;
+
+static uint64_t telemetry_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Sends all batch datagrams queued by the calling thread.
+ */
+static int telemetry_buffer_flush(struct telemetry_buffer *buf)
+{
+	unsigned int i;
+	int ret;
+
+	if (!buf->num_datagrams)
+		return 0;
+
+	for (i = 0; i < buf->num_datagrams; i++) {
+		buf->msg[i].msg_hdr.msg_name = &telemetry_addr;
+		buf->msg[i].msg_hdr.msg_namelen = sizeof(telemetry_addr);
+		buf->msg[i].msg_hdr.msg_iov = &buf->iov[i];
+		buf->msg[i].msg_hdr.msg_iovlen = 1;
+		buf->iov[i].iov_base = buf->data[i];
+	}
+
+	ret = sendmmsg(telemetry_fd, buf->msg, buf->num_datagrams, 0);
+	buf->num_datagrams = 0;
+
+	return ret;
+}
+
+/*
+ * Flushes and frees the calling thread's buffer on thread exit.
+ */
+static void telemetry_buffer_free(gpointer data)
+{
+	struct telemetry_buffer *buf = data;
+
+	g_mutex_lock(&telemetry_flusher_mutex);
+	telemetry_buffers = g_list_remove(telemetry_buffers, buf);
+	g_mutex_unlock(&telemetry_flusher_mutex);
+
+	if (telemetry_fd > 0)
+		telemetry_buffer_flush(buf);
+	g_mutex_clear(&buf->lock);
+	g_free(buf);
+}
+
+static void telemetry_wake_flusher(void)
+{
+	g_mutex_lock(&telemetry_flusher_mutex);
+	g_cond_signal(&telemetry_flusher_cond);
+	g_mutex_unlock(&telemetry_flusher_mutex);
+}
+
+/*
+ * Sends the datagrams of buffers whose flush deadline has passed, so that
+ * records of threads that went quiet are not held back indefinitely.
+ */
+static gpointer telemetry_flusher_thread(gpointer data)
+{
+	struct telemetry_buffer *buf;
+	uint64_t now, next;
+	GList *link;
+
+	(void)data;
+
+	g_mutex_lock(&telemetry_flusher_mutex);
+	while (!telemetry_flusher_stop) {
+		/* Set before scanning, so no newly filled buffer is missed */
+		g_atomic_int_set(&telemetry_flusher_idle, 1);
+
+		now = telemetry_now();
+		next = UINT64_MAX;
+		for (link = telemetry_buffers; link; link = link->next) {
+			buf = link->data;
+			g_mutex_lock(&buf->lock);
+			if (buf->num_datagrams) {
+				if (buf->deadline <= now)
+					telemetry_buffer_flush(buf);
+				else if (buf->deadline < next)
+					next = buf->deadline;
+			}
+			g_mutex_unlock(&buf->lock);
+		}
+
+		if (next == UINT64_MAX) {
+			g_cond_wait(&telemetry_flusher_cond,
+				    &telemetry_flusher_mutex);
+		} else {
+			g_atomic_int_set(&telemetry_flusher_idle, 0);
+			g_cond_wait_until(&telemetry_flusher_cond,
+					  &telemetry_flusher_mutex,
+					  g_get_monotonic_time() +
+					  (next - now + 999) / 1000);
+		}
+	}
+	g_mutex_unlock(&telemetry_flusher_mutex);
+
+	return NULL;
+}
+
+/*
+ * Returns space for a record of at most max_len bytes in the current batch
+ * datagram of the calling thread, starting a new datagram if necessary, and
+ * the delta encoding context of that datagram.
+ */
+static uint8_t *telemetry_reserve(size_t max_len,
+				  struct telemetry_wire_context **ctx)
+{
+	struct telemetry_buffer *buf;
+	unsigned char *datagram;
+	size_t *size;
+
+	buf = g_private_get(&telemetry_buffer_key);
+	if (!buf) {
+		buf = g_new0(struct telemetry_buffer, 1);
+		g_mutex_init(&buf->lock);
+		g_private_set(&telemetry_buffer_key, buf);
+
+		g_mutex_lock(&telemetry_flusher_mutex);
+		telemetry_buffers = g_list_prepend(telemetry_buffers, buf);
+		g_mutex_unlock(&telemetry_flusher_mutex);
+	}
+
+	/* Held until telemetry_commit() */
+	g_mutex_lock(&buf->lock);
+
+	if (buf->num_datagrams) {
+		size = &buf->iov[buf->num_datagrams - 1].iov_len;
+		if (*size + 2 + max_len > TELEMETRY_MAX_DATAGRAM_SIZE ||
+		    buf->data[buf->num_datagrams - 1][2] == UINT8_MAX) {
+			if (buf->num_datagrams == TELEMETRY_MAX_DATAGRAMS)
+				telemetry_buffer_flush(buf);
+			size = NULL;
+		}
+	} else {
+		size = NULL;
+	}
+
+	if (!size) {
+		if (!buf->num_datagrams) {
+			buf->deadline = telemetry_now() +
+					TELEMETRY_FLUSH_DEADLINE_NS;
+			buf->wake_flusher =
+				g_atomic_int_get(&telemetry_flusher_idle);
+		}
+		datagram = buf->data[buf->num_datagrams];
+		datagram[0] = TELEMETRY_PACKET_BATCH;
+		datagram[1] = TELEMETRY_WIRE_VERSION;
+		datagram[2] = 0;
+		size = &buf->iov[buf->num_datagrams].iov_len;
+		*size = 3;
+		telemetry_wire_reset(&buf->ctx);
+		buf->num_datagrams++;
+	}
+
+	*ctx = &buf->ctx;
+
+	return buf->data[buf->num_datagrams - 1] + *size + 2;
+}
+
+/*
+ * Completes the record of len bytes written into the space returned by
+ * telemetry_reserve(), and sends the queued datagrams if the flush deadline
+ * has passed. Otherwise the flusher thread sends them once it passes. The
+ * time spent since start is accounted to the device.
+ */
+static int telemetry_commit(uint8_t dev_id, size_t len, uint64_t start)
+{
+	struct telemetry_buffer *buf = g_private_get(&telemetry_buffer_key);
+	unsigned char *datagram = buf->data[buf->num_datagrams - 1];
+	size_t *size = &buf->iov[buf->num_datagrams - 1].iov_len;
+	uint64_t now;
+	bool wake;
+
+	datagram[*size] = len & 0xff;
+	datagram[*size + 1] = len >> 8;
+	*size += 2 + len;
+	datagram[2]++;
+
+	now = telemetry_now();
+	if (now >= buf->deadline) {
+		telemetry_buffer_flush(buf);
+		now = telemetry_now();
+	}
+
+	wake = buf->wake_flusher;
+	buf->wake_flusher = false;
+	g_mutex_unlock(&buf->lock);
+
+	if (wake)
+		telemetry_wake_flusher();
+
+	OUVRT_TRACE(telemetry_send, dev_id, len, start, now);
+	latency_record(dev_id, LATENCY_TELEMETRY_SEND, now - start);
+
+	return len;
+}
+
+/*
+ * Sends all telemetry records queued by the calling thread immediately.
+ */
+void telemetry_flush(void)
+{
+	struct telemetry_buffer *buf;
+
+	if (telemetry_fd <= 0)
+		return;
+
+	buf = g_private_get(&telemetry_buffer_key);
+	if (buf) {
+		g_mutex_lock(&buf->lock);
+		telemetry_buffer_flush(buf);
+		g_mutex_unlock(&buf->lock);
+	}
+}
+
+/*
+ * Recalculates the per device and packet type intervals after the list of
+ * subscriptions changed.
+ */
+static void telemetry_update_intervals(void)
+{
+	struct telemetry_subscription *sub;
+	uint64_t interval;
+	GList *link;
+	int dev_id, type;
+
+	for (dev_id = 0; dev_id < TELEMETRY_NUM_DEVICES; dev_id++) {
+		for (type = 0; type < TELEMETRY_NUM_PACKET_TYPES; type++) {
+			interval = TELEMETRY_NOT_SUBSCRIBED;
+			for (link = telemetry_subscriptions; link;
+			     link = link->next) {
+				sub = link->data;
+				if (sub->dev_id != TELEMETRY_ALL_DEVICES &&
+				    sub->dev_id != dev_id)
+					continue;
+				if (!(sub->types & (1U << type)))
+					continue;
+				if (sub->interval < interval)
+					interval = sub->interval;
+			}
+			__atomic_store_n(&telemetry_interval[dev_id][type],
+					 interval, __ATOMIC_RELAXED);
+		}
+	}
+
+	g_atomic_int_set(&telemetry_filter, telemetry_subscriptions != NULL);
+}
+
+/*
+ * Applies the subscriptions to the UDP stream as well, so that records no
+ * consumer subscribed to are not encoded at all. Must be called before any
+ * records are sent.
+ */
+void telemetry_set_filter_udp(bool enable)
+{
+	telemetry_filter_udp = enable;
+}
+
+/*
+ * Subscribes to records of the packet types in the types bit mask, of the
+ * given device or of all devices, at the given rate in Hz. A rate of 0
+ * requests all records. Returns the subscription id.
+ */
+unsigned int telemetry_subscribe(int dev_id, uint32_t types, double rate)
+{
+	struct telemetry_subscription *sub;
+
+	sub = g_new0(struct telemetry_subscription, 1);
+	sub->id = telemetry_next_subscription_id++;
+	sub->dev_id = dev_id;
+	sub->types = types ? types : (1U << TELEMETRY_NUM_PACKET_TYPES) - 1;
+	sub->interval = rate > 0 ? 1e9 / rate : 0;
+
+	telemetry_subscriptions = g_list_append(telemetry_subscriptions, sub);
+	telemetry_update_intervals();
+
+	return sub->id;
+}
+
+/*
+ * Removes the subscription with the given id.
+ */
+void telemetry_unsubscribe(unsigned int id)
+{
+	struct telemetry_subscription *sub;
+	GList *link;
+
+	for (link = telemetry_subscriptions; link; link = link->next) {
+		sub = link->data;
+		if (sub->id == id)
+			break;
+	}
+	if (!link)
+		return;
+
+	telemetry_subscriptions = g_list_delete_link(telemetry_subscriptions,
+						     link);
+	g_free(sub);
+	telemetry_update_intervals();
+}
+
+/*
+ * Decides whether a record of the given type should be produced for the
+ * given device, before any time is spent encoding it. Without subscriptions
+ * every record is produced. Decimated streams are kept on a fixed grid, so
+ * that the produced rate does not drop below the requested rate due to
+ * jitter of the source.
+ */
+static bool telemetry_wanted(uint8_t dev_id, int type)
+{
+	uint64_t interval, last, now;
+
+	if (!g_atomic_int_get(&telemetry_filter))
+		return true;
+
+	interval = __atomic_load_n(&telemetry_interval[dev_id][type],
+				   __ATOMIC_RELAXED);
+	if (interval == TELEMETRY_NOT_SUBSCRIBED)
+		return false;
+	if (!interval)
+		return true;
+
+	now = telemetry_now();
+	last = __atomic_load_n(&telemetry_last[dev_id][type], __ATOMIC_RELAXED);
+	if (now - last < interval)
+		return false;
 
+	last = (now - last < 2 * interval) ? last + interval : now;
+	__atomic_store_n(&telemetry_last[dev_id][type], last, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/*
+ * Returns the sinks a record of the given type should be written to. The
+ * subscriptions only apply to the shared memory ring, as UDP listeners,
+ * possibly remote, can not subscribe. The UDP stream carries all records
+ * at full rate, unless it was set to be filtered as well.
+ */
+static int telemetry_sinks(uint8_t dev_id, int type)
+{
+	if (telemetry_wanted(dev_id, type))
+		return TELEMETRY_SINK_RING | TELEMETRY_SINK_UDP;
+
+	return telemetry_filter_udp ? 0 : TELEMETRY_SINK_UDP;
+}
+
+/*
+ * Each sender encodes the record twice: once with a fresh context into the
+ * shared memory ring, where every slot must be decodable on its own, and
+ * once delta encoded against the previous records in the batch datagram.
+ */
 int telemetry_send_raw_buffer(uint8_t dev_id, const char *buf, size_t len)
 {
-	char packet[256];
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t size;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	if (len > sizeof(buf) - 2)
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_RAW_BUFFER);
+	if (!sinks)
+		return 0;
+
+	if (len > TELEMETRY_WIRE_MAX_RAW_BUFFER)
 		return -ENOSPC;
 
-	packet[0] = TELEMETRY_PACKET_RAW_BUFFER;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buf, len);
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	size = telemetry_wire_encode_raw_buffer(&ctx, record, dev_id, buf, len);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, size);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return size;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	out = telemetry_reserve(size + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	size = telemetry_wire_encode_raw_buffer(batch_ctx, out, dev_id, buf,
+						len);
+
+	return telemetry_commit(dev_id, size, start);
 }
 
 int telemetry_send_raw_imu_sample(uint8_t dev_id, struct raw_imu_sample *raw)
 {
-	char packet[2 + sizeof(*raw)];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_RAW_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, raw, sizeof(*raw));
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_RAW_IMU_SAMPLE);
+	if (!sinks)
+		return 0;
+
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_raw_imu_sample(&ctx, record, dev_id, raw);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
+
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_raw_imu_sample(batch_ctx, out, dev_id, raw);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_commit(dev_id, len, start);
 }
 
 int telemetry_send_imu_sample(uint8_t dev_id, struct imu_sample *sample)
 {
-	char packet[2 + sizeof(*sample)];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_IMU_SAMPLE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, sample, sizeof(*sample));
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_IMU_SAMPLE);
+	if (!sinks)
+		return 0;
+
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_imu_sample(&ctx, record, dev_id, sample);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
+
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_imu_sample(batch_ctx, out, dev_id, sample);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_commit(dev_id, len, start);
 }
 
 int telemetry_send_lighthouse_frame(uint8_t dev_id,
 				    struct lighthouse_frame *frame)
 {
-	char packet[2 + sizeof(*frame)];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_LIGHTHOUSE_FRAME;
-	packet[1] = dev_id;
-	memcpy(packet + 2, frame, sizeof(*frame));
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_LIGHTHOUSE_FRAME);
+	if (!sinks)
+		return 0;
+
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_lighthouse_frame(&ctx, record, dev_id,
+						     frame);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
+
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_lighthouse_frame(batch_ctx, out, dev_id,
+						     frame);
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	return telemetry_commit(dev_id, len, start);
 }
 
 int telemetry_send_pose(uint8_t dev_id, struct dpose *pose)
 {
-	char packet[2 + sizeof(*pose)];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_POSE;
-	packet[1] = dev_id;
-	memcpy(packet + 2, pose, sizeof(*pose));
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_POSE);
+	if (!sinks)
+		return 0;
+
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_pose(&ctx, record, dev_id, pose);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_pose(batch_ctx, out, dev_id, pose);
+
+	return telemetry_commit(dev_id, len, start);
 }
 
 int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis)
 {
-	char packet[2 + 1 + num_axis * sizeof(float)];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_AXIS);
+	if (!sinks)
+		return 0;
+
 	if (num_axis == 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_AXIS;
-	packet[1] = dev_id;
-	packet[2] = index;
-	memcpy(packet + 3, axis, num_axis * sizeof(float));
+	if (num_axis > TELEMETRY_WIRE_MAX_AXIS)
+		return -ENOSPC;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
-}
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_axis(&ctx, record, dev_id, index, axis,
+					 num_axis);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
 
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_axis(batch_ctx, out, dev_id, index, axis,
+					 num_axis);
+
+	return telemetry_commit(dev_id, len, start);
+}
 
 int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons)
 {
-	char packet[2 + num_buttons];
-	const size_t len = sizeof(packet);
+	struct telemetry_wire_context ctx, *batch_ctx;
+	uint8_t record[TELEMETRY_WIRE_MAX_RECORD];
+	uint8_t *out;
+	size_t len;
+	uint64_t start;
+	int sinks;
 
 	if (telemetry_fd <= 0)
 		return 0;
 
+	sinks = telemetry_sinks(dev_id, TELEMETRY_PACKET_BUTTONS);
+	if (!sinks)
+		return 0;
+
 	if (num_buttons == 0)
 		return 0;
 
-	packet[0] = TELEMETRY_PACKET_BUTTONS;
-	packet[1] = dev_id;
-	memcpy(packet + 2, buttons, num_buttons);
+	if (num_buttons > TELEMETRY_WIRE_MAX_BUTTONS)
+		return -ENOSPC;
 
-	return sendto(telemetry_fd, packet, len, 0,
-		      (struct sockaddr *)&telemetry_addr,
-		      sizeof(telemetry_addr));
+	start = telemetry_now();
+	telemetry_wire_reset(&ctx);
+	len = telemetry_wire_encode_buttons(&ctx, record, dev_id, buttons,
+					    num_buttons);
+	if (sinks & TELEMETRY_SINK_RING)
+		telemetry_ring_write(record, len);
+	if (!(sinks & TELEMETRY_SINK_UDP))
+		return len;
+
+	out = telemetry_reserve(len + TELEMETRY_WIRE_MAX_DELTA, &batch_ctx);
+	len = telemetry_wire_encode_buttons(batch_ctx, out, dev_id, buttons,
+					    num_buttons);
+
+	return telemetry_commit(dev_id, len, start);
 }
 
 /*
@@ -182,6 +726,14 @@ int telemetry_init(int *argc, char **argv[])
 
 	telemetry_fd = fd;
 
+	telemetry_flusher_stop = false;
+	telemetry_flusher = g_thread_new("telemetry-flush",
+					 telemetry_flusher_thread, NULL);
+
+	ret = telemetry_ring_init();
+	if (ret < 0)
+		g_print("Telemetry: Shared memory ring disabled\n");
+
 	return 0;
 }
 
@@ -191,7 +743,16 @@ int telemetry_init(int *argc, char **argv[])
 void telemetry_deinit()
 {
 	if (telemetry_fd > 0) {
+		g_mutex_lock(&telemetry_flusher_mutex);
+		telemetry_flusher_stop = true;
+		g_cond_signal(&telemetry_flusher_cond);
+		g_mutex_unlock(&telemetry_flusher_mutex);
+		g_thread_join(telemetry_flusher);
+		telemetry_flusher = NULL;
+
+		telemetry_flush();
 		close(telemetry_fd);
 		telemetry_fd = 0;
 	}
+	telemetry_ring_deinit();
 }
@@ -3,6 +3,7 @@
  * Copyright 2017 Philipp Zabel
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -15,6 +16,16 @@
 #define TELEMETRY_PACKET_LIGHTHOUSE_FRAME	4
 #define TELEMETRY_PACKET_BUTTONS		5
 #define TELEMETRY_PACKET_AXIS			6
+/*
+ * Batch datagrams carry the wire format version in the second byte and the
+ * number of records in the third byte, followed by the records in the
+ * compact encoding described in telemetry-wire.h, each prefixed with its
+ * length as little-endian 16-bit value.
+ */
+#define TELEMETRY_PACKET_BATCH			7
+
+#define TELEMETRY_NUM_PACKET_TYPES		7
+#define TELEMETRY_ALL_DEVICES			-1
 
 struct imu_sample;
 struct raw_imu_sample;
@@ -29,5 +40,9 @@ int telemetry_send_lighthouse_frame(uint8_t dev_id,
 int telemetry_send_pose(uint8_t dev_id, struct dpose *pose);
 int telemetry_send_buttons(uint8_t dev_id, uint8_t *buttons, int num_buttons);
 int telemetry_send_axis(uint8_t dev_id, int index, float *axis, int num_axis);
+void telemetry_flush(void);
+unsigned int telemetry_subscribe(int dev_id, uint32_t types, double rate);
+void telemetry_unsubscribe(unsigned int id);
+void telemetry_set_filter_udp(bool enable);
 int telemetry_init();
 void telemetry_deinit();
@@ -0,0 +1,39 @@
+/*
+ * Static tracepoints
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * User space statically defined tracepoints in the "ouvrt" provider, for
+ * use with perf, bpftrace, or SystemTap on running daemons. Each probe is
+ * a single nop instruction unless a tracer is attached. All timestamps are
+ * CLOCK_MONOTONIC nanoseconds.
+ *
+ *   frame_dequeue(dev_id, sequence, sof_time)
+ *   blob_detect_start(dev_id, sof_time)
+ *   blob_detect_end(dev_id, sof_time, num_blobs)
+ *   flicker_start(num_blobs, led_pattern_phase)
+ *   flicker_end(num_blobs, led_pattern_phase)
+ *   pnp_start(dev_id, sof_time, num_blobs)
+ *   pnp_end(dev_id, sof_time)
+ *   imu_decode_start(dev_id, time, num_reports)
+ *   imu_decode_end(dev_id, time)
+ *   pose_update(dt_ns, sample_time)
+ *   telemetry_send(dev_id, len, start_time, end_time)
+ *
+ * The flicker and pose_update probes are hit from library code without
+ * knowledge of the device, they can be associated with the device probes
+ * hit before them on the same thread.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define OUVRT_TRACE(name, ...)	STAP_PROBEV(ouvrt, name, ##__VA_ARGS__)
+#else
+#define OUVRT_TRACE(name, ...)	do { } while (0)
+#endif /* HAVE_SDT */
+
+#endif /* __TRACE_H__ */
@@ -33,6 +33,51 @@ void tracking_model_copy(struct tracking_model *dst, struct tracking_model *src)
 	memcpy(dst->normals, src->points, src->num_points * sizeof(vec3));
 }
 
+/*
+ * Returns the size of the binary serialization of the model: the number of
+ * points followed by all points and all normals, in host byte order.
+ */
+size_t tracking_model_serialized_size(const struct tracking_model *model)
+{
+	return sizeof(uint32_t) + 2 * model->num_points * sizeof(vec3);
+}
+
+void tracking_model_serialize(const struct tracking_model *model, void *buf)
+{
+	uint32_t num_points = model->num_points;
+	size_t size = num_points * sizeof(vec3);
+	uint8_t *p = buf;
+
+	memcpy(p, &num_points, sizeof(num_points));
+	memcpy(p + sizeof(num_points), model->points, size);
+	memcpy(p + sizeof(num_points) + size, model->normals, size);
+}
+
+/*
+ * Initializes the model from its binary serialization. Returns the number
+ * of bytes consumed or -1 if the buffer is too short.
+ */
+ssize_t tracking_model_deserialize(struct tracking_model *model,
+				   const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t num_points;
+
+	if (size < sizeof(num_points))
+		return -1;
+	memcpy(&num_points, p, sizeof(num_points));
+	if ((size - sizeof(num_points)) / (2 * sizeof(vec3)) < num_points)
+		return -1;
+
+	tracking_model_init(model, num_points);
+	memcpy(model->points, p + sizeof(num_points),
+	       num_points * sizeof(vec3));
+	memcpy(model->normals, p + sizeof(num_points) +
+	       num_points * sizeof(vec3), num_points * sizeof(vec3));
+
+	return sizeof(num_points) + 2 * num_points * sizeof(vec3);
+}
+
 void tracking_model_dump_obj(struct tracking_model *model, const char *name)
 {
 	unsigned int i;
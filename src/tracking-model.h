@@ -6,6 +6,9 @@
 #ifndef __TRACKING_MODEL_H__
 #define __TRACKING_MODEL_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #include "maths.h"
 
 /*
@@ -24,6 +27,11 @@ void tracking_model_fini(struct tracking_model *model);
 void tracking_model_copy(struct tracking_model *dst,
 			 struct tracking_model *src);
 
+size_t tracking_model_serialized_size(const struct tracking_model *model);
+void tracking_model_serialize(const struct tracking_model *model, void *buf);
+ssize_t tracking_model_deserialize(struct tracking_model *model,
+				   const void *buf, size_t size);
+
 void tracking_model_dump_obj(struct tracking_model *model, const char *name);
 void tracking_model_dump_struct(struct tracking_model *model);
 
@@ -7,10 +7,27 @@
 #include <string.h>
 #include <zlib.h>
 
+#include "cache.h"
 #include "device.h"
 #include "hidraw.h"
+#include "vive-config.h"
 #include "vive-hid-reports.h"
 
+/* "VIVE" */
+#define VIVE_CALIBRATION_CACHE_MAGIC	0x45564956
+#define VIVE_CALIBRATION_CACHE_VERSION	1
+
+/*
+ * The binary calibration cache contains the IMU calibration followed by the
+ * serialized Lighthouse tracking model.
+ */
+struct vive_calibration_cache {
+	vec3 acc_bias;
+	vec3 acc_scale;
+	vec3 gyro_bias;
+	vec3 gyro_scale;
+};
+
 /*
  * Downloads configuration data stored in the Vive headset and controller.
  */
@@ -103,3 +120,126 @@ char *ouvrt_vive_get_config(OuvrtDevice *dev)
 
 	return g_realloc(config_json, strm.total_out + 1);
 }
+
+/*
+ * Returns the configuration data of a device seen before from the cache,
+ * keyed by serial number and firmware version. Otherwise downloads the
+ * configuration data and stores it in the cache.
+ */
+char *ouvrt_vive_get_cached_config(OuvrtDevice *dev,
+				   uint32_t firmware_version)
+{
+	gchar *config_json;
+	gchar *name;
+	gsize length;
+
+	if (!dev->serial || !firmware_version)
+		return ouvrt_vive_get_config(dev);
+
+	name = g_strdup_printf("vive-%s-%u.json", dev->serial,
+			       firmware_version);
+
+	if (cache_read(name, &config_json, &length)) {
+		if (length && length == strlen(config_json)) {
+			g_print("%s: Read cached configuration data\n",
+				dev->name);
+			g_free(name);
+			return config_json;
+		}
+		g_free(config_json);
+	}
+
+	config_json = ouvrt_vive_get_config(dev);
+	if (config_json)
+		cache_write(name, config_json, strlen(config_json));
+
+	g_free(name);
+
+	return config_json;
+}
+
+/*
+ * Loads the parsed IMU calibration and tracking model from the binary cache,
+ * avoiding configuration readout and JSON parsing altogether.
+ */
+int ouvrt_vive_get_cached_calibration(OuvrtDevice *dev,
+				      uint32_t firmware_version,
+				      struct vive_imu *imu,
+				      struct tracking_model *model)
+{
+	const struct vive_calibration_cache *cache;
+	struct cache_mapping map;
+	gchar *name;
+	ssize_t ret;
+
+	if (!dev->serial || !firmware_version)
+		return -ENOENT;
+
+	name = g_strdup_printf("vive-%s-%u.bin", dev->serial,
+			       firmware_version);
+	if (!cache_map(name, VIVE_CALIBRATION_CACHE_MAGIC,
+		       VIVE_CALIBRATION_CACHE_VERSION, &map)) {
+		g_free(name);
+		return -ENOENT;
+	}
+	g_free(name);
+
+	if (map.size < sizeof(*cache)) {
+		cache_unmap(&map);
+		return -ENOENT;
+	}
+
+	ret = tracking_model_deserialize(model,
+					 (const uint8_t *)map.data +
+					 sizeof(*cache),
+					 map.size - sizeof(*cache));
+	if (ret < 0 || model->num_points == 0) {
+		if (ret >= 0)
+			tracking_model_fini(model);
+		cache_unmap(&map);
+		return -ENOENT;
+	}
+
+	cache = map.data;
+	imu->acc_bias = cache->acc_bias;
+	imu->acc_scale = cache->acc_scale;
+	imu->gyro_bias = cache->gyro_bias;
+	imu->gyro_scale = cache->gyro_scale;
+
+	cache_unmap(&map);
+
+	g_print("%s: Read cached calibration data\n", dev->name);
+
+	return 0;
+}
+
+/*
+ * Stores the parsed IMU calibration and tracking model in the binary cache.
+ */
+void ouvrt_vive_cache_calibration(OuvrtDevice *dev, uint32_t firmware_version,
+				  const struct vive_imu *imu,
+				  const struct tracking_model *model)
+{
+	struct vive_calibration_cache *cache;
+	gchar *name;
+	gsize size;
+
+	if (!dev->serial || !firmware_version || !model->num_points)
+		return;
+
+	size = sizeof(*cache) + tracking_model_serialized_size(model);
+	cache = g_malloc(size);
+	cache->acc_bias = imu->acc_bias;
+	cache->acc_scale = imu->acc_scale;
+	cache->gyro_bias = imu->gyro_bias;
+	cache->gyro_scale = imu->gyro_scale;
+	tracking_model_serialize(model, cache + 1);
+
+	name = g_strdup_printf("vive-%s-%u.bin", dev->serial,
+			       firmware_version);
+	cache_write_binary(name, VIVE_CALIBRATION_CACHE_MAGIC,
+			   VIVE_CALIBRATION_CACHE_VERSION, cache, size);
+	g_free(name);
+
+	g_free(cache);
+}
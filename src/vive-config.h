@@ -6,8 +6,21 @@
 #ifndef __VIVE_CONFIG_H__
 #define __VIVE_CONFIG_H__
 
+#include <stdint.h>
+
 #include "device.h"
+#include "tracking-model.h"
+#include "vive-imu.h"
 
 char *ouvrt_vive_get_config(OuvrtDevice *dev);
+char *ouvrt_vive_get_cached_config(OuvrtDevice *dev,
+				   uint32_t firmware_version);
+int ouvrt_vive_get_cached_calibration(OuvrtDevice *dev,
+				      uint32_t firmware_version,
+				      struct vive_imu *imu,
+				      struct tracking_model *model);
+void ouvrt_vive_cache_calibration(OuvrtDevice *dev, uint32_t firmware_version,
+				  const struct vive_imu *imu,
+				  const struct tracking_model *model);
 
 #endif /* __VIVE_LIGHTHOUSE_CONFIG_H__ */
@@ -23,6 +23,7 @@
 #include "json.h"
 #include "lighthouse.h"
 #include "maths.h"
+#include "recorder.h"
 #include "usb-ids.h"
 #include "telemetry.h"
 
@@ -30,6 +31,7 @@ struct _OuvrtViveControllerUSB {
 	OuvrtDevice dev;
 
 	JsonNode *config;
+	uint32_t firmware_version;
 	struct vive_imu imu;
 	struct lighthouse_watchman watchman;
 	uint32_t buttons;
@@ -50,7 +52,13 @@ static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self)
 	gint64 device_pid, device_vid;
 	const char *serial;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
+	if (ouvrt_vive_get_cached_calibration(&self->dev,
+					      self->firmware_version, imu,
+					      &self->watchman.model) == 0)
+		return 0;
+
+	config_json = ouvrt_vive_get_cached_config(&self->dev,
+						   self->firmware_version);
 	if (!config_json)
 		return -1;
 
@@ -98,8 +106,12 @@ static int vive_controller_usb_get_config(OuvrtViveControllerUSB *self)
 	if (!self->watchman.model.num_points) {
 		g_print("%s: Failed to parse Lighthouse configuration\n",
 			self->dev.name);
+		return 0;
 	}
 
+	ouvrt_vive_cache_calibration(&self->dev, self->firmware_version, imu,
+				     &self->watchman.model);
+
 	return 0;
 }
 
@@ -111,7 +123,8 @@ static void vive_controller_decode_pulse_report(OuvrtViveControllerUSB *self,
 						const void *buf)
 {
 	const struct vive_controller_lighthouse_pulse_report *report = buf;
-	unsigned int i;
+	struct lighthouse_pulse pulses[7];
+	unsigned int i, num = 0;
 
 	/* The pulses may appear in arbitrary order */
 	for (i = 0; i < 7; i++) {
@@ -132,15 +145,21 @@ static void vive_controller_decode_pulse_report(OuvrtViveControllerUSB *self,
 			for (i = 0; i < sizeof(*report); i++)
 				g_print("%02x ", ((unsigned char *)buf)[i]);
 			g_print("\n");
-			return;
+			break;
 		}
 
 		timestamp = __le32_to_cpu(pulse->timestamp);
 		duration = __le16_to_cpu(pulse->duration);
 
-		lighthouse_watchman_handle_pulse(&self->watchman, sensor_id,
-						 duration, timestamp);
+		recorder_write_lighthouse_pulse(self->dev.rec, sensor_id,
+						duration, timestamp);
+		pulses[num].id = sensor_id;
+		pulses[num].duration = duration;
+		pulses[num].timestamp = timestamp;
+		num++;
 	}
+
+	lighthouse_watchman_handle_pulses(&self->watchman, pulses, num);
 }
 
 static const struct button_map vive_controller_usb_button_map[6] = {
@@ -183,7 +202,7 @@ static int vive_controller_usb_start(OuvrtDevice *dev)
 
 	self->watchman.name = dev->name;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, &self->firmware_version);
 	if (ret < 0 && errno == EPIPE) {
 		g_print("%s: Failed to get firmware version\n", dev->name);
 		return ret;
@@ -199,9 +218,11 @@ static int vive_controller_usb_start(OuvrtDevice *dev)
 static void vive_controller_usb_thread(OuvrtDevice *dev)
 {
 	OuvrtViveControllerUSB *self = OUVRT_VIVE_CONTROLLER_USB(dev);
-	unsigned char buf[64];
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
 	struct pollfd fds[3];
 	int ret;
+	int i;
 
 	self->watchman.id = dev->id;
 
@@ -244,45 +265,64 @@ static void vive_controller_usb_thread(OuvrtDevice *dev)
 		}
 
 		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[0], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
 			}
-			if (ret == 52 && buf[0] == VIVE_IMU_REPORT_ID) {
-				vive_imu_decode_message(dev, &self->imu, buf,
-							ret);
-			} else {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
+			recorder_write_hid_reports(dev->rec, 0, buf[0], 64, len,
+						   ret);
+			for (i = 0; i < ret; i++) {
+				if (len[i] == 52 &&
+				    buf[i][0] == VIVE_IMU_REPORT_ID) {
+					vive_imu_decode_message(dev, &self->imu,
+								buf[i], len[i]);
+				} else {
+					g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+						dev->name, len[i], buf[i][0]);
+				}
 			}
 		}
 		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[1], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
 			}
-			if (ret == 58 &&
-			    buf[0] == VIVE_CONTROLLER_LIGHTHOUSE_PULSE_REPORT_ID) {
-				vive_controller_decode_pulse_report(self, buf);
-			} else {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
+			recorder_write_hid_reports(dev->rec, 1, buf[0], 64, len,
+						   ret);
+			for (i = 0; i < ret; i++) {
+				if (len[i] == 58 &&
+				    buf[i][0] == VIVE_CONTROLLER_LIGHTHOUSE_PULSE_REPORT_ID) {
+					vive_controller_decode_pulse_report(self,
+									    buf[i]);
+				} else {
+					g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+						dev->name, len[i], buf[i][0]);
+				}
 			}
 		}
 		if (fds[2].revents & POLLIN) {
-			ret = read(dev->fds[2], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[2], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name, errno);
 				continue;
 			}
-			if (ret == 64 &&
-			    buf[0] == VIVE_CONTROLLER_BUTTON_REPORT_ID) {
-				vive_controller_decode_button_message(self, buf, ret);
-			} else {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
+			recorder_write_hid_reports(dev->rec, 2, buf[0], 64, len,
+						   ret);
+			for (i = 0; i < ret; i++) {
+				if (len[i] == 64 &&
+				    buf[i][0] == VIVE_CONTROLLER_BUTTON_REPORT_ID) {
+					vive_controller_decode_button_message(self,
+									      buf[i],
+									      len[i]);
+				} else {
+					g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+						dev->name, len[i], buf[i][0]);
+				}
 			}
 		}
 	}
@@ -318,6 +358,7 @@ static void ouvrt_vive_controller_usb_init(OuvrtViveControllerUSB *self)
 	self->config = NULL;
 	self->imu.sequence = 0;
 	self->imu.time = 0;
+	clock_sync_init(&self->imu.clock, 48000000, 32);
 	self->imu.state.pose.rotation.w = 1.0;
 	lighthouse_watchman_init(&self->watchman);
 }
@@ -21,10 +21,20 @@
 #include "buttons.h"
 #include "device.h"
 #include "hidraw.h"
+#include "imu.h"
 #include "json.h"
+#include "latency.h"
 #include "maths.h"
+#include "recorder.h"
 #include "usb-ids.h"
 #include "telemetry.h"
+#include "trace.h"
+
+/*
+ * Only integrate IMU samples into the pose if they are less than 10 ms
+ * apart. The wireless link may drop samples.
+ */
+#define VIVE_CONTROLLER_IMU_MAX_DT	480000
 
 struct _OuvrtViveController {
 	OuvrtDevice dev;
@@ -36,6 +46,7 @@ struct _OuvrtViveController {
 	struct lighthouse_watchman watchman;
 
 	uint32_t timestamp;
+	uint32_t imu_interval;
 	uint8_t battery;
 	uint8_t buttons;
 	int16_t touch_pos[2];
@@ -182,25 +193,125 @@ static void vive_controller_handle_analog_trigger(OuvrtViveController *self,
 		self->squeeze = squeeze;
 }
 
+/*
+ * Returns the distance of dt to the nearest non-zero multiple of the IMU
+ * sample interval.
+ */
+static int32_t vive_controller_imu_phase_error(OuvrtViveController *self,
+					       int32_t dt)
+{
+	int32_t n = (dt + self->imu_interval / 2) / self->imu_interval;
+
+	return abs(dt - (n > 1 ? n : 1) * (int32_t)self->imu_interval);
+}
+
+/*
+ * Completes the 48 MHz sample timestamp of which only bits 8-15 are sent.
+ * Since the sample precedes the packet, its bits 16-31 are either those of
+ * the packet timestamp or one less, if the packet timestamp has crossed a
+ * 64k tick boundary since the sample was taken. The IMU samples at a fixed
+ * rate, so the candidate that is closer to a whole number of sample
+ * intervals after the previous sample is chosen. This also holds across
+ * dropped samples. If the previous sample is stale, or the sample interval
+ * is not known yet, the packet's bits are kept.
+ */
+static uint32_t
+vive_controller_imu_timestamp(OuvrtViveController *self, uint8_t bits)
+{
+	uint32_t timestamp = self->timestamp | (bits << 8);
+	int32_t dt = timestamp - (uint32_t)self->imu.time;
+
+	if (!self->imu.time || dt < 0x10000 ||
+	    dt >= VIVE_CONTROLLER_IMU_MAX_DT)
+		return timestamp;
+
+	/* The previous sample, repeated after crossing a 64k tick boundary */
+	if (dt == 0x10000)
+		return timestamp - 0x10000;
+
+	if (!self->imu_interval)
+		return timestamp;
+
+	if (vive_controller_imu_phase_error(self, dt - 0x10000) <
+	    vive_controller_imu_phase_error(self, dt))
+		return timestamp - 0x10000;
+
+	return timestamp;
+}
+
+/*
+ * Tracks the IMU sample interval, taking into account that dt may span
+ * multiple intervals if samples were dropped.
+ */
+static void vive_controller_update_imu_interval(OuvrtViveController *self,
+						int32_t dt)
+{
+	int32_t n;
+
+	if (!self->imu_interval) {
+		self->imu_interval = dt;
+		return;
+	}
+
+	n = (dt + self->imu_interval / 2) / self->imu_interval;
+	if (n < 1)
+		n = 1;
+	self->imu_interval += (dt / n - (int32_t)self->imu_interval) / 16;
+}
+
+/*
+ * Handles an IMU sample from the wireless controller. The sample is
+ * integrated into the controller pose if it closely follows the previous
+ * sample.
+ */
 static void vive_controller_handle_imu_sample(OuvrtViveController *self,
 					      uint8_t *buf)
 {
-	/* Time in 48 MHz ticks, but we are missing the low byte */
-	uint32_t timestamp = self->timestamp | (*buf << 8);
-	int16_t accel[3] = {
-		__le16_to_cpup((__le16 *)(buf + 1)),
-		__le16_to_cpup((__le16 *)(buf + 3)),
-		__le16_to_cpup((__le16 *)(buf + 5)),
-	};
-	int16_t gyro[3] = {
-		__le16_to_cpup((__le16 *)(buf + 7)),
-		__le16_to_cpup((__le16 *)(buf + 9)),
-		__le16_to_cpup((__le16 *)(buf + 11)),
+	OuvrtDevice *dev = &self->dev;
+	struct vive_imu *imu = &self->imu;
+	uint64_t now = clock_sync_host_now();
+	uint32_t timestamp;
+	struct raw_imu_sample raw = {
+		.acc = {
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 1)),
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 3)),
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 5)),
+		},
+		.gyro = {
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 7)),
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 9)),
+			(int16_t)__le16_to_cpup((__le16 *)(buf + 11)),
+		},
 	};
+	struct imu_sample s;
+	int32_t dt;
+
+	/* Without range modes, the sample can not be scaled */
+	if (imu->gyro_range == 0.0)
+		return;
+
+	/* Time in 48 MHz ticks, but we are missing the low byte */
+	timestamp = vive_controller_imu_timestamp(self, *buf);
+
+	/* Skip repeated samples */
+	if (imu->time && timestamp == (uint32_t)imu->time)
+		return;
+
+	OUVRT_TRACE(imu_decode_start, dev->id, now, 1);
+
+	dt = vive_imu_handle_sample(dev, imu, &raw, timestamp, now, &s);
+	if (dt > 0 && dt < VIVE_CONTROLLER_IMU_MAX_DT) {
+		vive_controller_update_imu_interval(self, dt);
+
+		pose_update(dt / 48e6, &imu->state.pose, &s);
+
+		telemetry_send_pose(dev->id, &imu->state.pose);
+	}
 
-	(void)timestamp;
-	(void)accel;
-	(void)gyro;
+	OUVRT_TRACE(imu_decode_end, dev->id, now);
+
+	latency_record(dev->id, LATENCY_IMU_DECODE,
+		       clock_sync_host_now() - now);
 }
 
 /*
@@ -328,6 +439,8 @@ vive_controller_decode_message(OuvrtViveController *self,
 	uint32_t mask = 0;
 	uint32_t duration[8];
 	uint32_t start[8];
+	struct lighthouse_pulse pulses[8];
+	unsigned int num = 0;
 	for (i = 0; i < num_edges / 2; i++) {
 		int falling = rising + 1 + (buf[i] & 7);
 		mask |= 1 << falling;
@@ -359,9 +472,47 @@ vive_controller_decode_message(OuvrtViveController *self,
 		timestamp = (abs(dts1) < abs(dts2)) ? ts1 :
 			    (abs(dts2) < abs(dts3)) ? ts2 : ts3;
 
-		lighthouse_watchman_handle_pulse(&self->watchman,
-						 buf[i] >> 3, duration[i],
-						 timestamp);
+		recorder_write_lighthouse_pulse(self->dev.rec, buf[i] >> 3,
+						duration[i], timestamp);
+		pulses[num].id = buf[i] >> 3;
+		pulses[num].duration = duration[i];
+		pulses[num].timestamp = timestamp;
+		num++;
+	}
+
+	lighthouse_watchman_handle_pulses(&self->watchman, pulses, num);
+}
+
+/*
+ * Handles a single Wireless Receiver report.
+ */
+static void vive_controller_handle_report(OuvrtViveController *self,
+					  unsigned char *buf, int len)
+{
+	OuvrtDevice *dev = &self->dev;
+
+	if (len == 30 && buf[0] == VIVE_CONTROLLER_REPORT1_ID) {
+		struct vive_controller_report1 *report = (void *)buf;
+
+		vive_controller_decode_message(self, &report->message);
+	} else if (len == 59 && buf[0] == VIVE_CONTROLLER_REPORT2_ID) {
+		struct vive_controller_report2 *report = (void *)buf;
+
+		vive_controller_decode_message(self, &report->message[0]);
+		vive_controller_decode_message(self, &report->message[1]);
+	} else if (len == 2 &&
+		   buf[0] == VIVE_CONTROLLER_DISCONNECT_REPORT_ID &&
+		   buf[1] == 0x01) {
+		g_free(dev->name);
+		dev->name = g_strdup_printf("Vive Wireless Receiver %s",
+					    dev->serial);
+		self->watchman.name = dev->name;
+		g_print("%s: Controller %s disconnected\n", dev->name,
+			self->serial);
+		self->connected = FALSE;
+	} else {
+		g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
 	}
 }
 
@@ -387,11 +538,13 @@ static int vive_controller_start(OuvrtDevice *dev)
 static void vive_controller_thread(OuvrtDevice *dev)
 {
 	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
-	unsigned char buf[64];
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
 	struct pollfd fds;
 	int ret;
+	int i;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, NULL);
 	if (ret < 0 && errno == EPIPE) {
 		g_print("%s: No connected controller found\n", dev->name);
 	}
@@ -435,7 +588,7 @@ static void vive_controller_thread(OuvrtDevice *dev)
 		}
 
 		if (!self->connected) {
-			ret = vive_get_firmware_version(dev);
+			ret = vive_get_firmware_version(dev, NULL);
 			if (ret < 0)
 				continue;
 
@@ -463,36 +616,16 @@ static void vive_controller_thread(OuvrtDevice *dev)
 			}
 		}
 
-		ret = read(dev->fd, buf, sizeof(buf));
+		ret = hid_read_reports(dev->fd, buf[0], 64, len,
+				       HID_REPORT_BATCH);
 		if (ret == -1) {
 			g_print("%s: Read error: %d\n", dev->name, errno);
 			continue;
 		}
-		if (ret == 30 && buf[0] == VIVE_CONTROLLER_REPORT1_ID) {
-			struct vive_controller_report1 *report = (void *)buf;
-
-			vive_controller_decode_message(self, &report->message);
-		} else if (ret == 59 && buf[0] == VIVE_CONTROLLER_REPORT2_ID) {
-			struct vive_controller_report2 *report = (void *)buf;
-
-			vive_controller_decode_message(self,
-						       &report->message[0]);
-			vive_controller_decode_message(self,
-						       &report->message[1]);
-		} else if (ret == 2 &&
-			   buf[0] == VIVE_CONTROLLER_DISCONNECT_REPORT_ID &&
-			   buf[1] == 0x01) {
-			g_free(dev->name);
-			dev->name = g_strdup_printf("Vive Wireless Receiver %s",
-						    dev->serial);
-			self->watchman.name = dev->name;
-			g_print("%s: Controller %s disconnected\n", dev->name,
-				self->serial);
-			self->connected = FALSE;
-		} else {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-		}
+
+		recorder_write_hid_reports(dev->rec, 0, buf[0], 64, len, ret);
+		for (i = 0; i < ret; i++)
+			vive_controller_handle_report(self, buf[i], len[i]);
 	}
 }
 
@@ -529,6 +662,7 @@ static void ouvrt_vive_controller_init(OuvrtViveController *self)
 	self->connected = FALSE;
 	self->imu.sequence = 0;
 	self->imu.time = 0;
+	clock_sync_init(&self->imu.clock, 48000000, 32);
 	self->imu.state.pose.rotation.w = 1.0;
 	lighthouse_watchman_init(&self->watchman);
 }
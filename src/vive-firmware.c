@@ -11,14 +11,15 @@
 #include "hidraw.h"
 
 /*
- * Retrieves the device firmware version and hardware revision
+ * Retrieves the device firmware version and hardware revision. The firmware
+ * version is stored in firmware_version, if not NULL.
  */
-int vive_get_firmware_version(OuvrtDevice *dev)
+int vive_get_firmware_version(OuvrtDevice *dev, uint32_t *firmware_version)
 {
 	struct vive_firmware_version_report report = {
 		.id = VIVE_FIRMWARE_VERSION_REPORT_ID,
 	};
-	uint32_t firmware_version;
+	uint32_t version;
 	int ret;
 
 	ret = hid_get_feature_report_timeout(dev->fd, &report, sizeof(report),
@@ -29,10 +30,12 @@ int vive_get_firmware_version(OuvrtDevice *dev)
 		return ret;
 	}
 
-	firmware_version = __le32_to_cpu(report.firmware_version);
+	version = __le32_to_cpu(report.firmware_version);
+	if (firmware_version)
+		*firmware_version = version;
 
 	g_print("%s: Firmware version %u %s@%s FPGA %u.%u\n",
-		dev->name, firmware_version, report.string1,
+		dev->name, version, report.string1,
 		report.string2, report.fpga_version_major,
 		report.fpga_version_minor);
 	g_print("%s: Hardware revision: %d rev %d.%d.%d\n", dev->name,
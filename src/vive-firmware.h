@@ -6,8 +6,10 @@
 #ifndef __VIVE_FIRMWARE_H__
 #define __VIVE_FIRMWARE_H__
 
+#include <stdint.h>
+
 #include "device.h"
 
-int vive_get_firmware_version(OuvrtDevice *dev);
+int vive_get_firmware_version(OuvrtDevice *dev, uint32_t *firmware_version);
 
 #endif /* __VIVE_FIRMWARE_H__ */
@@ -17,17 +17,20 @@
 #include "vive-firmware.h"
 #include "vive-imu.h"
 #include "device.h"
+#include "hid-uring.h"
 #include "hidraw.h"
 #include "imu.h"
 #include "json.h"
 #include "lighthouse.h"
 #include "maths.h"
+#include "recorder.h"
 #include "usb-ids.h"
 
 struct _OuvrtViveHeadset {
 	OuvrtDevice dev;
 
 	JsonNode *config;
+	uint32_t firmware_version;
 	struct vive_imu imu;
 	struct lighthouse_watchman watchman;
 };
@@ -46,7 +49,13 @@ static int vive_headset_get_config(OuvrtViveHeadset *self)
 	gint64 device_pid, device_vid;
 	const char *serial;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
+	if (ouvrt_vive_get_cached_calibration(&self->dev,
+					      self->firmware_version, imu,
+					      &self->watchman.model) == 0)
+		return 0;
+
+	config_json = ouvrt_vive_get_cached_config(&self->dev,
+						   self->firmware_version);
 	if (!config_json)
 		return -1;
 
@@ -94,8 +103,12 @@ static int vive_headset_get_config(OuvrtViveHeadset *self)
 	if (!self->watchman.model.num_points) {
 		g_print("%s: Failed to parse Lighthouse configuration\n",
 			self->dev.name);
+		return 0;
 	}
 
+	ouvrt_vive_cache_calibration(&self->dev, self->firmware_version, imu,
+				     &self->watchman.model);
+
 	return 0;
 }
 
@@ -128,7 +141,8 @@ static void vive_headset_decode_pulse_report(OuvrtViveHeadset *self,
 					     const void *buf)
 {
 	const struct vive_headset_lighthouse_pulse_report *report = buf;
-	unsigned int i;
+	struct lighthouse_pulse pulses[9];
+	unsigned int i, num = 0;
 
 	/* The pulses may appear in arbitrary order */
 	for (i = 0; i < 9; i++) {
@@ -152,15 +166,20 @@ static void vive_headset_decode_pulse_report(OuvrtViveHeadset *self,
 		if (sensor_id > 31) {
 			g_print("%s: unhandled sensor id: %04x\n",
 				self->dev.name, sensor_id);
-			return;
+			break;
 		}
 
 		duration = __le16_to_cpu(pulse->duration);
 
-		lighthouse_watchman_handle_pulse(&self->watchman,
-						 sensor_id, duration,
-						 timestamp);
+		recorder_write_lighthouse_pulse(self->dev.rec, sensor_id,
+						duration, timestamp);
+		pulses[num].id = sensor_id;
+		pulses[num].duration = duration;
+		pulses[num].timestamp = timestamp;
+		num++;
 	}
+
+	lighthouse_watchman_handle_pulses(&self->watchman, pulses, num);
 }
 
 /*
@@ -172,7 +191,7 @@ static int vive_headset_start(OuvrtDevice *dev)
 	OuvrtViveHeadset *self = OUVRT_VIVE_HEADSET(dev);
 	int ret;
 
-	ret = vive_get_firmware_version(dev);
+	ret = vive_get_firmware_version(dev, &self->firmware_version);
 	if (ret < 0) {
 		g_print("%s: Failed to get firmware version\n", dev->name);
 		return ret;
@@ -196,17 +215,83 @@ static int vive_headset_start(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Handles a batch of reports received from the IMU (index 0) or Lighthouse
+ * Receiver (index 1) interface.
+ */
+static void vive_headset_handle_reports(void *data, int index,
+					unsigned char *buf, size_t len,
+					const int *lens, int num)
+{
+	OuvrtViveHeadset *self = data;
+	OuvrtDevice *dev = &self->dev;
+	unsigned char *report;
+	int i;
+
+	recorder_write_hid_reports(dev->rec, index, buf, len, lens, num);
+
+	for (i = 0; i < num; i++) {
+		report = buf + i * len;
+
+		if (index == 0 && lens[i] == 52 &&
+		    report[0] == VIVE_IMU_REPORT_ID) {
+			vive_imu_decode_message(dev, &self->imu, report, 52);
+		} else if (index == 1 && lens[i] == 64 &&
+			   report[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT_ID) {
+			vive_headset_decode_pulse_report(self, report);
+		} else {
+			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
+				dev->name, lens[i], report[0]);
+		}
+	}
+}
+
 /*
  * Handles IMU and Lighthouse Receiver messages.
  */
 static void vive_headset_thread(OuvrtDevice *dev)
 {
 	OuvrtViveHeadset *self = OUVRT_VIVE_HEADSET(dev);
-	unsigned char buf[64];
+	unsigned char buf[HID_REPORT_BATCH][64];
+	int len[HID_REPORT_BATCH];
+	struct hid_uring *uring;
 	struct pollfd fds[2];
 	int ret;
 
+	uring = hid_uring_new(dev->fds, 2);
+	if (uring)
+		g_print("%s: Using io_uring\n", dev->name);
+
 	while (dev->active) {
+		if (uring) {
+			/*
+			 * Reports are decoded during the wait, so the range
+			 * modes have to be known before.
+			 */
+			if (self->imu.gyro_range == 0.0) {
+				ret = vive_imu_get_range_modes(dev, &self->imu);
+				if (ret < 0) {
+					g_print("%s: Failed to get gyro/accelerometer range modes\n",
+						dev->name);
+					continue;
+				}
+			}
+
+			ret = hid_uring_wait(uring, 1000,
+					     vive_headset_handle_reports, self);
+			if (ret == -ENODEV) {
+				g_print("%s: Disconnected\n", dev->name);
+				dev->active = FALSE;
+				break;
+			}
+			if (ret < 0)
+				g_print("%s: Wait failure: %d\n", dev->name,
+					-ret);
+			else if (ret == 0)
+				g_print("%s: Poll timeout\n", dev->name);
+			continue;
+		}
+
 		fds[0].fd = dev->fds[0];
 		fds[0].events = POLLIN;
 		fds[0].revents = 0;
@@ -242,37 +327,32 @@ static void vive_headset_thread(OuvrtDevice *dev)
 		}
 
 		if (fds[0].revents & POLLIN) {
-			ret = read(dev->fds[0], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[0], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
 				continue;
 			}
-			if (ret != 52 || buf[0] != VIVE_IMU_REPORT_ID) {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
 
-			vive_imu_decode_message(dev, &self->imu, buf, 52);
+			vive_headset_handle_reports(self, 0, buf[0], 64, len,
+						    ret);
 		}
 		if (fds[1].revents & POLLIN) {
-			ret = read(dev->fds[1], buf, sizeof(buf));
+			ret = hid_read_reports(dev->fds[1], buf[0], 64, len,
+					       HID_REPORT_BATCH);
 			if (ret == -1) {
 				g_print("%s: Read error: %d\n", dev->name,
 					errno);
 				continue;
 			}
-			if (ret == 64 &&
-			    buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT_ID) {
-				vive_headset_decode_pulse_report(self, buf);
-			} else {
-				g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-					dev->name, ret, buf[0]);
-				continue;
-			}
+
+			vive_headset_handle_reports(self, 1, buf[0], 64, len,
+						    ret);
 		}
 	}
+
+	hid_uring_free(uring);
 }
 
 /*
@@ -303,6 +383,7 @@ static void ouvrt_vive_headset_init(OuvrtViveHeadset *self)
 	self->dev.type = DEVICE_TYPE_HMD;
 	self->imu.sequence = 0;
 	self->imu.time = 0;
+	clock_sync_init(&self->imu.clock, 48000000, 32);
 	self->imu.state.pose.rotation.w = 1.0;
 	lighthouse_watchman_init(&self->watchman);
 }
@@ -12,7 +12,10 @@
 #include "vive-hid-reports.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "latency.h"
+#include "recorder.h"
 #include "telemetry.h"
+#include "trace.h"
 
 static inline int oldest_sequence_index(uint8_t a, uint8_t b, uint8_t c)
 {
@@ -65,6 +68,56 @@ int vive_imu_get_range_modes(OuvrtDevice *dev, struct vive_imu *imu)
 	return 0;
 }
 
+/*
+ * Handles a single raw IMU sample taken at the given 48 MHz device time:
+ * synchronizes it to the host clock, converts it into calibrated units,
+ * and sends it to telemetry and the recorder. Returns the time since the
+ * previous sample in 48 MHz ticks.
+ */
+int32_t vive_imu_handle_sample(OuvrtDevice *dev, struct vive_imu *imu,
+			       struct raw_imu_sample *raw, uint32_t time,
+			       uint64_t now, struct imu_sample *s)
+{
+	uint64_t ticks;
+	double scale;
+	int32_t dt;
+
+	dt = time - (uint32_t)imu->time;
+	raw->time = imu->time + dt;
+
+	/* 48 MHz, wraps every ~89 s */
+	ticks = clock_sync_unwrap(&imu->clock, time);
+	clock_sync_update(&imu->clock, ticks, now);
+
+	telemetry_send_raw_imu_sample(dev->id, raw);
+
+	scale = imu->accel_range / 32768.0;
+	s->acceleration.x = -scale * imu->acc_scale.x * raw->acc[0] -
+			    imu->acc_bias.x;
+	s->acceleration.z = -scale * imu->acc_scale.y * raw->acc[1] -
+			    imu->acc_bias.y;
+	s->acceleration.y = -scale * imu->acc_scale.z * raw->acc[2] -
+			    imu->acc_bias.z;
+
+	scale = imu->gyro_range / 32768.0;
+	s->angular_velocity.x = -scale * imu->gyro_scale.x * raw->gyro[0] -
+				imu->gyro_bias.x;
+	s->angular_velocity.z = -scale * imu->gyro_scale.y * raw->gyro[1] -
+				imu->gyro_bias.y;
+	s->angular_velocity.y = -scale * imu->gyro_scale.z * raw->gyro[2] -
+				imu->gyro_bias.z;
+
+	s->time = 1e-9 * clock_sync_ticks_to_host(&imu->clock, ticks);
+
+	telemetry_send_imu_sample(dev->id, s);
+	recorder_write(dev->rec, RECORDER_EVENT_IMU_SAMPLE,
+		       s->time * 1e9, s, sizeof(*s), NULL, 0);
+
+	imu->time = raw->time;
+
+	return dt;
+}
+
 /*
  * Decodes the periodic IMU sensor message sent by the Vive headset and wired
  * controllers.
@@ -74,11 +127,14 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 {
 	const struct vive_imu_report *report = buf;
 	const struct vive_imu_sample *sample = report->sample;
+	uint64_t now = clock_sync_host_now();
 	uint8_t last_seq = imu->sequence;
 	int i, j;
 
 	(void)len;
 
+	OUVRT_TRACE(imu_decode_start, dev->id, now, 1);
+
 	/*
 	 * The three samples are updated round-robin. New messages
 	 * can contain already seen samples in any place, but the
@@ -91,8 +147,6 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 	for (j = 3; j; --j, i = (i + 1) % 3) {
 		struct raw_imu_sample raw;
 		struct imu_sample s;
-		uint32_t time;
-		double scale;
 		uint8_t seq;
 		int32_t dt;
 
@@ -112,31 +166,9 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 		raw.gyro[1] = (int16_t)__le16_to_cpu(sample->gyro[1]);
 		raw.gyro[2] = (int16_t)__le16_to_cpu(sample->gyro[2]);
 
-		time = __le32_to_cpu(sample->time);
-		dt = time - (uint32_t)imu->time;
-		raw.time = imu->time + dt;
-
-		telemetry_send_raw_imu_sample(dev->id, &raw);
-
-		scale = imu->accel_range / 32768.0;
-		s.acceleration.x = -scale * imu->acc_scale.x * raw.acc[0] -
-				   imu->acc_bias.x;
-		s.acceleration.z = -scale * imu->acc_scale.y * raw.acc[1] -
-				   imu->acc_bias.y;
-		s.acceleration.y = -scale * imu->acc_scale.z * raw.acc[2] -
-				   imu->acc_bias.z;
-
-		scale = imu->gyro_range / 32768.0;
-		s.angular_velocity.x = -scale * imu->gyro_scale.x * raw.gyro[0] -
-				       imu->gyro_bias.x;
-		s.angular_velocity.z = -scale * imu->gyro_scale.y * raw.gyro[1] -
-				       imu->gyro_bias.y;
-		s.angular_velocity.y = -scale * imu->gyro_scale.z * raw.gyro[2] -
-				       imu->gyro_bias.z;
-
-		s.time = (double)raw.time / 48e6;
-
-		telemetry_send_imu_sample(dev->id, &s);
+		dt = vive_imu_handle_sample(dev, imu, &raw,
+					    __le32_to_cpu(sample->time), now,
+					    &s);
 
 		if ((dt > 47950 && dt < 48050) ||
 		    (dt > 190000 && dt < 194000)) {
@@ -146,6 +178,10 @@ void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 		}
 
 		imu->sequence = seq;
-		imu->time = raw.time;
 	}
+
+	OUVRT_TRACE(imu_decode_end, dev->id, now);
+
+	latency_record(dev->id, LATENCY_IMU_DECODE,
+		       clock_sync_host_now() - now);
 }
@@ -6,11 +6,13 @@
 #ifndef __VIVE_IMU_H__
 #define __VIVE_IMU_H__
 
+#include "clock-sync.h"
 #include "device.h"
 #include "maths.h"
 #include "imu.h"
 
 struct vive_imu {
+	struct clock_sync clock;
 	uint64_t time;
 	uint8_t sequence;
 	struct imu_state state;
@@ -23,6 +25,9 @@ struct vive_imu {
 };
 
 int vive_imu_get_range_modes(OuvrtDevice *dev, struct vive_imu *imu);
+int32_t vive_imu_handle_sample(OuvrtDevice *dev, struct vive_imu *imu,
+			       struct raw_imu_sample *raw, uint32_t time,
+			       uint64_t now, struct imu_sample *s);
 void vive_imu_decode_message(OuvrtDevice *dev, struct vive_imu *imu,
 			     const void *buf, size_t len);
 
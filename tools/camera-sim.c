@@ -0,0 +1,851 @@
+/*
+ * Renders synthetic IR camera frames and IMU samples of a tracked object
+ * moving along a scripted trajectory, and runs them through the tracking
+ * pipeline to measure accuracy and latency against the ground truth.
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "imu.h"
+#include "leds.h"
+#include "maths.h"
+#include "opencv.h"
+
+#define LED_PATTERN_LENGTH	10
+#define LED_BLOOM_RADIUS	0.006	/* m */
+#define LED_MAX_ANGLE		75.0	/* degrees */
+#define LED_PEAK_LEVEL		400.0
+#define LED_DIM_LEVEL		0.65
+#define NOISE_TABLE_SIZE	65536
+#define MAX_LEDS		64
+#define IMU_RATE		1000
+
+struct keyframe {
+	double time;
+	struct dpose pose;
+};
+
+struct scene {
+	struct leds leds;
+	int width;
+	int height;
+	dmat3 camera_matrix;
+	double dist_coeffs[5];
+	int framerate;
+	double duration;
+	double noise;
+	unsigned int seed;
+	float *noise_table;
+	dquat base_rotation;
+	struct keyframe *keyframes;
+	int num_keyframes;
+};
+
+struct projection {
+	int led_id;
+	double u;
+	double v;
+	double radius;
+};
+
+struct latency {
+	double *samples;
+	int num;
+};
+
+static double timespec_to_s(const struct timespec *ts)
+{
+	return ts->tv_sec + 1e-9 * ts->tv_nsec;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_s(&ts);
+}
+
+static void dquat_slerp(dquat *r, const dquat *a, const dquat *b, double t)
+{
+	dquat c = *b;
+	double d = dquat_dot(a, b);
+	double theta, sa, sb;
+
+	if (d < 0.0) {
+		c.w = -c.w;
+		c.x = -c.x;
+		c.y = -c.y;
+		c.z = -c.z;
+		d = -d;
+	}
+
+	if (d > 0.9995) {
+		sa = 1.0 - t;
+		sb = t;
+	} else {
+		theta = acos(d);
+		sa = sin((1.0 - t) * theta) / sin(theta);
+		sb = sin(t * theta) / sin(theta);
+	}
+
+	r->w = sa * a->w + sb * c.w;
+	r->x = sa * a->x + sb * c.x;
+	r->y = sa * a->y + sb * c.y;
+	r->z = sa * a->z + sb * c.z;
+	dquat_normalize(r);
+}
+
+static double dquat_angle(const dquat *a, const dquat *b)
+{
+	double d = fabs(dquat_dot(a, b));
+
+	return 2.0 * acos(d > 1.0 ? 1.0 : d);
+}
+
+/*
+ * Loads a tracking model from an OBJ file in the format written by
+ * tracking_model_dump_obj(): for each point, one vertex at the point
+ * position followed by one vertex at the position plus normal.
+ */
+static int load_model(struct leds *leds, const char *filename)
+{
+	vec3 v[2 * MAX_LEDS];
+	char line[256];
+	int num = 0;
+	FILE *f;
+	int i;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open '%s': %s\n", filename,
+			strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] != 'v' || line[1] != ' ')
+			continue;
+		if (num == 2 * MAX_LEDS) {
+			fprintf(stderr, "Too many points in '%s'\n", filename);
+			fclose(f);
+			return -EINVAL;
+		}
+		if (sscanf(line + 2, "%f %f %f", &v[num].x, &v[num].y,
+			   &v[num].z) != 3) {
+			fprintf(stderr, "Invalid vertex: %s", line);
+			fclose(f);
+			return -EINVAL;
+		}
+		num++;
+	}
+	fclose(f);
+
+	if (num < 8 || num % 2) {
+		fprintf(stderr, "'%s' contains no usable tracking model\n",
+			filename);
+		return -EINVAL;
+	}
+
+	leds_init(leds, num / 2);
+	for (i = 0; i < num / 2; i++) {
+		leds->model.points[i] = v[2 * i];
+		leds->model.normals[i].x = v[2 * i + 1].x - v[2 * i].x;
+		leds->model.normals[i].y = v[2 * i + 1].y - v[2 * i].y;
+		leds->model.normals[i].z = v[2 * i + 1].z - v[2 * i].z;
+		vec3_normalize(&leds->model.normals[i]);
+	}
+
+	return 0;
+}
+
+static int hamming_distance(uint16_t a, uint16_t b)
+{
+	return __builtin_popcount(a ^ b);
+}
+
+/*
+ * Assigns 10-bit blinking patterns with a minimum Hamming distance of 3 to
+ * all LEDs, so that the flicker detection can tell them apart even with a
+ * single bit error. Patterns with less than three bright or dim phases are
+ * skipped, as they produce too few edges to be tracked reliably.
+ */
+static int generate_patterns(struct leds *leds)
+{
+	unsigned int num = 0;
+	uint16_t pattern;
+	unsigned int i;
+
+	for (pattern = 1; pattern < 0x3ff; pattern++) {
+		if (__builtin_popcount(pattern) < 3 ||
+		    __builtin_popcount(pattern) > 7)
+			continue;
+		for (i = 0; i < num; i++) {
+			if (hamming_distance(pattern, leds->patterns[i]) < 3)
+				break;
+		}
+		if (i < num)
+			continue;
+		leds->patterns[num++] = pattern;
+		if (num == leds->model.num_points)
+			return 0;
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * Loads a trajectory of keyframes, one per line: time in seconds, position
+ * in meters, and orientation quaternion (w, x, y, z) of the object in the
+ * camera coordinate system.
+ */
+static int load_trajectory(struct scene *scene, const char *filename)
+{
+	struct keyframe *k;
+	char line[256];
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open '%s': %s\n", filename,
+			strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		scene->keyframes = realloc(scene->keyframes,
+					   (scene->num_keyframes + 1) *
+					   sizeof(*scene->keyframes));
+		k = &scene->keyframes[scene->num_keyframes];
+		if (sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf", &k->time,
+			   &k->pose.translation.x, &k->pose.translation.y,
+			   &k->pose.translation.z, &k->pose.rotation.w,
+			   &k->pose.rotation.x, &k->pose.rotation.y,
+			   &k->pose.rotation.z) != 8 ||
+		    (scene->num_keyframes &&
+		     k->time <= k[-1].time)) {
+			fprintf(stderr, "Invalid keyframe: %s", line);
+			fclose(f);
+			return -EINVAL;
+		}
+		dquat_normalize(&k->pose.rotation);
+		scene->num_keyframes++;
+	}
+	fclose(f);
+
+	if (scene->num_keyframes < 2) {
+		fprintf(stderr, "Trajectory needs at least two keyframes\n");
+		return -EINVAL;
+	}
+
+	scene->duration = scene->keyframes[scene->num_keyframes - 1].time -
+			  scene->keyframes[0].time;
+
+	return 0;
+}
+
+/*
+ * Determines the base orientation for the built-in trajectory: the object's
+ * up axis (+y) turned to the camera's up axis (-y), and the average LED
+ * normal turned around the vertical axis to face the camera.
+ */
+static void init_base_rotation(struct scene *scene)
+{
+	const dquat upright = { 0.0, 0.0, 1.0, 0.0 };
+	struct tracking_model *model = &scene->leds.model;
+	dvec3 n = { 0.0, 0.0, 0.0 };
+	dquat turn;
+	dvec3 axis = { 0.0, 1.0, 0.0 };
+	unsigned int i;
+
+	for (i = 0; i < model->num_points; i++) {
+		n.x += model->normals[i].x;
+		n.y += model->normals[i].y;
+		n.z += model->normals[i].z;
+	}
+	dquat_rotate(&n, &upright, &n);
+
+	/* Yaw the horizontal part of the average normal towards -z */
+	if (fabs(n.x) + fabs(n.z) < 1e-3)
+		turn = (dquat){ 0.0, 0.0, 0.0, 1.0 };
+	else
+		dquat_from_axis_angle(&turn, &axis, atan2(n.x, -n.z));
+
+	dquat_mult(&scene->base_rotation, &turn, &upright);
+}
+
+/*
+ * Returns the ground truth pose of the object at time t, either interpolated
+ * between keyframes, or from the built-in trajectory: a slow figure of eight
+ * in front of the camera at 1.5 m distance while yawing and pitching.
+ */
+static void trajectory_pose(const struct scene *scene, double t,
+			    struct dpose *pose)
+{
+	const struct keyframe *k = scene->keyframes;
+	const double w = 2.0 * M_PI / 8.0;
+	dquat yaw, pitch, q;
+	dvec3 axis;
+	double s;
+	int i;
+
+	if (scene->num_keyframes) {
+		t += k[0].time;
+		for (i = 1; i < scene->num_keyframes - 1; i++) {
+			if (t < k[i].time)
+				break;
+		}
+		s = (t - k[i - 1].time) / (k[i].time - k[i - 1].time);
+		if (s < 0.0)
+			s = 0.0;
+		if (s > 1.0)
+			s = 1.0;
+		pose->translation.x = k[i - 1].pose.translation.x + s *
+			(k[i].pose.translation.x - k[i - 1].pose.translation.x);
+		pose->translation.y = k[i - 1].pose.translation.y + s *
+			(k[i].pose.translation.y - k[i - 1].pose.translation.y);
+		pose->translation.z = k[i - 1].pose.translation.z + s *
+			(k[i].pose.translation.z - k[i - 1].pose.translation.z);
+		dquat_slerp(&pose->rotation, &k[i - 1].pose.rotation,
+			    &k[i].pose.rotation, s);
+		return;
+	}
+
+	pose->translation.x = 0.2 * sin(w * t);
+	pose->translation.y = 0.1 * sin(2.0 * w * t);
+	pose->translation.z = 1.5 + 0.2 * cos(w * t);
+
+	axis = (dvec3){ 0.0, 1.0, 0.0 };
+	dquat_from_axis_angle(&yaw, &axis, 0.5 * sin(w * t));
+	axis = (dvec3){ 1.0, 0.0, 0.0 };
+	dquat_from_axis_angle(&pitch, &axis, 0.2 * sin(1.3 * w * t));
+	dquat_mult(&q, &yaw, &pitch);
+	dquat_mult(&pose->rotation, &q, &scene->base_rotation);
+}
+
+/*
+ * Projects a point in camera coordinates into the image, applying the
+ * radial and tangential lens distortion.
+ */
+static void project(const struct scene *scene, const dvec3 *p, double *u,
+		    double *v)
+{
+	const double *m = scene->camera_matrix.m;
+	const double *d = scene->dist_coeffs;
+	const double x = p->x / p->z;
+	const double y = p->y / p->z;
+	const double r2 = x * x + y * y;
+	const double radial = 1.0 + r2 * (d[0] + r2 * (d[1] + r2 * d[4]));
+	const double xd = x * radial + 2.0 * d[2] * x * y +
+			  d[3] * (r2 + 2.0 * x * x);
+	const double yd = y * radial + d[2] * (r2 + 2.0 * y * y) +
+			  2.0 * d[3] * x * y;
+
+	*u = m[0] * xd + m[2];
+	*v = m[4] * yd + m[5];
+}
+
+/*
+ * Fills a table with normally distributed noise, used to render the sensor
+ * noise without drawing a new random number for every pixel.
+ */
+static void init_noise_table(struct scene *scene)
+{
+	double u1, u2;
+	int i;
+
+	scene->noise_table = malloc(NOISE_TABLE_SIZE * sizeof(float));
+	for (i = 0; i < NOISE_TABLE_SIZE; i++) {
+		u1 = (rand_r(&scene->seed) + 1.0) / ((double)RAND_MAX + 2.0);
+		u2 = (rand_r(&scene->seed) + 1.0) / ((double)RAND_MAX + 2.0);
+		scene->noise_table[i] = scene->noise *
+					sqrt(-2.0 * log(u1)) *
+					cos(2.0 * M_PI * u2);
+	}
+}
+
+/*
+ * Renders the LEDs facing the camera as Gaussian spots, bright or dim
+ * according to their blinking pattern at the given phase, over a dark,
+ * noisy background.
+ *
+ * Returns the number of LEDs projected into the image.
+ */
+static int render_frame(struct scene *scene, const struct dpose *pose,
+			uint8_t phase, uint8_t *frame,
+			struct projection *projections)
+{
+	const struct tracking_model *model = &scene->leds.model;
+	const double cos_max = cos(LED_MAX_ANGLE * M_PI / 180.0);
+	const double fx = scene->camera_matrix.m[0];
+	double u, v, sigma, peak, facing, dist, val;
+	int x, y, x0, x1, y0, y1;
+	struct projection *proj;
+	unsigned int offset;
+	unsigned int i;
+	dvec3 p, n;
+	int num = 0;
+
+	offset = rand_r(&scene->seed);
+	for (y = 0; y < scene->width * scene->height; y++) {
+		val = 8.0 + scene->noise_table[(offset + y) %
+					       NOISE_TABLE_SIZE];
+		frame[y] = val < 0.0 ? 0 : val;
+	}
+
+	for (i = 0; i < model->num_points; i++) {
+		p = (dvec3){ model->points[i].x, model->points[i].y,
+			     model->points[i].z };
+		n = (dvec3){ model->normals[i].x, model->normals[i].y,
+			     model->normals[i].z };
+		dquat_rotate(&p, &pose->rotation, &p);
+		dquat_rotate(&n, &pose->rotation, &n);
+		p.x += pose->translation.x;
+		p.y += pose->translation.y;
+		p.z += pose->translation.z;
+
+		if (p.z < 0.05)
+			continue;
+
+		dist = sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+		facing = -(n.x * p.x + n.y * p.y + n.z * p.z) / dist;
+		if (facing < cos_max)
+			continue;
+
+		project(scene, &p, &u, &v);
+		if (u < 0 || v < 0 || u >= scene->width || v >= scene->height)
+			continue;
+
+		sigma = LED_BLOOM_RADIUS * fx / p.z;
+		if (sigma < 0.8)
+			sigma = 0.8;
+		peak = LED_PEAK_LEVEL * (0.5 + 0.5 * facing);
+		if (!(scene->leds.patterns[i] & (1 << phase)))
+			peak *= LED_DIM_LEVEL;
+
+		proj = &projections[num++];
+		proj->led_id = i;
+		proj->u = u;
+		proj->v = v;
+		proj->radius = 3.0 * sigma;
+
+		x0 = fmax(0, floor(u - 3.0 * sigma));
+		x1 = fmin(scene->width - 1, ceil(u + 3.0 * sigma));
+		y0 = fmax(0, floor(v - 3.0 * sigma));
+		y1 = fmin(scene->height - 1, ceil(v + 3.0 * sigma));
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				double dx = x + 0.5 - u;
+				double dy = y + 0.5 - v;
+				uint8_t *pixel = &frame[y * scene->width + x];
+
+				val = peak * exp(-(dx * dx + dy * dy) /
+						 (2.0 * sigma * sigma));
+				if (val > 255.0)
+					val = 255.0;
+				if (val > *pixel)
+					*pixel = val;
+			}
+		}
+	}
+
+	return num;
+}
+
+/*
+ * Derives the IMU sample at time t from the trajectory: angular velocity
+ * and specific force in the object frame, with gravity pointing along +y
+ * in the camera frame.
+ */
+static void imu_sample_at(const struct scene *scene, double t,
+			  struct imu_sample *sample)
+{
+	const double h = 0.5 / IMU_RATE;
+	struct dpose p0, p1, p2;
+	dquat inv, dq;
+	dvec3 a, f;
+	double s;
+
+	trajectory_pose(scene, t - h, &p0);
+	trajectory_pose(scene, t, &p1);
+	trajectory_pose(scene, t + h, &p2);
+
+	dquat_conj(&inv, &p0.rotation);
+	dquat_mult(&dq, &inv, &p2.rotation);
+	s = dq.w < 0.0 ? -1.0 : 1.0;
+	sample->angular_velocity.x = s * dq.x * 2.0 / (2.0 * h);
+	sample->angular_velocity.y = s * dq.y * 2.0 / (2.0 * h);
+	sample->angular_velocity.z = s * dq.z * 2.0 / (2.0 * h);
+
+	a.x = (p0.translation.x - 2.0 * p1.translation.x + p2.translation.x) /
+	      (h * h);
+	a.y = (p0.translation.y - 2.0 * p1.translation.y + p2.translation.y) /
+	      (h * h);
+	a.z = (p0.translation.z - 2.0 * p1.translation.z + p2.translation.z) /
+	      (h * h);
+	a.y -= STANDARD_GRAVITY;
+
+	dquat_conj(&inv, &p1.rotation);
+	dquat_rotate(&f, &inv, &a);
+	sample->acceleration.x = f.x;
+	sample->acceleration.y = f.y;
+	sample->acceleration.z = f.z;
+	sample->magnetic_field = (vec3){ 0.0, 0.0, 0.0 };
+	sample->temperature = 25.0;
+	sample->time = t;
+}
+
+static void latency_add(struct latency *l, double value)
+{
+	l->samples = realloc(l->samples, (l->num + 1) * sizeof(double));
+	l->samples[l->num++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	const double *x = a;
+	const double *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void latency_print(const char *name, struct latency *l)
+{
+	if (!l->num) {
+		printf("%-20s no samples\n", name);
+		return;
+	}
+
+	qsort(l->samples, l->num, sizeof(double), compare_doubles);
+	printf("%-20s p50 %8.1f µs  p99 %8.1f µs  max %8.1f µs\n", name,
+	       1e6 * l->samples[l->num / 2],
+	       1e6 * l->samples[l->num * 99 / 100],
+	       1e6 * l->samples[l->num - 1]);
+}
+
+static int parse_camera(struct scene *scene, const char *arg)
+{
+	double v[9] = { 0 };
+	char *end;
+	int n;
+
+	for (n = 0; n < 9; n++) {
+		v[n] = strtod(arg, &end);
+		if (end == arg)
+			return -EINVAL;
+		if (*end != ',')
+			break;
+		arg = end + 1;
+	}
+	if (*end != '\0' || n < 3)
+		return -EINVAL;
+
+	memset(&scene->camera_matrix, 0, sizeof(scene->camera_matrix));
+	scene->camera_matrix.m[0] = v[0];
+	scene->camera_matrix.m[4] = v[1];
+	scene->camera_matrix.m[2] = v[2];
+	scene->camera_matrix.m[5] = v[3];
+	scene->camera_matrix.m[8] = 1.0;
+	memcpy(scene->dist_coeffs, v + 4, sizeof(scene->dist_coeffs));
+
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("camera-sim [OPTIONS...] MODEL.obj\n\n"
+		"Renders a tracking model moving along a trajectory into\n"
+		"synthetic camera frames and measures tracking accuracy and\n"
+		"latency against the ground truth.\n\n"
+		"  -h --help          Show this help\n"
+		"  -t --trajectory=FILE\n"
+		"                     Keyframes: t x y z qw qx qy qz per line\n"
+		"  -d --duration=S    Duration of the built-in trajectory\n"
+		"  -s --size=WxH      Frame size, default 1280x960\n"
+		"  -c --camera=fx,fy,cx,cy[,k1,k2,p1,p2,k3]\n"
+		"                     Camera matrix and distortion coefficients\n"
+		"  -r --framerate=N   Camera frame rate, default 60\n"
+		"  -n --noise=SIGMA   Pixel noise standard deviation, default 2\n"
+		"  -o --frames=FILE   Write rendered 8-bit gray frames to FILE\n"
+		"  -i --imu=FILE      Write IMU samples to FILE\n");
+}
+
+static const struct option options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "trajectory", required_argument, NULL, 't' },
+	{ "duration", required_argument, NULL, 'd' },
+	{ "size", required_argument, NULL, 's' },
+	{ "camera", required_argument, NULL, 'c' },
+	{ "framerate", required_argument, NULL, 'r' },
+	{ "noise", required_argument, NULL, 'n' },
+	{ "frames", required_argument, NULL, 'o' },
+	{ "imu", required_argument, NULL, 'i' },
+	{ NULL }
+};
+
+int main(int argc, char *argv[])
+{
+	struct scene scene = {
+		.width = 1280,
+		.height = 960,
+		.framerate = 60,
+		.duration = 10.0,
+		.noise = 2.0,
+		.seed = 1,
+	};
+	struct latency detect = { 0 }, solve = { 0 }, render = { 0 };
+	struct projection projections[MAX_LEDS];
+	const char *trajectory = NULL;
+	FILE *frames_file = NULL;
+	FILE *imu_file = NULL;
+	struct blobservation *ob;
+	struct imu_sample sample;
+	struct dpose pose, imu_pose;
+	double t, t0, t1, d;
+	int num_frames, num_imu = 0;
+	int frames_with_pose = 0;
+	long blobs = 0, identified = 0, correct = 0, visible = 0;
+	double trans_err = 0.0, rot_err = 0.0;
+	struct blobwatch *bw;
+	uint8_t *frame;
+	dquat rot = { 0 };
+	dvec3 trans = { 0 };
+	int num, frame_idx;
+	int ret;
+	int i, j;
+
+	do {
+		ret = getopt_long(argc, argv, "ht:d:s:c:r:n:o:i:", options,
+				  NULL);
+		switch (ret) {
+		case -1:
+			break;
+		case 't':
+			trajectory = optarg;
+			break;
+		case 'd':
+			scene.duration = atof(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &scene.width,
+				   &scene.height) != 2 ||
+			    scene.width <= 0 || scene.height <= 0) {
+				fprintf(stderr, "Invalid size: '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			if (parse_camera(&scene, optarg) < 0) {
+				fprintf(stderr, "Invalid camera: '%s'\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'r':
+			scene.framerate = atoi(optarg);
+			break;
+		case 'n':
+			scene.noise = atof(optarg);
+			break;
+		case 'o':
+			frames_file = fopen(optarg, "w");
+			if (!frames_file) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			imu_file = fopen(optarg, "w");
+			if (!imu_file) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			usage();
+			return 0;
+		}
+	} while (ret != -1);
+
+	if (optind != argc - 1 || scene.framerate <= 0) {
+		usage();
+		return 1;
+	}
+
+	if (load_model(&scene.leds, argv[optind]) < 0)
+		return 1;
+	if (generate_patterns(&scene.leds) < 0) {
+		fprintf(stderr, "Not enough distinct blinking patterns\n");
+		return 1;
+	}
+	if (trajectory && load_trajectory(&scene, trajectory) < 0)
+		return 1;
+
+	/* Default to the Rift CV1 sensor's approximate intrinsics */
+	if (scene.camera_matrix.m[8] == 0.0) {
+		scene.camera_matrix.m[0] = 715.0 * scene.width / 1280;
+		scene.camera_matrix.m[4] = 715.0 * scene.width / 1280;
+		scene.camera_matrix.m[2] = scene.width / 2.0;
+		scene.camera_matrix.m[5] = scene.height / 2.0;
+		scene.camera_matrix.m[8] = 1.0;
+	}
+
+	init_base_rotation(&scene);
+	init_noise_table(&scene);
+
+	frame = malloc(scene.width * scene.height);
+	bw = blobwatch_new(scene.width, scene.height);
+	blobwatch_set_flicker(true);
+
+	trajectory_pose(&scene, 0.0, &imu_pose);
+	num_frames = scene.duration * scene.framerate;
+
+	for (frame_idx = 0; frame_idx < num_frames; frame_idx++) {
+		uint8_t phase = frame_idx % LED_PATTERN_LENGTH;
+
+		t = (double)frame_idx / scene.framerate;
+
+		/* Integrate the IMU samples up to this frame */
+		for (; num_imu <= t * IMU_RATE; num_imu++) {
+			imu_sample_at(&scene, (double)num_imu / IMU_RATE,
+				      &sample);
+			if (num_imu)
+				pose_update(1.0 / IMU_RATE, &imu_pose, &sample);
+			if (imu_file) {
+				fprintf(imu_file, "%.6f %f %f %f %f %f %f\n",
+					sample.time, sample.acceleration.x,
+					sample.acceleration.y,
+					sample.acceleration.z,
+					sample.angular_velocity.x,
+					sample.angular_velocity.y,
+					sample.angular_velocity.z);
+			}
+		}
+
+		trajectory_pose(&scene, t, &pose);
+
+		t0 = now();
+		num = render_frame(&scene, &pose, phase, frame, projections);
+		latency_add(&render, now() - t0);
+		visible += num;
+
+		if (frames_file)
+			fwrite(frame, scene.width * scene.height, 1,
+			       frames_file);
+
+		t0 = now();
+		blobwatch_process(bw, frame, scene.width, scene.height, phase,
+				  &scene.leds, &ob);
+		t1 = now();
+		latency_add(&detect, t1 - t0);
+
+		if (!ob)
+			continue;
+
+		/* Compare blob identification against the projected LEDs */
+		blobs += ob->num_blobs;
+		for (i = 0; i < ob->num_blobs; i++) {
+			struct blob *b = &ob->blobs[i];
+			int best = -1;
+			double best_dist = 1e9;
+
+			if (b->led_id < 0)
+				continue;
+			identified++;
+
+			for (j = 0; j < num; j++) {
+				double du = b->x - projections[j].u;
+				double dv = b->y - projections[j].v;
+
+				d = sqrt(du * du + dv * dv);
+				if (d < best_dist && d < projections[j].radius) {
+					best_dist = d;
+					best = projections[j].led_id;
+				}
+			}
+			if (best == b->led_id)
+				correct++;
+		}
+
+		t0 = now();
+		rot = (dquat){ 0.0, 0.0, 0.0, 0.0 };
+		trans = (dvec3){ 0.0, 0.0, 0.0 };
+		estimate_initial_pose(ob->blobs, ob->num_blobs,
+				      scene.leds.model.points,
+				      scene.leds.model.num_points,
+				      &scene.camera_matrix, scene.dist_coeffs,
+				      &rot, &trans, false);
+		t1 = now();
+
+		if (dquat_norm(&rot) < 0.5)
+			continue;
+
+		latency_add(&solve, t1 - t0);
+		frames_with_pose++;
+		trans_err += sqrt((trans.x - pose.translation.x) *
+				  (trans.x - pose.translation.x) +
+				  (trans.y - pose.translation.y) *
+				  (trans.y - pose.translation.y) +
+				  (trans.z - pose.translation.z) *
+				  (trans.z - pose.translation.z));
+		rot_err += dquat_angle(&rot, &pose.rotation);
+	}
+
+	printf("frames               %d (%.1f s at %d Hz, %dx%d)\n",
+	       num_frames, scene.duration, scene.framerate, scene.width,
+	       scene.height);
+	printf("LEDs                 %u, %.1f visible per frame\n",
+	       scene.leds.model.num_points,
+	       num_frames ? (double)visible / num_frames : 0.0);
+	printf("blobs                %.1f per frame, %.1f%% identified, "
+	       "%.1f%% of those correctly\n",
+	       num_frames ? (double)blobs / num_frames : 0.0,
+	       blobs ? 100.0 * identified / blobs : 0.0,
+	       identified ? 100.0 * correct / identified : 0.0);
+	if (frames_with_pose) {
+		printf("pose                 %d frames, mean error %.2f mm, "
+		       "%.3f°\n", frames_with_pose,
+		       1e3 * trans_err / frames_with_pose,
+		       180.0 / M_PI * rot_err / frames_with_pose);
+	} else {
+#if HAVE_OPENCV
+		printf("pose                 no estimates\n");
+#else
+		printf("pose                 no estimates, built without OpenCV\n");
+#endif
+	}
+	printf("imu                  %d samples, orientation drift %.3f°\n",
+	       num_imu, 180.0 / M_PI * dquat_angle(&imu_pose.rotation,
+						 &pose.rotation));
+	latency_print("render", &render);
+	latency_print("blob detection", &detect);
+	latency_print("pose estimation", &solve);
+
+	if (frames_file)
+		fclose(frames_file);
+	if (imu_file)
+		fclose(imu_file);
+	free(frame);
+	free(render.samples);
+	free(detect.samples);
+	free(solve.samples);
+	free(scene.keyframes);
+	free(scene.noise_table);
+	leds_fini(&scene.leds);
+
+	return 0;
+}
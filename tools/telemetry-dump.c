@@ -0,0 +1,126 @@
+/*
+ * Prints telemetry records received from ouvrtd
+ * Copyright 2019 Philipp Zabel
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+#include "telemetry-wire.h"
+
+static void print_record(void *data, const struct telemetry_record *record)
+{
+	const struct lighthouse_frame *frame;
+	const struct raw_imu_sample *raw;
+	const struct imu_sample *sample;
+	const struct dpose *pose;
+	int i;
+
+	(void)data;
+
+	printf("%u: ", record->dev_id);
+
+	switch (record->type) {
+	case TELEMETRY_PACKET_RAW_BUFFER:
+		printf("raw buffer, %zu bytes\n", record->raw_buffer.len);
+		break;
+	case TELEMETRY_PACKET_RAW_IMU_SAMPLE:
+		raw = &record->raw_imu_sample;
+		printf("raw imu %lu acc %d %d %d gyro %d %d %d\n",
+		       (unsigned long)raw->time, raw->acc[0], raw->acc[1],
+		       raw->acc[2], raw->gyro[0], raw->gyro[1], raw->gyro[2]);
+		break;
+	case TELEMETRY_PACKET_IMU_SAMPLE:
+		sample = &record->imu_sample;
+		printf("imu %.6f acc %f %f %f gyro %f %f %f\n", sample->time,
+		       sample->acceleration.x, sample->acceleration.y,
+		       sample->acceleration.z, sample->angular_velocity.x,
+		       sample->angular_velocity.y, sample->angular_velocity.z);
+		break;
+	case TELEMETRY_PACKET_POSE:
+		pose = &record->pose;
+		printf("pose %f %f %f %f %f %f %f\n", pose->rotation.x,
+		       pose->rotation.y, pose->rotation.z, pose->rotation.w,
+		       pose->translation.x, pose->translation.y,
+		       pose->translation.z);
+		break;
+	case TELEMETRY_PACKET_LIGHTHOUSE_FRAME:
+		frame = &record->lighthouse_frame;
+		printf("lighthouse %u sync 0x%x", frame->sync_timestamp,
+		       frame->sync_ids);
+		for (i = 0; i < 32; i++) {
+			if (frame->sweep_ids & (1U << i))
+				printf(" %d:%u/%u", i, frame->sweep_offset[i],
+				       frame->sweep_duration[i]);
+		}
+		printf("\n");
+		break;
+	case TELEMETRY_PACKET_BUTTONS:
+		printf("buttons");
+		for (i = 0; i < record->buttons.num; i++)
+			printf(" %u", record->buttons.buttons[i]);
+		printf("\n");
+		break;
+	case TELEMETRY_PACKET_AXIS:
+		printf("axis %d", record->axis.index);
+		for (i = 0; i < record->axis.num; i++)
+			printf(" %f", record->axis.axis[i]);
+		printf("\n");
+		break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(TELEMETRY_DEFAULT_PORT),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	uint8_t buf[65536];
+	ssize_t len;
+	int fd;
+	int ret;
+
+	(void)argc;
+	(void)argv;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (ret < 0) {
+		perror("bind");
+		close(fd);
+		return 1;
+	}
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("recv");
+			break;
+		}
+
+		ret = telemetry_wire_decode_datagram(buf, len, print_record,
+						     NULL);
+		if (ret < 0)
+			fprintf(stderr, "Invalid datagram: %s\n",
+				strerror(-ret));
+	}
+
+	close(fd);
+
+	return 0;
+}